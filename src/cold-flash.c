@@ -18,62 +18,59 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
 
 #include "global.h"
+#include "device.h"
 #include "cold-flash.h"
 #include "image.h"
 #include "usb-device.h"
 #include "printf-utils.h"
+#include "crc32.h"
+#include "usb-stats.h"
 
 #define READ_TIMEOUT		500
 #define WRITE_TIMEOUT		3000
 
-static uint32_t tab[256];
+/* Cold flash transfer profiles, selected by OMAP chip from ASIC ID */
+/* Image is sent in bulk transfers of given size, host controller splits them into packets */
+struct cold_flash_profile {
+	const char * chip;
+	const char * id;	/* 3 bytes - OMAP chip version in 1. ID Subblock */
+	uint32_t rom_transfer;	/* transfer size for 2nd X-Loader sent to OMAP Boot ROM */
+	uint32_t xloader_transfer;	/* transfer size for Secondary image sent to X-Loader */
+};
 
-static void crc32_gentab(void) {
-
-	int i, j;
-	uint32_t crc;
-	uint32_t poly = 0xEDB88320L;
-
-	for ( i = 0; i < 256; i++) {
-
-		crc = i;
-
-		for ( j = 8; j > 0; j-- ) {
-
-			if ( crc & 1 )
-				crc = (crc >> 1) ^ poly;
-			else
-				crc >>= 1;
-
-		}
-
-		tab[i] = crc;
-
-	}
-
-}
-
-static uint32_t crc32(unsigned char * bytes, size_t size, uint32_t crc) {
-
-	static int gen = 0;
-	uint32_t i;
-
-	if ( ! gen ) {
-		crc32_gentab();
-		gen = 1;
-	}
-
-	for ( i = 0; i < size; ++i )
-		crc = (crc >> 8) ^ tab[(crc ^ bytes[i]) & 0xff];
-
-	return crc;
-
-}
+/*
+ * Transfer sizes are not verified on hardware and no TRM or captured trace
+ * documents them. Boot ROM and X-Loader receive data as stream of 512 byte
+ * packets, so transfer size should not be visible to device, but if some chip
+ * fails with them, use old 1024 byte transfers of cold_flash_default_profile.
+ */
+static const struct cold_flash_profile cold_flash_profiles[] = {
+	{ "OMAP3430", "\x34\x30\x07", 4096, 16384 },
+	{ "OMAP3630", "\x36\x30\x07", 16384, 65536 },
+};
+
+/* ASIC ID fingerprints of known devices */
+/* Device is detected only when all matching fingerprints agree */
+struct cold_flash_fingerprint {
+	const char * id;	/* 3 bytes - OMAP chip version in 1. ID Subblock */
+	int revision;	/* OMAP chip revision, -1 for any */
+	const char * root_key_hash;	/* 20 bytes - Root Key Hash Subblock data, NULL for any */
+	enum device device;
+};
+
+static const struct cold_flash_fingerprint cold_flash_fingerprints[] = {
+	{ "\x34\x30\x07", -1, NULL, DEVICE_RX_51 },
+	/* N950 and N9 (both OMAP3630) are not listed, their root key hashes are not known yet */
+};
+
+/* Used when ASIC ID was not read, same as old fixed transfer size */
+static const struct cold_flash_profile cold_flash_default_profile = { NULL, NULL, 1024, 1024 };
 
 /* Omap Boot Messages */
 /* See spruf98v.pdf (page 3444): OMAP35x Technical Reference Manual - 25.4.5 Peripheral Booting */
@@ -156,23 +153,66 @@ struct xloader_msg xloader_msg_create(uint32_t type, struct image * image) {
 			ret = image_read(image, buffer, need);
 			if ( ret == 0 )
 				break;
-			msg.crc1 = crc32(buffer, ret, msg.crc1);
+			msg.crc1 = crc32(msg.crc1, buffer, ret);
 			sent += ret;
 		}
 	}
 
-	msg.crc2 = crc32((unsigned char *)&msg, 12, 0);
+	msg.crc2 = crc32(0, &msg, 12);
 
 	return msg;
 
 }
 
-static int read_asic(usb_dev_handle * udev, uint8_t * asic_buffer, int size, int asic_size) {
+static const char * cold_flash_phases[] = {
+	[COLD_FLASH_ASIC_ID] = "asic_id",
+	[COLD_FLASH_PERIPHERAL] = "peripheral_boot",
+	[COLD_FLASH_2ND_SIZE] = "2nd_size",
+	[COLD_FLASH_2ND] = "2nd",
+	[COLD_FLASH_SECONDARY_INIT] = "secondary_init",
+	[COLD_FLASH_SECONDARY] = "secondary",
+	[COLD_FLASH_PING] = "ping",
+	[COLD_FLASH_MEMORY_BOOT] = "memory_boot",
+};
+
+const char * cold_flash_phase_to_string(int phase) {
+
+	if ( phase < 0 || (size_t)phase >= sizeof(cold_flash_phases)/sizeof(cold_flash_phases[0]) )
+		return NULL;
+
+	return cold_flash_phases[phase];
+
+}
+
+static enum device asic_to_device(const uint8_t * asic_buffer) {
+
+	enum device device = DEVICE_UNKNOWN;
+	size_t i;
+
+	for ( i = 0; i < sizeof(cold_flash_fingerprints)/sizeof(cold_flash_fingerprints[0]); ++i ) {
+		const struct cold_flash_fingerprint * fingerprint = &cold_flash_fingerprints[i];
+		if ( memcmp(asic_buffer+4, fingerprint->id, 3) != 0 )
+			continue;
+		if ( fingerprint->revision >= 0 && fingerprint->revision != asic_buffer[7] )
+			continue;
+		if ( fingerprint->root_key_hash && memcmp(asic_buffer+38, fingerprint->root_key_hash, 20) != 0 )
+			continue;
+		if ( device != DEVICE_UNKNOWN && device != fingerprint->device )
+			return DEVICE_UNKNOWN;
+		device = fingerprint->device;
+	}
+
+	return device;
+
+}
+
+static int read_asic(struct usb_device_info * dev, uint8_t * asic_buffer, int size, int asic_size) {
 
 	int ret;
 
 	printf("Waiting for ASIC ID...\n");
-	ret = usb_bulk_read(udev, USB_READ_EP, (char *)asic_buffer, size, READ_TIMEOUT);
+	dev->stats_request = COLD_FLASH_ASIC_ID;
+	ret = usb_device_bulk_read(dev, USB_READ_EP, (char *)asic_buffer, size, READ_TIMEOUT);
 	if ( ret != asic_size )
 		ERROR_RETURN("Invalid size of ASIC ID", -1);
 
@@ -180,88 +220,114 @@ static int read_asic(usb_dev_handle * udev, uint8_t * asic_buffer, int size, int
 
 }
 
-static int send_2nd(usb_dev_handle * udev, struct image * image) {
+/* Read whole image to memory first, so all transfers can be queued at once */
+static int send_image(struct usb_device_info * dev, struct image * image, uint32_t transfer) {
 
-	uint8_t buffer[1024];
+	uint8_t * buffer;
 	uint32_t need, sent;
 	int ret;
 
+	buffer = malloc(image->size);
+	if ( ! buffer )
+		ALLOC_ERROR_RETURN(-1);
+
+	image_seek(image, 0);
+	sent = 0;
+	while ( sent < image->size ) {
+		ret = image_read(image, buffer + sent, image->size - sent);
+		if ( ret == 0 )
+			break;
+		sent += ret;
+	}
+
+	if ( sent != image->size ) {
+		free(buffer);
+		ERROR_RETURN("Cannot read image", -1);
+	}
+
+	printf_progressbar(0, image->size);
+	sent = 0;
+	while ( sent < image->size ) {
+		need = image->size - sent;
+		if ( need > transfer )
+			need = transfer;
+		if ( usb_device_bulk_submit(dev, USB_WRITE_EP, (char *)buffer + sent, need, WRITE_TIMEOUT) != 0 ) {
+			usb_device_bulk_flush(dev);
+			free(buffer);
+			PRINTF_ERROR_RETURN("Bulk write failed", -1);
+		}
+		sent += need;
+		printf_progressbar(sent, image->size);
+	}
+
+	ret = usb_device_bulk_flush(dev);
+	free(buffer);
+
+	if ( ret != 0 )
+		ERROR_RETURN("Bulk write failed", -1);
+
+	return 0;
+
+}
+
+static int send_2nd(struct usb_device_info * dev, struct image * image, const struct cold_flash_profile * profile) {
+
+	int ret;
+
 	printf("Sending OMAP peripheral boot message...\n");
-	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)&omap_peripheral_msg, sizeof(omap_peripheral_msg), WRITE_TIMEOUT);
+	dev->stats_request = COLD_FLASH_PERIPHERAL;
+	ret = usb_device_bulk_write(dev, USB_WRITE_EP, (char *)&omap_peripheral_msg, sizeof(omap_peripheral_msg), WRITE_TIMEOUT);
 	if ( ret != sizeof(omap_peripheral_msg) )
 		ERROR_RETURN("Sending OMAP peripheral boot message failed", -1);
 
 	MSLEEP(5);
 
 	printf("Sending 2nd X-Loader image size...\n");
-	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)&image->size, 4, WRITE_TIMEOUT);
+	dev->stats_request = COLD_FLASH_2ND_SIZE;
+	ret = usb_device_bulk_write(dev, USB_WRITE_EP, (char *)&image->size, 4, WRITE_TIMEOUT);
 	if ( ret != 4 )
 		ERROR_RETURN("Sending 2nd X-Loader image size failed", -1);
 
 	MSLEEP(5);
 
 	printf("Sending 2nd X-Loader image...\n");
-	printf_progressbar(0, image->size);
-	image_seek(image, 0);
-	sent = 0;
-	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(buffer) )
-			need = sizeof(buffer);
-		ret = image_read(image, buffer, need);
-		if ( ret == 0 )
-			break;
-		if ( usb_bulk_write(udev, USB_WRITE_EP, (char *)buffer, ret, WRITE_TIMEOUT) != ret )
-			PRINTF_ERROR_RETURN("Sending 2nd X-Loader image failed", -1);
-		sent += ret;
-		printf_progressbar(sent, image->size);
-	}
+	dev->stats_request = COLD_FLASH_2ND;
+	if ( send_image(dev, image, profile->rom_transfer) != 0 )
+		ERROR_RETURN("Sending 2nd X-Loader image failed", -1);
 
 	MSLEEP(50);
 	return 0;
 
 }
 
-static int send_secondary(usb_dev_handle * udev, struct image * image) {
+static int send_secondary(struct usb_device_info * dev, struct image * image, const struct cold_flash_profile * profile) {
 
 	struct xloader_msg init_msg;
-	uint8_t buffer[1024];
-	uint32_t need, sent;
+	uint8_t buffer[4];
 	int ret;
 
 	init_msg = xloader_msg_create(XLOADER_MSG_TYPE_SEND, image);
 
 	printf("Sending X-Loader init message...\n");
-	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)&init_msg, sizeof(init_msg), WRITE_TIMEOUT);
+	dev->stats_request = COLD_FLASH_SECONDARY_INIT;
+	ret = usb_device_bulk_write(dev, USB_WRITE_EP, (char *)&init_msg, sizeof(init_msg), WRITE_TIMEOUT);
 	if ( ret != sizeof(init_msg) )
 		ERROR_RETURN("Sending X-Loader init message failed", -1);
 
 	printf("Waiting for X-Loader response...\n");
 	MSLEEP(5);
-	ret = usb_bulk_read(udev, USB_READ_EP, (char *)&buffer, 4, READ_TIMEOUT); /* 4 bytes - dummy value */
+	ret = usb_device_bulk_read(dev, USB_READ_EP, (char *)&buffer, 4, READ_TIMEOUT); /* 4 bytes - dummy value */
 	if ( ret != 4 )
 		ERROR_RETURN("No response", -1);
 
 	printf("Sending Secondary image...\n");
-	printf_progressbar(0, image->size);
-	image_seek(image, 0);
-	sent = 0;
-	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(buffer) )
-			need = sizeof(buffer);
-		ret = image_read(image, buffer, need);
-		if ( ret == 0 )
-			break;
-		if ( usb_bulk_write(udev, USB_WRITE_EP, (char *)buffer, ret, WRITE_TIMEOUT) != ret )
-			PRINTF_ERROR_RETURN("Sending Secondary image failed", -1);
-		sent += ret;
-		printf_progressbar(sent, image->size);
-	}
+	dev->stats_request = COLD_FLASH_SECONDARY;
+	if ( send_image(dev, image, profile->xloader_transfer) != 0 )
+		ERROR_RETURN("Sending Secondary image failed", -1);
 
 	printf("Waiting for X-Loader response...\n");
 	MSLEEP(5);
-	ret = usb_bulk_read(udev, USB_READ_EP, (char *)&buffer, 4, READ_TIMEOUT); /* 4 bytes - dummy value */
+	ret = usb_device_bulk_read(dev, USB_READ_EP, (char *)&buffer, 4, READ_TIMEOUT); /* 4 bytes - dummy value */
 	if ( ret != 4 )
 		ERROR_RETURN("No response", -1);
 
@@ -269,19 +335,21 @@ static int send_secondary(usb_dev_handle * udev, struct image * image) {
 
 }
 
-static int ping_timeout(usb_dev_handle * udev) {
+static int ping_timeout(struct usb_device_info * dev) {
 
 	int ret;
 	int pong = 0;
 	int try_ping = 10;
 
+	dev->stats_request = COLD_FLASH_PING;
+
 	while ( try_ping > 0 ) {
 
 		struct xloader_msg ping_msg = xloader_msg_create(XLOADER_MSG_TYPE_PING, NULL);
 		int try_read = 4;
 
 		printf("Sending X-Loader ping message\n");
-		ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)&ping_msg, sizeof(ping_msg), WRITE_TIMEOUT);
+		ret = usb_device_bulk_write(dev, USB_WRITE_EP, (char *)&ping_msg, sizeof(ping_msg), WRITE_TIMEOUT);
 		if ( ret != sizeof(ping_msg) )
 			ERROR_RETURN("Sending X-Loader ping message failed", -1);
 
@@ -289,7 +357,7 @@ static int ping_timeout(usb_dev_handle * udev) {
 		while ( try_read > 0 ) {
 
 			uint32_t ping_read;
-			ret = usb_bulk_read(udev, USB_READ_EP, (char *)&ping_read, sizeof(ping_read), READ_TIMEOUT);
+			ret = usb_device_bulk_read(dev, USB_READ_EP, (char *)&ping_read, sizeof(ping_read), READ_TIMEOUT);
 			if ( ret == sizeof(ping_read) ) {
 				printf("Got it\n");
 				pong = 1;
@@ -298,6 +366,7 @@ static int ping_timeout(usb_dev_handle * udev) {
 
 			MSLEEP(5);
 			--try_read;
+			usb_stats_retry(dev, USB_STATS_BULK_READ);
 
 		}
 
@@ -306,6 +375,7 @@ static int ping_timeout(usb_dev_handle * udev) {
 
 		printf("Response timeout\n");
 		--try_ping;
+		usb_stats_retry(dev, USB_STATS_BULK_WRITE);
 
 	}
 
@@ -320,14 +390,15 @@ int init_cold_flash(struct usb_device_info * dev) {
 
 	uint8_t asic_buffer[127];
 	int asic_size = 69;
-	const char * chip = NULL;
+	const struct cold_flash_profile * profile = NULL;
+	enum device device;
 	int revision;
 	int i;
 
 	if ( dev->flash_device->protocol != FLASH_COLD )
 		ERROR_RETURN("Device is not in Cold Flash mode", -1);
 
-	if ( read_asic(dev->udev, asic_buffer, sizeof(asic_buffer), asic_size) != 0 )
+	if ( read_asic(dev, asic_buffer, sizeof(asic_buffer), asic_size) != 0 )
 		ERROR_RETURN("Reading ASIC ID failed", -1);
 
 	if ( verbose ) {
@@ -337,8 +408,6 @@ int init_cold_flash(struct usb_device_info * dev) {
 		printf("\n");
 	}
 
-	/* TODO: Detect device from asic id */
-
 	/* ASIC ID specification: http://processors.wiki.ti.com/index.php/OMAP35x_and_AM/DM37x_Initialization#UART.2FUSB_Booting */
 
 	/* Number of subblocks */
@@ -350,11 +419,14 @@ int init_cold_flash(struct usb_device_info * dev) {
 		ERROR_RETURN("Invalid ASIC ID", -1);
 
 	/* 1. ID Subblock - OMAP chip version (check for OMAP3430 or 3630) */
-	if ( memcmp(asic_buffer+4, "\x34\x30\x07", 3) == 0 )
-		chip = "OMAP3430";
-	else if ( memcmp(asic_buffer+4, "\x36\x30\x07", 3) == 0 )
-		chip = "OMAP3630";
-	else
+	for ( i = 0; i < (int)(sizeof(cold_flash_profiles)/sizeof(cold_flash_profiles[0])); ++i ) {
+		if ( memcmp(asic_buffer+4, cold_flash_profiles[i].id, 3) == 0 ) {
+			profile = &cold_flash_profiles[i];
+			break;
+		}
+	}
+
+	if ( ! profile )
 		ERROR_RETURN("Invalid ASIC ID", -1);
 
 	/* 1. ID Subblock - OMAP chip revision */
@@ -376,7 +448,15 @@ int init_cold_flash(struct usb_device_info * dev) {
 	if ( memcmp(asic_buffer+58, "\x15\x09\x01", 3) != 0 )
 		ERROR_RETURN("Invalid ASIC ID", -1);
 
-	printf("Detected %s chip (revision %d)\n", chip, revision);
+	printf("Detected %s chip (revision %d)\n", profile->chip, revision);
+
+	device = asic_to_device(asic_buffer);
+	if ( device != DEVICE_UNKNOWN ) {
+		printf("Detected device: %s\n", device_to_string(device));
+		dev->device = device;
+	}
+
+	dev->cold_flash_profile = profile;
 
 	return 0;
 
@@ -384,19 +464,24 @@ int init_cold_flash(struct usb_device_info * dev) {
 
 int cold_flash(struct usb_device_info * dev, struct image * x2nd, struct image * secondary) {
 
+	const struct cold_flash_profile * profile = dev->cold_flash_profile;
+
+	if ( ! profile )
+		profile = &cold_flash_default_profile;
+
 	if ( x2nd->type != IMAGE_2ND )
 		ERROR_RETURN("Image type is not 2nd X-Loader", -1);
 
 	if ( secondary->type != IMAGE_SECONDARY )
 		ERROR_RETURN("Image type is not Secondary", -1);
 
-	if ( send_2nd(dev->udev, x2nd) != 0 )
+	if ( send_2nd(dev, x2nd, profile) != 0 )
 		ERROR_RETURN("Sending 2nd X-Loader image failed", -1);
 
-	if ( ping_timeout(dev->udev) != 0 )
+	if ( ping_timeout(dev) != 0 )
 		ERROR_RETURN("Sending X-Loader ping message failed", -1);
 
-	if ( send_secondary(dev->udev, secondary) != 0 )
+	if ( send_secondary(dev, secondary, profile) != 0 )
 		ERROR_RETURN("Sending Secondary image failed", -1);
 
 	printf("Done\n");
@@ -409,11 +494,13 @@ int leave_cold_flash(struct usb_device_info * dev) {
 	int ret;
 
 	printf("Sending OMAP memory boot message...\n");
-	ret = usb_bulk_write(dev->udev, USB_WRITE_EP, (char *)&omap_memory_msg, sizeof(omap_memory_msg), WRITE_TIMEOUT);
+	dev->stats_request = COLD_FLASH_MEMORY_BOOT;
+	ret = usb_device_bulk_write(dev, USB_WRITE_EP, (char *)&omap_memory_msg, sizeof(omap_memory_msg), WRITE_TIMEOUT);
 	if ( ret != sizeof(omap_memory_msg) )
 		ERROR_RETURN("Sending OMAP memory boot message failed", -1);
 
-	MSLEEP(250);
+	/* Do not find device in Cold Flash mode again before it boots */
+	usb_wait_for_disconnect(dev, 250);
 	return 0;
 
 }
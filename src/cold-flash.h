@@ -23,6 +23,20 @@
 #include "image.h"
 #include "usb-device.h"
 
+/* Phases of Cold Flash protocol, used as request in USB statistics */
+enum cold_flash_phase {
+	COLD_FLASH_ASIC_ID = 1,
+	COLD_FLASH_PERIPHERAL,
+	COLD_FLASH_2ND_SIZE,
+	COLD_FLASH_2ND,
+	COLD_FLASH_SECONDARY_INIT,
+	COLD_FLASH_SECONDARY,
+	COLD_FLASH_PING,
+	COLD_FLASH_MEMORY_BOOT,
+};
+
+const char * cold_flash_phase_to_string(int phase);
+
 /* Initialize Cold Flash mde */
 int init_cold_flash(struct usb_device_info * dev);
 
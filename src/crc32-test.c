@@ -0,0 +1,169 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Compares crc32() and table only crc32_slice8() with old bytewise implementation on random data and measures throughput of all */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define TEST_BUFFER	(1024 * 1024)
+#define TEST_ROUNDS	100000
+#define TEST_LARGE	(4 * 1024 * 1024 + 13)
+#define BENCH_SIZE	(64 * 1024 * 1024)
+
+/* Bitwise implementation previously used in cal.c */
+static uint32_t crc32_bitwise(uint32_t crc, const void * _data, size_t size) {
+
+	const uint8_t * data = _data;
+	uint8_t value;
+	unsigned int bit;
+	size_t i;
+	const uint32_t poly = 0xEDB88320;
+
+	for ( i = 0; i < size; i++ ) {
+		value = data[i];
+		for ( bit = 8; bit; bit-- ) {
+			if ( (crc & 1) != (value & 1) )
+				crc = (crc >> 1) ^ poly;
+			else
+				crc >>= 1;
+			value >>= 1;
+		}
+	}
+
+	return crc;
+
+}
+
+static uint32_t test_random(void) {
+
+	/* xorshift32, results must not depend on libc rand() */
+	static uint32_t state = 0x12345678;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+
+}
+
+static double test_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+static double test_bench(uint32_t (*func)(uint32_t, const void *, size_t), const uint8_t * data, size_t size, uint32_t * crc) {
+
+	double start = test_now();
+	double end;
+	size_t done = 0;
+
+	/* Run at least 0.2 s for stable results */
+	do {
+		*crc = func(*crc, data, size);
+		done += size;
+		end = test_now();
+	} while ( end - start < 0.2 );
+
+	return done / ( end - start ) / ( 1024 * 1024 );
+
+}
+
+int main(void) {
+
+	uint8_t * data;
+	uint32_t seed, crc1, crc2, crc3;
+	size_t offset, size, split;
+	double fast, table, slow;
+	int failed = 0;
+	int i;
+
+	data = malloc(BENCH_SIZE);
+	if ( ! data ) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return 1;
+	}
+
+	for ( i = 0; i < BENCH_SIZE; ++i )
+		data[i] = test_random();
+
+	/* Random alignments, lengths (mostly short to cover all tails) and initial values */
+	for ( i = 0; i < TEST_ROUNDS; ++i ) {
+		offset = test_random() % 64;
+		if ( i % 1000 == 0 )
+			size = test_random() % ( TEST_BUFFER - 64 );
+		else
+			size = test_random() % 1024;
+		seed = ( i % 3 == 0 ) ? 0xFFFFFFFF : ( i % 3 == 1 ) ? 0 : test_random();
+		crc2 = crc32_bitwise(seed, data + offset, size);
+		crc1 = crc32(seed, data + offset, size);
+		if ( crc1 != crc2 ) {
+			fprintf(stderr, "CRC32 mismatch: offset %lu, size %lu, seed 0x%08lx: 0x%08lx != 0x%08lx\n", (unsigned long int)offset, (unsigned long int)size, (unsigned long int)seed, (unsigned long int)crc1, (unsigned long int)crc2);
+			failed = 1;
+			break;
+		}
+		/* Hardware accelerated crc32() uses tables only for short tails */
+		crc1 = crc32_slice8(seed, data + offset, size);
+		if ( crc1 != crc2 ) {
+			fprintf(stderr, "CRC32 table mismatch: offset %lu, size %lu, seed 0x%08lx: 0x%08lx != 0x%08lx\n", (unsigned long int)offset, (unsigned long int)size, (unsigned long int)seed, (unsigned long int)crc1, (unsigned long int)crc2);
+			failed = 1;
+			break;
+		}
+		/* Computing in two parts must give same result */
+		split = size ? test_random() % size : 0;
+		crc1 = crc32(crc32(seed, data + offset, split), data + offset + split, size - split);
+		if ( crc1 != crc2 ) {
+			fprintf(stderr, "CRC32 mismatch: offset %lu, size %lu split at %lu, seed 0x%08lx: 0x%08lx != 0x%08lx\n", (unsigned long int)offset, (unsigned long int)size, (unsigned long int)split, (unsigned long int)seed, (unsigned long int)crc1, (unsigned long int)crc2);
+			failed = 1;
+			break;
+		}
+	}
+
+	/* Large buffers from every unaligned start */
+	for ( offset = 0; offset < 16 && ! failed; ++offset ) {
+		crc3 = crc32_bitwise(0xFFFFFFFF, data + offset, TEST_LARGE);
+		crc1 = crc32_slice8(0xFFFFFFFF, data + offset, TEST_LARGE);
+		crc2 = crc32(0xFFFFFFFF, data + offset, TEST_LARGE);
+		if ( crc1 != crc3 || crc2 != crc3 ) {
+			fprintf(stderr, "CRC32 mismatch of large buffer: offset %lu: tables 0x%08lx, crc32 0x%08lx, bytewise 0x%08lx\n", (unsigned long int)offset, (unsigned long int)crc1, (unsigned long int)crc2, (unsigned long int)crc3);
+			failed = 1;
+		}
+	}
+
+	if ( ! failed )
+		printf("CRC32: %d random and 16 large buffers match bytewise implementation\n", TEST_ROUNDS);
+
+	crc1 = crc2 = crc3 = 0;
+	fast = test_bench(crc32, data, BENCH_SIZE, &crc1);
+	table = test_bench(crc32_slice8, data, BENCH_SIZE, &crc3);
+	slow = test_bench(crc32_bitwise, data, TEST_BUFFER, &crc2);
+	printf("CRC32 throughput: %.0f MB/s, tables %.0f MB/s, bytewise %.0f MB/s (%.1fx)\n", fast, table, slow, fast / slow);
+
+	free(data);
+	return failed;
+
+}
@@ -0,0 +1,223 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crc32.h"
+#include "crc32-table.h"
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define CRC32_ARM
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+uint32_t crc32_slice8(uint32_t crc, const void * bytes, size_t size) {
+
+	const uint8_t * data = bytes;
+	uint32_t one, two;
+
+	while ( size >= 8 ) {
+		one = crc ^ ( (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24 );
+		two = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = crc32_tab[7][one & 0xff] ^ crc32_tab[6][(one >> 8) & 0xff] ^
+		      crc32_tab[5][(one >> 16) & 0xff] ^ crc32_tab[4][one >> 24] ^
+		      crc32_tab[3][two & 0xff] ^ crc32_tab[2][(two >> 8) & 0xff] ^
+		      crc32_tab[1][(two >> 16) & 0xff] ^ crc32_tab[0][two >> 24];
+		data += 8;
+		size -= 8;
+	}
+
+	while ( size-- )
+		crc = ( crc >> 8 ) ^ crc32_tab[0][(crc ^ *data++) & 0xff];
+
+	return crc;
+
+}
+
+#ifdef CRC32_PCLMUL
+
+/* Folding with carry-less multiplication, see Intel paper "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" */
+/* Size must be at least 64 bytes and multiple of 16 bytes */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t * data, size_t size) {
+
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+
+	data += 64;
+	size -= 64;
+
+	/* Fold 512 bits at once */
+	while ( size >= 64 ) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+		data += 64;
+		size -= 64;
+	}
+
+	/* Fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold remaining 128 bit blocks */
+	while ( size >= 16 ) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)), x5);
+		data += 16;
+		size -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+
+}
+
+#endif
+
+#ifdef CRC32_ARM
+
+__attribute__((target("+crc")))
+static uint32_t crc32_arm(uint32_t crc, const uint8_t * data, size_t size) {
+
+	uint64_t value;
+
+	while ( size >= 8 ) {
+		value = (uint64_t)data[0] | (uint64_t)data[1] << 8 | (uint64_t)data[2] << 16 | (uint64_t)data[3] << 24 |
+		        (uint64_t)data[4] << 32 | (uint64_t)data[5] << 40 | (uint64_t)data[6] << 48 | (uint64_t)data[7] << 56;
+		crc = __crc32d(crc, value);
+		data += 8;
+		size -= 8;
+	}
+
+	while ( size-- )
+		crc = __crc32b(crc, *data++);
+
+	return crc;
+
+}
+
+#endif
+
+/* -1 unknown, 0 table only, 1 hardware accelerated */
+static int crc32_hw = -1;
+
+static int crc32_hw_detect(void) {
+
+#if defined(CRC32_PCLMUL)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#elif defined(CRC32_ARM)
+	return ( getauxval(AT_HWCAP) & HWCAP_CRC32 ) ? 1 : 0;
+#else
+	return 0;
+#endif
+
+}
+
+uint32_t crc32(uint32_t crc, const void * data, size_t size) {
+
+	const uint8_t * bytes = data;
+	int hw;
+
+	/* Detection can run in more threads at once, all of them store same value */
+	hw = __atomic_load_n(&crc32_hw, __ATOMIC_RELAXED);
+	if ( hw < 0 ) {
+		hw = crc32_hw_detect();
+		__atomic_store_n(&crc32_hw, hw, __ATOMIC_RELAXED);
+	}
+
+	if ( ! hw )
+		return crc32_slice8(crc, bytes, size);
+
+#if defined(CRC32_PCLMUL)
+	if ( size >= 64 ) {
+		size_t len = size & ~(size_t)15;
+		crc = crc32_pclmul(crc, bytes, len);
+		bytes += len;
+		size -= len;
+	}
+	return crc32_slice8(crc, bytes, size);
+#elif defined(CRC32_ARM)
+	return crc32_arm(crc, bytes, size);
+#else
+	return crc32_slice8(crc, bytes, size);
+#endif
+
+}
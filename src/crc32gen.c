@@ -0,0 +1,59 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Host tool which generates slicing-by-8 tables for crc32.c */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CRC32_POLY 0xEDB88320
+
+int main() {
+
+	uint32_t tab[8][256];
+	uint32_t crc;
+	int i, j;
+
+	for ( i = 0; i < 256; i++ ) {
+		crc = i;
+		for ( j = 0; j < 8; j++ )
+			crc = ( crc & 1 ) ? ( crc >> 1 ) ^ CRC32_POLY : crc >> 1;
+		tab[0][i] = crc;
+	}
+
+	for ( i = 0; i < 256; i++ )
+		for ( j = 1; j < 8; j++ )
+			tab[j][i] = ( tab[j-1][i] >> 8 ) ^ tab[0][tab[j-1][i] & 0xff];
+
+	puts("/* Generated by crc32gen, do not edit */");
+	puts("");
+	puts("static const uint32_t crc32_tab[8][256] = {");
+
+	for ( j = 0; j < 8; j++ ) {
+		puts("\t{");
+		for ( i = 0; i < 256; i++ )
+			printf("%s0x%08lx%s", ( i % 6 == 0 ) ? "\t\t" : " ", (unsigned long int)tab[j][i], ( i == 255 ) ? "\n" : ( i % 6 == 5 ) ? ",\n" : ",");
+		printf("\t}%s\n", ( j == 7 ) ? "" : ",");
+	}
+
+	puts("};");
+
+	return 0;
+
+}
@@ -16,10 +16,20 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* Enable O_DIRECT for glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <fcntl.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -30,7 +40,6 @@
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <dirent.h>
-#include <errno.h>
 #endif
 
 #include "disk.h"
@@ -39,8 +48,375 @@
 #include "device.h"
 #include "usb-device.h"
 #include "printf-utils.h"
+#include "sha256.h"
+#ifdef WITH_ZSTD
+#include "zstd-seekable.h"
+#endif
+
+#define DISK_BUF_SIZE	(1UL << 22) /* 4MB */
+#define DISK_BUFFERS	4	/* number of chunks queued for writer thread */
+#define DISK_ALIGN	4096	/* alignment of buffers for O_DIRECT */
+#define DISK_BLOCKS	64	/* chunk is divided into blocks which are written only when changed, see disk_compare */
+#define DISK_BLOCK_SIZE	(DISK_BUF_SIZE / DISK_BLOCKS)
+#define DISK_ALL_BLOCKS	(~(uint64_t)0)
+#define DISK_HASH_BLOCK	(1UL << 20)	/* 1MB block of incremental dump manifest */
+#define DISK_HASH_THREADS	8
+#define DISK_MANIFEST_HEADER	"0xFFFF block hash manifest"
+
+int disk_compare;
+int disk_sparse;
+int disk_zstd;
+const char * disk_manifest;
+int disk_verify;
+
+/*
+ * Image is read in main thread and written by writer thread, so reading of
+ * next chunk overlaps with writing of previous ones. Block device is written
+ * with O_DIRECT (if possible) so eMMC data do not fill page cache, every
+ * write is large enough to keep more requests in flight in block layer.
+ */
+struct disk_writer {
+	int fd;
+	int flags;	/* original file status flags of fd */
+	int direct;	/* fd is in O_DIRECT mode */
+	int sector;	/* logical sector size, O_DIRECT writes must be multiple of it */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char * buffers[DISK_BUFFERS];
+	size_t sizes[DISK_BUFFERS];
+	uint64_t offsets[DISK_BUFFERS];
+	uint64_t masks[DISK_BUFFERS];	/* blocks of chunk which are written */
+	uint64_t zeros[DISK_BUFFERS];	/* blocks of chunk which contain only zeros */
+	unsigned long int zero_ioctl;	/* BLKZEROOUT or BLKDISCARD when device returns zeros after it, 0 for none */
+	const char * zero_name;
+	uint64_t written;	/* number of written bytes */
+	uint64_t zeroed;	/* number of bytes zeroed by zero_ioctl */
+	int first;	/* oldest queued chunk */
+	int count;	/* number of queued chunks */
+	int stop;
+	int error;	/* errno of first failed write */
+	uint64_t error_offset;
+};
+
+static void disk_writer_direct(struct disk_writer * writer, int enable) {
+
+#ifdef O_DIRECT
+	if ( enable == writer->direct )
+		return;
+	if ( fcntl(writer->fd, F_SETFL, enable ? ( writer->flags | O_DIRECT ) : writer->flags) == 0 )
+		writer->direct = enable;
+#else
+	(void)writer;
+	(void)enable;
+#endif
+
+}
+
+static int disk_writer_write(struct disk_writer * writer, const char * buf, size_t size, uint64_t offset) {
+
+	ssize_t ret;
+
+	/* Unaligned tail of image cannot be written with O_DIRECT */
+	if ( writer->direct && size % writer->sector != 0 )
+		disk_writer_direct(writer, 0);
+
+	while ( size > 0 ) {
+		ret = pwrite(writer->fd, buf, size, offset);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret < 0 && errno == EINVAL && writer->direct ) {
+			/* Device does not support O_DIRECT with our alignment */
+			disk_writer_direct(writer, 0);
+			continue;
+		}
+		if ( ret <= 0 ) {
+			if ( ret == 0 )
+				errno = EIO;
+			writer->error_offset = offset;
+			return -1;
+		}
+		buf += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+
+}
+
+#ifdef __linux__
+
+static long long int disk_queue_value(int fd, const char * name) {
+
+	char path[256];
+	struct stat st;
+	long long int value;
+	FILE * file;
+
+	if ( fstat(fd, &st) != 0 || ! S_ISBLK(st.st_mode) )
+		return -1;
+
+	/* Partition does not have own queue directory */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(st.st_rdev), minor(st.st_rdev), name);
+	file = fopen(path, "r");
+	if ( ! file ) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s", major(st.st_rdev), minor(st.st_rdev), name);
+		file = fopen(path, "r");
+	}
+	if ( ! file )
+		return -1;
+
+	if ( fscanf(file, "%lld", &value) != 1 )
+		value = -1;
+
+	fclose(file);
+	return value;
+
+}
+
+#endif
+
+/* Select how zero blocks are written without transferring them, device must return zeros after it */
+static void disk_writer_zero_method(struct disk_writer * writer) {
+
+#if defined(__linux__) && defined(BLKZEROOUT) && defined(BLKDISCARD)
+	if ( disk_queue_value(writer->fd, "write_zeroes_max_bytes") > 0 ) {
+		writer->zero_ioctl = BLKZEROOUT;
+		writer->zero_name = "BLKZEROOUT";
+	} else if ( disk_queue_value(writer->fd, "discard_zeroes_data") == 1 && disk_queue_value(writer->fd, "discard_max_bytes") > 0 ) {
+		writer->zero_ioctl = BLKDISCARD;
+		writer->zero_name = "BLKDISCARD";
+	}
+#else
+	(void)writer;
+#endif
+
+}
+
+static int disk_writer_zero(struct disk_writer * writer, size_t size, uint64_t offset) {
+
+	uint64_t range[2] = { offset, size };
+
+	if ( ! writer->zero_ioctl )
+		return -1;
+
+#ifdef __linux__
+	/* When device rejects it, zero blocks are written normally */
+	if ( ioctl(writer->fd, writer->zero_ioctl, range) == 0 )
+		return 0;
+#else
+	(void)range;
+#endif
+
+	writer->zero_ioctl = 0;
+	return -1;
+
+}
+
+/* Write every run of consecutive blocks selected by mask of chunk, runs of zero blocks are zeroed by ioctl */
+static void disk_writer_chunk(struct disk_writer * writer, int cur) {
+
+	uint64_t mask = writer->masks[cur];
+	uint64_t zeros = writer->zeros[cur];
+	uint64_t bit;
+	size_t start;
+	size_t end;
+	int block = 0;
+	int zero;
+
+	while ( block < DISK_BLOCKS ) {
+
+		bit = (uint64_t)1 << block;
+		if ( ! ( mask & bit ) ) {
+			++block;
+			continue;
+		}
+
+		zero = ( zeros & bit ) != 0;
+		start = block * DISK_BLOCK_SIZE;
+		/* Check bound before shifting, shift by DISK_BLOCKS bits is undefined */
+		for ( ++block; block < DISK_BLOCKS; ++block ) {
+			bit = (uint64_t)1 << block;
+			if ( ! ( mask & bit ) || ( ( zeros & bit ) != 0 ) != zero )
+				break;
+		}
+		end = block * DISK_BLOCK_SIZE;
+
+		if ( start >= writer->sizes[cur] )
+			break;
+		if ( end > writer->sizes[cur] )
+			end = writer->sizes[cur];
+
+		if ( simulate )
+			continue;
+
+		if ( zero && disk_writer_zero(writer, end - start, writer->offsets[cur] + start) == 0 ) {
+			writer->zeroed += end - start;
+			continue;
+		}
+
+		if ( disk_writer_write(writer, writer->buffers[cur] + start, end - start, writer->offsets[cur] + start) != 0 ) {
+			/* Main thread reads error in disk_writer_queue() */
+			pthread_mutex_lock(&writer->lock);
+			writer->error = errno;
+			pthread_mutex_unlock(&writer->lock);
+			return;
+		}
+
+		writer->written += end - start;
+
+	}
+
+}
+
+static void * disk_writer_thread(void * data) {
+
+	struct disk_writer * writer = data;
+	int error;
+	int cur;
+
+	pthread_mutex_lock(&writer->lock);
+
+	while ( 1 ) {
+
+		while ( writer->count == 0 && ! writer->stop )
+			pthread_cond_wait(&writer->cond, &writer->lock);
+
+		if ( writer->count == 0 )
+			break;
+
+		cur = writer->first;
+		error = writer->error;
+		pthread_mutex_unlock(&writer->lock);
+
+		/* After error queued chunks are only dropped, main thread stops reading */
+		if ( ! error )
+			disk_writer_chunk(writer, cur);
+
+		pthread_mutex_lock(&writer->lock);
+		writer->first = ( writer->first + 1 ) % DISK_BUFFERS;
+		writer->count--;
+		pthread_cond_broadcast(&writer->cond);
+
+	}
+
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+
+}
+
+static int disk_writer_start(struct disk_writer * writer, int fd) {
+
+	int i;
+
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = fd;
+	writer->sector = 512;
+
+#ifdef BLKSSZGET
+	if ( ioctl(fd, BLKSSZGET, &writer->sector) != 0 || writer->sector <= 0 || DISK_ALIGN % writer->sector != 0 )
+		writer->sector = DISK_ALIGN;
+#endif
+
+	for ( i = 0; i < DISK_BUFFERS; ++i ) {
+		if ( posix_memalign((void **)&writer->buffers[i], DISK_ALIGN, DISK_BUF_SIZE) != 0 ) {
+			writer->buffers[i] = NULL;
+			while ( i-- > 0 )
+				free(writer->buffers[i]);
+			ALLOC_ERROR_RETURN(-1);
+		}
+	}
+
+	writer->flags = fcntl(fd, F_GETFL);
+	if ( writer->flags != -1 && ! simulate )
+		disk_writer_direct(writer, 1);
+
+	disk_writer_zero_method(writer);
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	if ( pthread_create(&writer->thread, NULL, disk_writer_thread, writer) != 0 ) {
+		ERROR("Cannot create writer thread");
+		pthread_cond_destroy(&writer->cond);
+		pthread_mutex_destroy(&writer->lock);
+		disk_writer_direct(writer, 0);
+		for ( i = 0; i < DISK_BUFFERS; ++i )
+			free(writer->buffers[i]);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/* Returns free buffer for next chunk, waits until some queued chunk is written */
+static char * disk_writer_buffer(struct disk_writer * writer) {
+
+	char * buf;
+
+	pthread_mutex_lock(&writer->lock);
+	while ( writer->count == DISK_BUFFERS )
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	buf = writer->buffers[( writer->first + writer->count ) % DISK_BUFFERS];
+	pthread_mutex_unlock(&writer->lock);
+
+	return buf;
+
+}
+
+/* Queue buffer returned by disk_writer_buffer(), only blocks in mask are written, returns -1 when some previous write failed */
+static int disk_writer_queue(struct disk_writer * writer, size_t size, uint64_t offset, uint64_t mask, uint64_t zeros) {
+
+	int cur;
+	int ret;
+
+	pthread_mutex_lock(&writer->lock);
+	cur = ( writer->first + writer->count ) % DISK_BUFFERS;
+	writer->sizes[cur] = size;
+	writer->offsets[cur] = offset;
+	writer->masks[cur] = mask;
+	writer->zeros[cur] = zeros;
+	writer->count++;
+	pthread_cond_broadcast(&writer->cond);
+	ret = writer->error ? -1 : 0;
+	pthread_mutex_unlock(&writer->lock);
 
-static char global_buf[1UL << 22]; /* 4MB */
+	return ret;
+
+}
+
+/* Wait for all queued chunks and flush device, returns -1 and sets errno when some write failed */
+static int disk_writer_finish(struct disk_writer * writer) {
+
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&writer->lock);
+	writer->stop = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+
+	pthread_join(writer->thread, NULL);
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+
+	disk_writer_direct(writer, 0);
+
+	for ( i = 0; i < DISK_BUFFERS; ++i )
+		free(writer->buffers[i]);
+
+	if ( writer->error ) {
+		errno = writer->error;
+		ret = -1;
+	} else if ( ! simulate && fdatasync(writer->fd) != 0 ) {
+		ret = -1;
+	}
+
+	return ret;
+
+}
 
 int disk_open_dev(int maj, int min, int partition, int readonly) {
 
@@ -199,169 +575,1277 @@ int disk_open_dev(int maj, int min, int partition, int readonly) {
 
 }
 
-int disk_dump_dev(int fd, const char * file) {
+/* Returns mask of blocks which contain only zeros and have size aligned for zeroing ioctl or file holes */
+static uint64_t disk_zero_blocks(const char * data, size_t size) {
 
-	int fd2 = -1;
-	int ret;
-	char * path;
-	uint64_t blksize;
-	size_t need, sent;
-	ssize_t size;
-	struct statvfs buf;
+	uint64_t mask = 0;
+	const char * ptr;
+	size_t len;
+	int block;
+
+	for ( block = 0; block < DISK_BLOCKS && (size_t)block * DISK_BLOCK_SIZE < size; ++block ) {
+		ptr = data + block * DISK_BLOCK_SIZE;
+		len = size - block * DISK_BLOCK_SIZE;
+		if ( len > DISK_BLOCK_SIZE )
+			len = DISK_BLOCK_SIZE;
+		if ( len % DISK_ALIGN != 0 )
+			continue;
+		/* Block is zero when first byte is zero and every byte equals to previous one */
+		if ( ptr[0] == 0 && memcmp(ptr, ptr + 1, len - 1) == 0 )
+			mask |= (uint64_t)1 << block;
+	}
 
-	printf("Dump block device to file %s...\n", file);
+	return mask;
 
-#ifdef __linux__
+}
 
-	if ( ioctl(fd, BLKGETSIZE64, &blksize) != 0 ) {
-		ERROR_INFO("Cannot get size of block device");
-		return -1;
-	}
+/* Write chunk to dump file, runs of zero blocks are skipped by lseek() to leave holes */
+static int disk_dump_chunk(int fd, const char * data, size_t size, uint64_t zeros, uint64_t * holes) {
+
+	uint64_t bit;
+	size_t start;
+	size_t end;
+	int block = 0;
+	int zero;
+
+	while ( block < DISK_BLOCKS && (size_t)block * DISK_BLOCK_SIZE < size ) {
+
+		bit = (uint64_t)1 << block;
+		zero = ( zeros & bit ) != 0;
+		start = block * DISK_BLOCK_SIZE;
+		/* Check bound before shifting, shift by DISK_BLOCKS bits is undefined */
+		for ( ++block; block < DISK_BLOCKS; ++block ) {
+			bit = (uint64_t)1 << block;
+			if ( ( ( zeros & bit ) != 0 ) != zero )
+				break;
+		}
+		end = block * DISK_BLOCK_SIZE;
+		if ( end > size )
+			end = size;
 
-#else
+		if ( zero ) {
+			if ( lseek(fd, end - start, SEEK_CUR) == (off_t)-1 )
+				return -1;
+			*holes += end - start;
+		} else if ( write(fd, data + start, end - start) != (ssize_t)(end - start) ) {
+			return -1;
+		}
 
-	blksize = lseek(fd, 0, SEEK_END);
-	if ( (off_t)blksize == (off_t)-1 ) {
-		ERROR_INFO("Cannot get size of block device");
-		return -1;
 	}
 
-	if ( lseek(fd, 0, SEEK_SET) == (off_t)-1 ) {
-		ERROR_INFO("Cannot seek to begin of block device");
-		return -1;
-	}
+	return 0;
 
-#endif
+}
 
-	if ( blksize == 0 ) {
-		ERROR("Block device has zero size");
-		return -1;
-	}
+/* Check that directory of file has size bytes free */
+static int disk_free_space_check(const char * file, uint64_t size) {
+
+	struct statvfs buf;
+	char * path;
+	int ret;
 
 	path = strdup(file);
-	if ( ! path ) {
-		ALLOC_ERROR();
-		return -1;
-	}
+	if ( ! path )
+		ALLOC_ERROR_RETURN(-1);
 
 	ret = statvfs(dirname(path), &buf);
 
 	free(path);
 
-	if ( ret == 0 && buf.f_bsize * buf.f_bfree < blksize ) {
-		ERROR("Not enough free space (have: %llu, need: %llu)", (unsigned long long int)(buf.f_bsize) * buf.f_bfree, (unsigned long long int)blksize);
-		return -1;
-	}
-
-	if ( ! simulate ) {
-
-		fd2 = creat(file, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-		if ( fd2 < 0 ) {
-			ERROR_INFO("Cannot create file %s", file);
+	/* Size of sparse or compressed dump is not known in advance, full device size is only upper bound */
+	if ( ret == 0 && buf.f_bsize * buf.f_bfree < size ) {
+		if ( ! disk_sparse && ! disk_zstd ) {
+			ERROR("Not enough free space (have: %llu, need: %llu)", (unsigned long long int)(buf.f_bsize) * buf.f_bfree, (unsigned long long int)size);
 			return -1;
 		}
-
+		printf("Warning: Dump can need up to %llu bytes, but only %llu bytes are free\n", (unsigned long long int)size, (unsigned long long int)(buf.f_bsize) * buf.f_bfree);
 	}
 
-	sent = 0;
-	printf_progressbar(0, blksize);
+	return 0;
 
-	while ( sent < blksize ) {
-		need = blksize - sent;
-		if ( need > sizeof(global_buf) )
-			need = sizeof(global_buf);
-		size = read(fd, global_buf, need);
-		if ( size == 0 )
-			break;
-		if ( size < 0 ) {
-			PRINTF_ERROR("Reading from block device failed");
-			if ( ! simulate )
-				close(fd2);
+}
+
+/*
+ * Incremental dump: device is read in main thread and every 1 MiB block is
+ * hashed by pool of worker threads. Workers write to temporary copy of dump
+ * file only blocks whose hash differs from previous manifest, each one at its
+ * own offset, so chunks are processed in any order. Copy replaces previous
+ * dump only after whole device was read, then new manifest is stored.
+ */
+
+enum disk_hasher_state {
+	DISK_HASHER_FREE,
+	DISK_HASHER_READY,
+	DISK_HASHER_BUSY,
+};
+
+struct disk_hasher_slot {
+	enum disk_hasher_state state;
+	char * data;
+	size_t size;
+	uint64_t offset;
+};
+
+struct disk_hasher {
+	int fd;	/* dump file, -1 in simulate mode */
+	const unsigned char * old;	/* hashes from previous manifest, NULL for full dump */
+	unsigned char * hashes;
+	int threads;
+	pthread_t workers[DISK_HASH_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct disk_hasher_slot slots[DISK_HASH_THREADS + 2];
+	int count;
+	uint64_t next_fill;
+	uint64_t next_hash;
+	uint64_t written;	/* number of written bytes */
+	uint64_t changed;	/* number of written blocks */
+	int stop;
+	int error;
+};
+
+static int disk_pwrite(int fd, const char * data, size_t size, uint64_t offset) {
+
+	ssize_t ret;
+
+	while ( size > 0 ) {
+		ret = pwrite(fd, data, size, offset);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			if ( ret == 0 )
+				errno = ENOSPC;
 			return -1;
 		}
-		if ( ! simulate ) {
-			if ( write(fd2, global_buf, size) != size ) {
-				PRINTF_ERROR("Dumping image failed");
-				close(fd2);
-				return -1;
-			}
-		}
-		sent += size;
-		printf_progressbar(sent, blksize);
+		data += ret;
+		size -= ret;
+		offset += ret;
 	}
 
-	if ( ! simulate )
-		close(fd2);
 	return 0;
 
 }
 
-int disk_flash_dev(int fd, struct image * image) {
+static int disk_hasher_slot(struct disk_hasher * hasher, struct disk_hasher_slot * slot, uint64_t * written, uint64_t * changed) {
 
-	uint64_t blksize;
-	size_t need, sent;
-	ssize_t size;
+	unsigned char * hash;
+	const char * data;
+	uint64_t block;
+	size_t pos;
+	size_t len;
 
-	if ( image->type != IMAGE_MMC )
-		ERROR_RETURN("Only mmc images are supported", -1);
+	for ( pos = 0; pos < slot->size; pos += DISK_HASH_BLOCK ) {
 
-	printf("Writing image to block device...\n");
+		data = slot->data + pos;
+		len = slot->size - pos;
+		if ( len > DISK_HASH_BLOCK )
+			len = DISK_HASH_BLOCK;
 
-#ifdef __linux__
+		block = ( slot->offset + pos ) / DISK_HASH_BLOCK;
+		hash = hasher->hashes + block * SHA256_SIZE;
+		sha256(data, len, hash);
 
-	if ( ioctl(fd, BLKGETSIZE64, &blksize) != 0 ) {
-		ERROR_INFO("Cannot get size of block device");
-		return -1;
-	}
+		if ( hasher->old && memcmp(hasher->old + block * SHA256_SIZE, hash, SHA256_SIZE) == 0 )
+			continue;
 
-#else
+		/* New dump file is created empty, so zero blocks can stay as holes */
+		if ( ! hasher->old && disk_sparse && data[0] == 0 && memcmp(data, data + 1, len - 1) == 0 )
+			continue;
 
-	blksize = lseek(fd, 0, SEEK_END);
-	if ( (off_t)blksize == (off_t)-1 ) {
-		ERROR_INFO("Cannot get size of block device");
-		return -1;
-	}
+		if ( hasher->fd >= 0 && disk_pwrite(hasher->fd, data, len, slot->offset + pos) != 0 )
+			return errno;
+
+		*written += len;
+		*changed += 1;
 
-	if ( lseek(fd, 0, SEEK_SET) == (off_t)-1 ) {
-		ERROR_INFO("Cannot seek to begin of block device");
-		return -1;
 	}
 
-#endif
+	return 0;
 
-	if ( blksize == 0 )
-		ERROR_RETURN("Block device has zero size", -1);
+}
 
-	if ( image->size > blksize )
-		ERROR_RETURN("Image is too big", -1);
+static void * disk_hasher_thread(void * arg) {
 
-	sent = 0;
-	printf_progressbar(0, image->size);
+	struct disk_hasher * hasher = arg;
+	struct disk_hasher_slot * slot;
+	uint64_t written;
+	uint64_t changed;
+	int error;
 
-	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(global_buf) )
-			need = sizeof(global_buf);
-		size = image_read(image, global_buf, need);
-		if ( size == 0 ) {
-			PRINTF_ERROR("Failed to read image");
+	pthread_mutex_lock(&hasher->lock);
+
+	while ( 1 ) {
+
+		while ( hasher->next_hash == hasher->next_fill && ! hasher->stop )
+			pthread_cond_wait(&hasher->cond, &hasher->lock);
+
+		if ( hasher->next_hash == hasher->next_fill )
+			break;
+
+		slot = &hasher->slots[hasher->next_hash++ % hasher->count];
+		slot->state = DISK_HASHER_BUSY;
+
+		pthread_mutex_unlock(&hasher->lock);
+
+		written = 0;
+		changed = 0;
+		error = disk_hasher_slot(hasher, slot, &written, &changed);
+
+		pthread_mutex_lock(&hasher->lock);
+
+		if ( error && ! hasher->error )
+			hasher->error = error;
+
+		hasher->written += written;
+		hasher->changed += changed;
+		slot->state = DISK_HASHER_FREE;
+		pthread_cond_broadcast(&hasher->cond);
+
+	}
+
+	pthread_mutex_unlock(&hasher->lock);
+
+	return NULL;
+
+}
+
+static void disk_hasher_free(struct disk_hasher * hasher) {
+
+	int i;
+
+	for ( i = 0; i < hasher->count; ++i )
+		free(hasher->slots[i].data);
+
+	pthread_mutex_destroy(&hasher->lock);
+	pthread_cond_destroy(&hasher->cond);
+
+}
+
+static int disk_hasher_start(struct disk_hasher * hasher, int fd, const unsigned char * old, unsigned char * hashes) {
+
+	long cpus;
+	int i;
+
+	memset(hasher, 0, sizeof(*hasher));
+	hasher->fd = fd;
+	hasher->old = old;
+	hasher->hashes = hashes;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( cpus < 1 )
+		cpus = 1;
+	if ( cpus > DISK_HASH_THREADS )
+		cpus = DISK_HASH_THREADS;
+
+	hasher->threads = cpus;
+	/* Every worker has one chunk, one is read by main thread and one is ready */
+	hasher->count = hasher->threads + 2;
+
+	pthread_mutex_init(&hasher->lock, NULL);
+	pthread_cond_init(&hasher->cond, NULL);
+
+	for ( i = 0; i < hasher->count; ++i ) {
+		hasher->slots[i].data = malloc(DISK_BUF_SIZE);
+		if ( ! hasher->slots[i].data ) {
+			disk_hasher_free(hasher);
+			ALLOC_ERROR_RETURN(-1);
+		}
+	}
+
+	for ( i = 0; i < hasher->threads; ++i ) {
+		if ( pthread_create(&hasher->workers[i], NULL, disk_hasher_thread, hasher) != 0 ) {
+			hasher->threads = i;
+			pthread_mutex_lock(&hasher->lock);
+			hasher->stop = 1;
+			pthread_cond_broadcast(&hasher->cond);
+			pthread_mutex_unlock(&hasher->lock);
+			while ( i-- > 0 )
+				pthread_join(hasher->workers[i], NULL);
+			disk_hasher_free(hasher);
+			ERROR_RETURN("Cannot create hash thread", -1);
+		}
+	}
+
+	VERBOSE("Hashing with %d threads\n", hasher->threads);
+
+	return 0;
+
+}
+
+/* Returns buffer of DISK_BUF_SIZE bytes, waits until some worker finished its chunk */
+static char * disk_hasher_buffer(struct disk_hasher * hasher) {
+
+	struct disk_hasher_slot * slot;
+
+	pthread_mutex_lock(&hasher->lock);
+	slot = &hasher->slots[hasher->next_fill % hasher->count];
+	while ( slot->state != DISK_HASHER_FREE )
+		pthread_cond_wait(&hasher->cond, &hasher->lock);
+	pthread_mutex_unlock(&hasher->lock);
+
+	return slot->data;
+
+}
+
+/* Queue buffer returned by disk_hasher_buffer(), offset must be multiple of DISK_HASH_BLOCK, returns -1 when some previous write failed */
+static int disk_hasher_queue(struct disk_hasher * hasher, size_t size, uint64_t offset) {
+
+	struct disk_hasher_slot * slot;
+	int ret;
+
+	pthread_mutex_lock(&hasher->lock);
+	slot = &hasher->slots[hasher->next_fill % hasher->count];
+	slot->size = size;
+	slot->offset = offset;
+	slot->state = DISK_HASHER_READY;
+	hasher->next_fill++;
+	pthread_cond_broadcast(&hasher->cond);
+	ret = hasher->error ? -1 : 0;
+	pthread_mutex_unlock(&hasher->lock);
+
+	return ret;
+
+}
+
+/* Wait for all queued chunks, returns -1 with errno set when some write failed */
+static int disk_hasher_finish(struct disk_hasher * hasher) {
+
+	int i;
+
+	pthread_mutex_lock(&hasher->lock);
+	hasher->stop = 1;
+	pthread_cond_broadcast(&hasher->cond);
+	pthread_mutex_unlock(&hasher->lock);
+
+	for ( i = 0; i < hasher->threads; ++i )
+		pthread_join(hasher->workers[i], NULL);
+
+	disk_hasher_free(hasher);
+
+	if ( hasher->error ) {
+		errno = hasher->error;
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/* Returns hashes of all blocks from manifest, NULL when it does not exist, was created for device of other size or dump was changed */
+static unsigned char * disk_manifest_load(const char * file, uint64_t size, const char * dump) {
+
+	unsigned char * hashes;
+	unsigned long long int manifest_size;
+	unsigned long int block_size;
+	unsigned long long int dump_dev, dump_ino;
+	long long int dump_sec;
+	long int dump_nsec;
+	struct stat st;
+	char line[128];
+	uint64_t blocks;
+	uint64_t block;
+	unsigned int byte;
+	int i;
+	FILE * fp;
+
+	fp = fopen(file, "r");
+	if ( ! fp )
+		return NULL;
+
+	if ( ! fgets(line, sizeof(line), fp) || strcmp(line, DISK_MANIFEST_HEADER "\n") != 0 || fscanf(fp, "size %llu\nblock %lu\ndump %llu %llu %lld.%ld\n", &manifest_size, &block_size, &dump_dev, &dump_ino, &dump_sec, &dump_nsec) != 6 ) {
+		ERROR("File %s is not block hash manifest", file);
+		fclose(fp);
+		return NULL;
+	}
+
+	if ( manifest_size != size || block_size != DISK_HASH_BLOCK ) {
+		printf("Manifest %s was created for other device, doing full dump\n", file);
+		fclose(fp);
+		return NULL;
+	}
+
+	/* Hashes describe only dump file which was written together with manifest */
+	if ( stat(dump, &st) != 0 ) {
+		printf("Previous dump %s does not exist, doing full dump\n", dump);
+		fclose(fp);
+		return NULL;
+	}
+
+	if ( (uint64_t)st.st_size != size || dump_dev != (unsigned long long int)st.st_dev || dump_ino != (unsigned long long int)st.st_ino || dump_sec != (long long int)st.st_mtim.tv_sec || dump_nsec != (long int)st.st_mtim.tv_nsec ) {
+		printf("Dump %s was not written together with manifest %s, doing full dump\n", dump, file);
+		fclose(fp);
+		return NULL;
+	}
+
+	blocks = ( size + DISK_HASH_BLOCK - 1 ) / DISK_HASH_BLOCK;
+	hashes = malloc(blocks * SHA256_SIZE);
+	if ( ! hashes ) {
+		fclose(fp);
+		ALLOC_ERROR_RETURN(NULL);
+	}
+
+	for ( block = 0; block < blocks; ++block ) {
+		if ( ! fgets(line, sizeof(line), fp) || strlen(line) != SHA256_SIZE * 2 + 1 )
+			break;
+		for ( i = 0; i < SHA256_SIZE; ++i ) {
+			if ( sscanf(line + i * 2, "%2x", &byte) != 1 )
+				break;
+			hashes[block * SHA256_SIZE + i] = byte;
+		}
+		if ( i != SHA256_SIZE )
+			break;
+	}
+
+	fclose(fp);
+
+	if ( block != blocks ) {
+		ERROR("Manifest %s is truncated or corrupted", file);
+		free(hashes);
+		return NULL;
+	}
+
+	return hashes;
+
+}
+
+static int disk_manifest_save(const char * file, const unsigned char * hashes, uint64_t size, const char * dump) {
+
+	struct stat st;
+	uint64_t blocks;
+	uint64_t block;
+	char * tmp;
+	FILE * fp;
+	int ret = 0;
+	int i;
+
+	if ( stat(dump, &st) != 0 ) {
+		ERROR_INFO("Cannot stat file %s", dump);
+		return -1;
+	}
+
+	/* Previous manifest is replaced only by complete new one */
+	tmp = malloc(strlen(file) + 5);
+	if ( ! tmp )
+		ALLOC_ERROR_RETURN(-1);
+	sprintf(tmp, "%s.tmp", file);
+
+	fp = fopen(tmp, "w");
+	if ( ! fp ) {
+		ERROR_INFO("Cannot create file %s", tmp);
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "%s\nsize %llu\nblock %lu\n", DISK_MANIFEST_HEADER, (unsigned long long int)size, DISK_HASH_BLOCK);
+	fprintf(fp, "dump %llu %llu %lld.%09ld\n", (unsigned long long int)st.st_dev, (unsigned long long int)st.st_ino, (long long int)st.st_mtim.tv_sec, (long int)st.st_mtim.tv_nsec);
+
+	blocks = ( size + DISK_HASH_BLOCK - 1 ) / DISK_HASH_BLOCK;
+	for ( block = 0; block < blocks; ++block ) {
+		for ( i = 0; i < SHA256_SIZE; ++i )
+			fprintf(fp, "%02x", hashes[block * SHA256_SIZE + i]);
+		fputc('\n', fp);
+	}
+
+	if ( ferror(fp) )
+		ret = -1;
+	if ( fclose(fp) != 0 )
+		ret = -1;
+
+	if ( ret == 0 && rename(tmp, file) != 0 )
+		ret = -1;
+
+	if ( ret != 0 ) {
+		ERROR_INFO("Cannot write manifest %s", file);
+		unlink(tmp);
+	}
+
+	free(tmp);
+	return ret;
+
+}
+
+/* Read until size bytes are read or end of device */
+static ssize_t disk_read_full(int fd, char * data, size_t size) {
+
+	ssize_t ret;
+	size_t done = 0;
+
+	while ( done < size ) {
+		ret = read(fd, data + done, size - done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret < 0 )
+			return -1;
+		if ( ret == 0 )
+			break;
+		done += ret;
+	}
+
+	return done;
+
+}
+
+/*
+ * Copy previous dump into new file which then receives only changed blocks.
+ * Data are shared by reflink when filesystem supports it, otherwise they are
+ * copied and zero blocks of sparse dump stay as holes.
+ */
+static int disk_dump_copy(const char * from, int fd, uint64_t size) {
+
+	uint64_t holes = 0;
+	uint64_t zeros;
+	ssize_t len;
+	char * data;
+	int fd1;
+	int ret = 0;
+
+	fd1 = open(from, O_RDONLY);
+	if ( fd1 < 0 ) {
+		ERROR_INFO("Cannot open file %s", from);
+		return -1;
+	}
+
+#ifdef FICLONE
+	if ( ioctl(fd, FICLONE, fd1) == 0 ) {
+		close(fd1);
+		return 0;
+	}
+#endif
+
+	if ( disk_free_space_check(from, size) != 0 ) {
+		close(fd1);
+		return -1;
+	}
+
+	data = malloc(DISK_BUF_SIZE);
+	if ( ! data ) {
+		close(fd1);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	printf("Copying previous dump %s...\n", from);
+
+	while ( ( len = disk_read_full(fd1, data, DISK_BUF_SIZE) ) > 0 ) {
+		zeros = disk_sparse ? disk_zero_blocks(data, len) : 0;
+		if ( disk_dump_chunk(fd, data, len, zeros, &holes) != 0 ) {
+			ERROR_INFO("Cannot write copy of file %s", from);
+			ret = -1;
+			break;
+		}
+	}
+
+	if ( len < 0 ) {
+		ERROR_INFO("Cannot read file %s", from);
+		ret = -1;
+	}
+
+	if ( ret == 0 && ftruncate(fd, size) != 0 ) {
+		ERROR_INFO("Cannot set size of copy of file %s", from);
+		ret = -1;
+	}
+
+	free(data);
+	close(fd1);
+	return ret;
+
+}
+
+static int disk_dump_incremental(int fd, const char * file, uint64_t blksize) {
+
+	struct disk_hasher hasher;
+	unsigned char * old;
+	unsigned char * hashes;
+	uint64_t blocks;
+	uint64_t sent;
+	size_t need;
+	ssize_t size;
+	char * data;
+	char * tmp = NULL;
+	int fd2 = -1;
+	int ret = 0;
+
+	old = disk_manifest_load(disk_manifest, blksize, file);
+	if ( old )
+		printf("Storing only blocks changed since manifest %s...\n", disk_manifest);
+
+	/* Copy of previous dump checks free space itself, reflink does not need any */
+	if ( ! old && disk_free_space_check(file, blksize) != 0 ) {
+		free(old);
+		return -1;
+	}
+
+	blocks = ( blksize + DISK_HASH_BLOCK - 1 ) / DISK_HASH_BLOCK;
+	hashes = malloc(blocks * SHA256_SIZE);
+	if ( ! hashes ) {
+		free(old);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	/* Previous dump is kept untouched until new one is complete, interrupted dump leaves only temporary file */
+	if ( ! simulate ) {
+		tmp = malloc(strlen(file) + sizeof(".tmp"));
+		if ( ! tmp ) {
+			free(hashes);
+			free(old);
+			ALLOC_ERROR_RETURN(-1);
+		}
+		sprintf(tmp, "%s.tmp", file);
+		fd2 = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if ( fd2 < 0 ) {
+			ERROR_INFO("Cannot open file %s", tmp);
+			free(tmp);
+			free(hashes);
+			free(old);
 			return -1;
 		}
+		if ( old && disk_dump_copy(file, fd2, blksize) != 0 ) {
+			close(fd2);
+			unlink(tmp);
+			free(tmp);
+			free(hashes);
+			free(old);
+			return -1;
+		}
+	}
+
+	if ( disk_hasher_start(&hasher, fd2, old, hashes) != 0 ) {
 		if ( ! simulate ) {
-			if ( write(fd, global_buf, size) != size ) {
-				PRINTF_ERROR("Writing image failed");
+			close(fd2);
+			unlink(tmp);
+		}
+		free(tmp);
+		free(hashes);
+		free(old);
+		return -1;
+	}
+
+	sent = 0;
+	printf_progressbar(0, blksize);
+
+	while ( sent < blksize ) {
+		need = blksize - sent;
+		if ( need > DISK_BUF_SIZE )
+			need = DISK_BUF_SIZE;
+		data = disk_hasher_buffer(&hasher);
+		size = disk_read_full(fd, data, need);
+		if ( size == 0 )
+			break;
+		if ( size < 0 ) {
+			PRINTF_ERROR("Reading from block device failed");
+			ret = -1;
+			break;
+		}
+		if ( disk_hasher_queue(&hasher, size, sent) != 0 )
+			break;
+		sent += size;
+		printf_progressbar(sent, blksize);
+	}
+
+	if ( disk_hasher_finish(&hasher) != 0 ) {
+		ERROR_INFO("Dumping image failed");
+		ret = -1;
+	} else if ( ret == 0 && sent != blksize ) {
+		ERROR("Block device is shorter than reported");
+		ret = -1;
+	}
+
+	/* Trailing hole is created only by setting file size */
+	if ( ret == 0 && ! simulate && ! old && ftruncate(fd2, sent) != 0 ) {
+		ERROR_INFO("Cannot set size of file %s", tmp);
+		ret = -1;
+	}
+
+	if ( ret == 0 && ! simulate && fsync(fd2) != 0 ) {
+		ERROR_INFO("Cannot sync file %s", tmp);
+		ret = -1;
+	}
+
+	if ( ! simulate && close(fd2) != 0 && ret == 0 ) {
+		ERROR_INFO("Cannot close file %s", tmp);
+		ret = -1;
+	}
+
+	if ( ret == 0 && ! simulate && rename(tmp, file) != 0 ) {
+		ERROR_INFO("Cannot rename file %s to %s", tmp, file);
+		ret = -1;
+	}
+
+	if ( ret != 0 && ! simulate )
+		unlink(tmp);
+
+	/* Manifest is bound to renamed file, stale manifest of previous dump is then rejected */
+	if ( ret == 0 && ! simulate )
+		ret = disk_manifest_save(disk_manifest, hashes, blksize, file);
+
+	if ( ret == 0 )
+		printf("Dumped %llu bytes, written %llu bytes in %llu of %llu blocks\n", (unsigned long long int)sent, (unsigned long long int)hasher.written, (unsigned long long int)hasher.changed, (unsigned long long int)blocks);
+
+	free(tmp);
+	free(hashes);
+	free(old);
+	return ret;
+
+}
+
+int disk_dump_dev(int fd, const char * file) {
+
+	int fd2 = -1;
+	int ret;
+	uint64_t blksize;
+	size_t need, sent;
+	ssize_t size;
+	uint64_t zeros;
+	uint64_t holes = 0;
+	char * data;
+	char * chunk;
+#ifdef WITH_ZSTD
+	struct zstd_seekable_writer * zstd = NULL;
+	uint64_t compressed;
+#endif
+
+	printf("Dump block device to file %s...\n", file);
+
+#ifdef __linux__
+
+	if ( ioctl(fd, BLKGETSIZE64, &blksize) != 0 ) {
+		ERROR_INFO("Cannot get size of block device");
+		return -1;
+	}
+
+#else
+
+	blksize = lseek(fd, 0, SEEK_END);
+	if ( (off_t)blksize == (off_t)-1 ) {
+		ERROR_INFO("Cannot get size of block device");
+		return -1;
+	}
+
+	if ( lseek(fd, 0, SEEK_SET) == (off_t)-1 ) {
+		ERROR_INFO("Cannot seek to begin of block device");
+		return -1;
+	}
+
+#endif
+
+	if ( blksize == 0 ) {
+		ERROR("Block device has zero size");
+		return -1;
+	}
+
+	if ( disk_manifest ) {
+		if ( disk_zstd )
+			ERROR_RETURN("Incremental dump cannot be compressed", -1);
+		return disk_dump_incremental(fd, file, blksize);
+	}
+
+	if ( disk_free_space_check(file, blksize) != 0 )
+		return -1;
+
+	if ( ! simulate ) {
+
+		fd2 = creat(file, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+		if ( fd2 < 0 ) {
+			ERROR_INFO("Cannot create file %s", file);
+			return -1;
+		}
+
+#ifdef WITH_ZSTD
+		/* Blocks are read directly to buffers of compression threads */
+		if ( disk_zstd ) {
+			zstd = zstd_seekable_writer_start(fd2, DISK_BUF_SIZE);
+			if ( ! zstd ) {
+				close(fd2);
 				return -1;
 			}
 		}
+#endif
+
+	}
+
+	data = malloc(DISK_BUF_SIZE);
+	if ( ! data ) {
+		ALLOC_ERROR();
+#ifdef WITH_ZSTD
+		if ( zstd )
+			zstd_seekable_writer_finish(zstd, NULL);
+#endif
+		if ( ! simulate )
+			close(fd2);
+		return -1;
+	}
+
+	ret = 0;
+	sent = 0;
+	printf_progressbar(0, blksize);
+
+	while ( sent < blksize ) {
+		need = blksize - sent;
+		if ( need > DISK_BUF_SIZE )
+			need = DISK_BUF_SIZE;
+		chunk = data;
+#ifdef WITH_ZSTD
+		if ( zstd )
+			chunk = zstd_seekable_writer_buffer(zstd);
+#endif
+		size = read(fd, chunk, need);
+		if ( size == 0 )
+			break;
+		if ( size < 0 ) {
+			PRINTF_ERROR("Reading from block device failed");
+			ret = -1;
+			break;
+		}
+#ifdef WITH_ZSTD
+		if ( zstd ) {
+			if ( zstd_seekable_writer_queue(zstd, size) != 0 ) {
+				PRINTF_ERROR("Dumping image failed");
+				ret = -1;
+				break;
+			}
+		} else
+#endif
+		if ( ! simulate ) {
+			zeros = disk_sparse ? disk_zero_blocks(chunk, size) : 0;
+			if ( disk_dump_chunk(fd2, chunk, size, zeros, &holes) != 0 ) {
+				PRINTF_ERROR("Dumping image failed");
+				ret = -1;
+				break;
+			}
+		}
 		sent += size;
+		printf_progressbar(sent, blksize);
+	}
+
+#ifdef WITH_ZSTD
+	if ( zstd ) {
+		if ( zstd_seekable_writer_finish(zstd, &compressed) != 0 && ret == 0 ) {
+			ERROR_INFO("Dumping image failed");
+			ret = -1;
+		}
+		if ( ret == 0 )
+			printf("Dumped %llu bytes, compressed to %llu bytes\n", (unsigned long long int)sent, (unsigned long long int)compressed);
+	}
+#endif
+
+	/* Trailing hole is created only by setting file size */
+	if ( ret == 0 && ! simulate && holes && ftruncate(fd2, sent) != 0 ) {
+		ERROR_INFO("Cannot set size of file %s", file);
+		ret = -1;
+	}
+
+	if ( ret == 0 && disk_sparse && ! disk_zstd && ! simulate )
+		printf("Dumped %llu bytes, %llu bytes of zeros left as holes\n", (unsigned long long int)sent, (unsigned long long int)holes);
+
+	free(data);
+	if ( ! simulate )
+		close(fd2);
+	return ret;
+
+}
+
+/* Returns mask of blocks in which device content differs from data */
+static uint64_t disk_compare_chunk(int fd, const char * data, char * buf, size_t size, uint64_t offset) {
+
+	uint64_t mask = 0;
+	ssize_t ret;
+	size_t done = 0;
+	size_t need;
+	size_t len;
+	int block;
+
+	/* Device is in O_DIRECT mode, so read whole sectors into aligned buffer, on any read error chunk is written */
+	need = ( size + DISK_ALIGN - 1 ) / DISK_ALIGN * DISK_ALIGN;
+	while ( done < size ) {
+		ret = pread(fd, buf + done, need - done, offset + done);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			break;
+		done += ret;
+	}
+
+	for ( block = 0; block < DISK_BLOCKS && (size_t)block * DISK_BLOCK_SIZE < size; ++block ) {
+		len = size - block * DISK_BLOCK_SIZE;
+		if ( len > DISK_BLOCK_SIZE )
+			len = DISK_BLOCK_SIZE;
+		if ( block * DISK_BLOCK_SIZE + len > done || memcmp(data + block * DISK_BLOCK_SIZE, buf + block * DISK_BLOCK_SIZE, len) != 0 )
+			mask |= (uint64_t)1 << block;
+	}
+
+	return mask;
+
+}
+
+/*
+ * Verification after flashing: block device is read back in main thread with
+ * O_DIRECT (so data come from eMMC and not from page cache) and every chunk
+ * is compared with image by verifier thread. Large reads are split by block
+ * layer into more requests in flight and reading of next chunk overlaps with
+ * reading and comparing of image data.
+ */
+struct disk_verifier {
+	struct image * image;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char * buffers[DISK_BUFFERS];
+	size_t sizes[DISK_BUFFERS];
+	uint64_t offsets[DISK_BUFFERS];
+	char * data;	/* image data of compared chunk */
+	int first;	/* oldest queued chunk */
+	int count;	/* number of queued chunks */
+	int stop;
+	int mismatch;	/* device content differs from image */
+	uint64_t mismatch_offset;
+	int error;	/* reading of image failed */
+};
+
+static void disk_verifier_chunk(struct disk_verifier * verifier, int cur) {
+
+	const char * buf = verifier->buffers[cur];
+	size_t size = verifier->sizes[cur];
+	size_t i;
+
+	/* Main thread reads results while queuing next chunks */
+	if ( image_read(verifier->image, verifier->data, size) != size ) {
+		pthread_mutex_lock(&verifier->lock);
+		verifier->error = 1;
+		pthread_mutex_unlock(&verifier->lock);
+		return;
+	}
+
+	if ( memcmp(buf, verifier->data, size) == 0 )
+		return;
+
+	for ( i = 0; i < size && buf[i] == verifier->data[i]; ++i )
+		;
+
+	pthread_mutex_lock(&verifier->lock);
+	verifier->mismatch_offset = verifier->offsets[cur] + i;
+	verifier->mismatch = 1;
+	pthread_mutex_unlock(&verifier->lock);
+
+}
+
+static void * disk_verifier_thread(void * data) {
+
+	struct disk_verifier * verifier = data;
+	int failed;
+	int cur;
+
+	pthread_mutex_lock(&verifier->lock);
+
+	while ( 1 ) {
+
+		while ( verifier->count == 0 && ! verifier->stop )
+			pthread_cond_wait(&verifier->cond, &verifier->lock);
+
+		if ( verifier->count == 0 )
+			break;
+
+		cur = verifier->first;
+		failed = ( verifier->mismatch || verifier->error );
+		pthread_mutex_unlock(&verifier->lock);
+
+		/* After first mismatch queued chunks are only dropped, main thread stops reading */
+		if ( ! failed )
+			disk_verifier_chunk(verifier, cur);
+
+		pthread_mutex_lock(&verifier->lock);
+		verifier->first = ( verifier->first + 1 ) % DISK_BUFFERS;
+		verifier->count--;
+		pthread_cond_broadcast(&verifier->cond);
+
+	}
+
+	pthread_mutex_unlock(&verifier->lock);
+	return NULL;
+
+}
+
+static int disk_verify_dev(int fd, struct image * image) {
+
+	struct disk_verifier verifier;
+	struct timespec start, end;
+	double seconds;
+	uint64_t sent = 0;
+	size_t need;
+	size_t size;
+	ssize_t ret;
+	size_t len;
+	char * buf;
+	int flags;
+	int direct = 0;
+	int failed;
+	int cur;
+	int i;
+
+	printf("Verifying written image...\n");
+
+	memset(&verifier, 0, sizeof(verifier));
+	verifier.image = image;
+
+	for ( i = 0; i < DISK_BUFFERS; ++i ) {
+		if ( posix_memalign((void **)&verifier.buffers[i], DISK_ALIGN, DISK_BUF_SIZE) != 0 )
+			verifier.buffers[i] = NULL;
+	}
+	verifier.data = malloc(DISK_BUF_SIZE);
+
+	for ( i = 0; i < DISK_BUFFERS; ++i ) {
+		if ( ! verifier.buffers[i] )
+			break;
+	}
+
+	if ( i != DISK_BUFFERS || ! verifier.data ) {
+		for ( i = 0; i < DISK_BUFFERS; ++i )
+			free(verifier.buffers[i]);
+		free(verifier.data);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	flags = fcntl(fd, F_GETFL);
+#ifdef O_DIRECT
+	if ( flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0 )
+		direct = 1;
+#endif
+#ifdef POSIX_FADV_DONTNEED
+	/* Buffered reads would be served from pages cached while writing */
+	if ( ! direct )
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+	pthread_mutex_init(&verifier.lock, NULL);
+	pthread_cond_init(&verifier.cond, NULL);
+
+	if ( pthread_create(&verifier.thread, NULL, disk_verifier_thread, &verifier) != 0 ) {
+		ERROR("Cannot create verifier thread");
+		verifier.error = 1;
+		verifier.stop = 1;
+	}
+
+	image_seek(image, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf_progressbar(0, image->size);
+
+	while ( sent < image->size && ! verifier.stop ) {
+
+		need = image->size - sent;
+		if ( need > DISK_BUF_SIZE )
+			need = DISK_BUF_SIZE;
+
+		pthread_mutex_lock(&verifier.lock);
+		while ( verifier.count == DISK_BUFFERS )
+			pthread_cond_wait(&verifier.cond, &verifier.lock);
+		cur = ( verifier.first + verifier.count ) % DISK_BUFFERS;
+		failed = ( verifier.mismatch || verifier.error );
+		pthread_mutex_unlock(&verifier.lock);
+
+		if ( failed )
+			break;
+
+		/* O_DIRECT reads must be whole sectors, data behind end of image are ignored */
+		/* After short read of unaligned size, rounded length must still fit into buffer */
+		buf = verifier.buffers[cur];
+		size = 0;
+		while ( size < need ) {
+			len = ( need - size + DISK_ALIGN - 1 ) / DISK_ALIGN * DISK_ALIGN;
+			if ( len > DISK_BUF_SIZE - size )
+				len = DISK_BUF_SIZE - size;
+			ret = pread(fd, buf + size, len, sent + size);
+			if ( ret < 0 && errno == EINTR )
+				continue;
+#ifdef O_DIRECT
+			if ( ret < 0 && errno == EINVAL && direct ) {
+				if ( fcntl(fd, F_SETFL, flags) == 0 )
+					direct = 0;
+#ifdef POSIX_FADV_DONTNEED
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+				continue;
+			}
+#endif
+			if ( ret <= 0 )
+				break;
+			size += ret;
+		}
+
+		if ( size < need ) {
+			PRINTF_ERROR("Reading from block device failed at offset %llu", (unsigned long long int)(sent + size));
+			pthread_mutex_lock(&verifier.lock);
+			verifier.error = 1;
+			pthread_mutex_unlock(&verifier.lock);
+			break;
+		}
+
+		pthread_mutex_lock(&verifier.lock);
+		verifier.sizes[cur] = need;
+		verifier.offsets[cur] = sent;
+		verifier.count++;
+		pthread_cond_broadcast(&verifier.cond);
+		pthread_mutex_unlock(&verifier.lock);
+
+		sent += need;
 		printf_progressbar(sent, image->size);
+
 	}
 
+	pthread_mutex_lock(&verifier.lock);
+	if ( ! verifier.stop ) {
+		verifier.stop = 1;
+		pthread_cond_broadcast(&verifier.cond);
+		pthread_mutex_unlock(&verifier.lock);
+		pthread_join(verifier.thread, NULL);
+	} else {
+		pthread_mutex_unlock(&verifier.lock);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_cond_destroy(&verifier.cond);
+	pthread_mutex_destroy(&verifier.lock);
+
+	if ( direct )
+		fcntl(fd, F_SETFL, flags);
+
+	for ( i = 0; i < DISK_BUFFERS; ++i )
+		free(verifier.buffers[i]);
+	free(verifier.data);
+
+	PRINTF_END();
+
+	if ( verifier.mismatch ) {
+		ERROR("Verification failed, first mismatch at offset %llu", (unsigned long long int)verifier.mismatch_offset);
+		return -1;
+	}
+
+	if ( verifier.error ) {
+		ERROR("Verification failed");
+		return -1;
+	}
+
+	seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+	printf("Verified %llu bytes in %.1f s (%.1f MB/s)\n", (unsigned long long int)sent, seconds, seconds > 0 ? sent / seconds / 1e6 : 0.0);
+
 	return 0;
 
 }
 
+int disk_flash_dev(int fd, struct image * image) {
+
+	int ret;
+	uint64_t blksize;
+	size_t need, sent;
+	ssize_t size;
+	char * data;
+	char * compare = NULL;
+	uint64_t mask;
+	uint64_t zeros;
+	int zero_method;
+	struct disk_writer writer;
+
+	if ( image->type != IMAGE_MMC )
+		ERROR_RETURN("Only mmc images are supported", -1);
+
+	printf("Writing image to block device...\n");
+
+#ifdef __linux__
+
+	if ( ioctl(fd, BLKGETSIZE64, &blksize) != 0 ) {
+		ERROR_INFO("Cannot get size of block device");
+		return -1;
+	}
+
+#else
+
+	blksize = lseek(fd, 0, SEEK_END);
+	if ( (off_t)blksize == (off_t)-1 ) {
+		ERROR_INFO("Cannot get size of block device");
+		return -1;
+	}
+
+	if ( lseek(fd, 0, SEEK_SET) == (off_t)-1 ) {
+		ERROR_INFO("Cannot seek to begin of block device");
+		return -1;
+	}
+
+#endif
+
+	if ( blksize == 0 )
+		ERROR_RETURN("Block device has zero size", -1);
+
+	if ( image->size > blksize )
+		ERROR_RETURN("Image is too big", -1);
+
+	if ( disk_compare && posix_memalign((void **)&compare, DISK_ALIGN, DISK_BUF_SIZE) != 0 )
+		ALLOC_ERROR_RETURN(-1);
+
+	if ( disk_writer_start(&writer, fd) != 0 ) {
+		free(compare);
+		return -1;
+	}
+
+	if ( verbose )
+		printf("Using %s writes\n", writer.direct ? "direct" : "buffered");
+
+	if ( compare )
+		printf("Writing only blocks which differ from device content...\n");
+
+	zero_method = writer.zero_ioctl != 0;
+	if ( verbose && zero_method )
+		printf("Zero blocks are written by %s\n", writer.zero_name);
+
+	ret = 0;
+	sent = 0;
+	image_seek(image, 0);
+	printf_progressbar(0, image->size);
+
+	while ( sent < image->size ) {
+		need = image->size - sent;
+		if ( need > DISK_BUF_SIZE )
+			need = DISK_BUF_SIZE;
+		data = disk_writer_buffer(&writer);
+		size = image_read(image, data, need);
+		if ( size == 0 ) {
+			PRINTF_ERROR("Failed to read image");
+			ret = -1;
+			break;
+		}
+		mask = DISK_ALL_BLOCKS;
+		if ( compare )
+			mask = disk_compare_chunk(fd, data, compare, size, sent);
+		zeros = 0;
+		if ( zero_method )
+			zeros = disk_zero_blocks(data, size);
+		if ( disk_writer_queue(&writer, size, sent, mask, zeros) != 0 )
+			break;
+		sent += size;
+		printf_progressbar(sent, image->size);
+	}
+
+	if ( ret == 0 && sent == image->size )
+		printf("Flushing block device...\n");
+
+	if ( disk_writer_finish(&writer) != 0 && ret == 0 ) {
+		if ( writer.error )
+			PRINTF_ERROR("Writing image failed at offset %llu", (unsigned long long int)writer.error_offset);
+		else
+			PRINTF_ERROR("Flushing block device failed");
+		ret = -1;
+	}
+
+	if ( ret == 0 && ( compare || zero_method ) && ! simulate )
+		printf("Written %llu bytes, zeroed %llu bytes without transfer, skipped %llu unchanged bytes\n", (unsigned long long int)writer.written, (unsigned long long int)writer.zeroed, (unsigned long long int)(sent - writer.written - writer.zeroed));
+
+	free(compare);
+
+	if ( ret == 0 && disk_verify && ! simulate )
+		ret = disk_verify_dev(fd, image);
+
+	return ret;
+
+}
+
 int disk_init(struct usb_device_info * dev) {
 
 #ifdef __linux__
@@ -23,6 +23,21 @@
 #include "device.h"
 #include "usb-device.h"
 
+/* Read device before flashing and write only changed blocks */
+extern int disk_compare;
+
+/* Leave zero blocks as holes in dumped file */
+extern int disk_sparse;
+
+/* Compress dumped file to seekable zstd format, only when built with ZSTD=1 */
+extern int disk_zstd;
+
+/* Read block device back after flashing and compare it with image */
+extern int disk_verify;
+
+/* Block hash manifest of incremental dump, only changed blocks are written to copy of dump file which was not modified since manifest was created */
+extern const char * disk_manifest;
+
 int disk_init(struct usb_device_info * dev);
 void disk_exit(struct usb_device_info * dev);
 
@@ -23,12 +23,16 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "global.h"
 #include "device.h"
 #include "image.h"
+#ifdef WITH_ZSTD
+#include "zstd-seekable.h"
+#endif
 
 /* format: type-device:hwrevs_version */
 static void image_missing_values_from_name(struct image * image, const char * name) {
@@ -356,6 +360,15 @@ struct image * image_alloc_from_fds(int * fds, const char ** orig_filenames, int
 		image_fd->shared_cur = 0;
 		image_fd->orig_filename = strdup(orig_filenames[i]);
 
+#ifdef WITH_ZSTD
+		/* Compressed dump is read without decompressing it to disk */
+		image_fd->zstd = zstd_seekable_reader_open(image_fd->fd);
+		if ( image_fd->zstd ) {
+			VERBOSE("File %s is in seekable zstd format\n", orig_filenames[i]);
+			image_fd->size = zstd_seekable_reader_size(image_fd->zstd);
+		}
+#endif
+
 		image->size += image_fd->size;
 
 		if ( lseek(image_fd->fd, 0, SEEK_SET) == (off_t)-1 ) {
@@ -411,15 +424,49 @@ struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, ui
 
 }
 
+/* Allocate copy of image with its own read position, which shares loaded data and all values with image */
+/* Copy is used by another reader (e.g. thread), so image must not be freed or modified before the copy */
+struct image * image_alloc_shared(struct image * image) {
+
+	struct image * shared;
+
+	if ( image_load(image) != 0 )
+		return NULL;
+
+	shared = image_alloc();
+	if ( ! shared )
+		return NULL;
+
+	memcpy(shared, image, sizeof(*shared));
+	shared->cur = 0;
+	shared->shared = image;
+
+	return shared;
+
+}
+
 void image_free(struct image * image) {
 
 	if ( ! image )
 		return;
 
+	if ( image->shared ) {
+		free(image);
+		return;
+	}
+
+	if ( image->map )
+		munmap(image->map, image->map_size);
+	else
+		free(image->data);
+
 	while ( image->fds ) {
 		struct image_fd * next = image->fds->next;
 		if ( ! image->fds->is_shared_fd )
 			close(image->fds->fd);
+#ifdef WITH_ZSTD
+		zstd_seekable_reader_close(image->fds->zstd);
+#endif
 		free(image->fds->orig_filename);
 		free(image->fds);
 		image->fds = next;
@@ -446,6 +493,58 @@ void image_free(struct image * image) {
 
 }
 
+/* Read whole image to memory once, then all reads are served from it */
+int image_load(struct image * image) {
+
+	struct image_fd * image_fd = image->fds;
+	unsigned char * data;
+	struct stat st;
+	off_t start;
+	long page;
+	void * map;
+	size_t map_size;
+
+	if ( image->data )
+		return 0;
+
+	/* Image stored in one file without padding can be mapped, so its pages are read only once */
+	if ( image_fd && ! image_fd->next && image_fd->align == 0 && ! image_fd->zstd && image->size > 0 ) {
+		page = sysconf(_SC_PAGESIZE);
+		if ( page <= 0 )
+			page = 4096;
+		start = image_fd->offset - image_fd->offset % page;
+		map_size = image_fd->offset - start + image->size;
+		/* Accessing mapped pages behind end of file would raise SIGBUS */
+		if ( fstat(image_fd->fd, &st) == 0 && st.st_size >= (off_t)(start + map_size) )
+			map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, image_fd->fd, start);
+		else
+			map = MAP_FAILED;
+		if ( map != MAP_FAILED ) {
+			image->map = map;
+			image->map_size = map_size;
+			image->data = (unsigned char *)map + ( image_fd->offset - start );
+			image->cur = 0;
+			return 0;
+		}
+	}
+
+	data = malloc(image->size ? image->size : 1);
+	if ( ! data )
+		ALLOC_ERROR_RETURN(-1);
+
+	image_seek(image, 0);
+	if ( image_read(image, data, image->size) != image->size ) {
+		ERROR("Cannot read image");
+		free(data);
+		return -1;
+	}
+
+	image->data = data;
+	image->cur = 0;
+	return 0;
+
+}
+
 void image_seek(struct image * image, size_t whence) {
 
 	off_t offset;
@@ -459,6 +558,9 @@ void image_seek(struct image * image, size_t whence) {
 		return;
 	}
 
+	if ( image->data )
+		return;
+
 	while ( image_fd ) {
 		if ( ( whence >= start && whence < start + image_fd->size ) || ! image_fd->next )
 			break;
@@ -479,6 +581,19 @@ void image_seek(struct image * image, size_t whence) {
 
 }
 
+/* Compressed file is read from position pos of its decompressed data, other files from current offset */
+static ssize_t image_fd_read(struct image_fd * image_fd, void * buf, size_t count, size_t pos) {
+
+#ifdef WITH_ZSTD
+	if ( image_fd->zstd )
+		return zstd_seekable_reader_pread(image_fd->zstd, buf, count, pos);
+#endif
+
+	(void)pos;
+	return read(image_fd->fd, buf, count);
+
+}
+
 size_t image_read(struct image * image, void * buf, size_t count) {
 
 	ssize_t ret;
@@ -488,6 +603,16 @@ size_t image_read(struct image * image, void * buf, size_t count) {
 	size_t start = 0;
 	struct image_fd * image_fd = image->fds;
 
+	if ( image->data ) {
+		if ( image->cur >= image->size )
+			return 0;
+		if ( count > image->size - image->cur )
+			count = image->size - image->cur;
+		memcpy(buf, image->data + image->cur, count);
+		image->cur += count;
+		return count;
+	}
+
 	while ( image_fd ) {
 		if ( ( image->cur >= start && image->cur < start + image_fd->size ) || ! image_fd->next )
 			break;
@@ -511,7 +636,7 @@ size_t image_read(struct image * image, void * buf, size_t count) {
 			else
 				new_count = count;
 
-			ret = read(image_fd->fd, buf, new_count);
+			ret = image_fd_read(image_fd, buf, new_count, image->cur - start);
 			if ( ret <= 0 )
 				break;
 
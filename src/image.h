@@ -50,6 +50,8 @@ struct image_part {
 	char * name;
 };
 
+struct zstd_seekable_reader;
+
 struct image_fd {
 	struct image_fd * next;
 	int fd;
@@ -59,6 +61,7 @@ struct image_fd {
 	uint32_t align;
 	size_t offset;
 	char * orig_filename;
+	struct zstd_seekable_reader * zstd;	/* file is in seekable zstd format, size is size of decompressed data */
 };
 
 struct image {
@@ -71,6 +74,10 @@ struct image {
 	struct image_part * parts;
 	struct image_fd * fds;
 	size_t cur;
+	unsigned char * data;	/* whole image in memory, see image_load() */
+	void * map;	/* mmap()ed region which contains data */
+	size_t map_size;
+	struct image * shared;	/* image which owns all values and data of this copy */
 };
 
 struct image_list {
@@ -84,7 +91,9 @@ struct image * image_alloc_from_files(const char ** files, int count, const char
 struct image * image_alloc_from_fd(int fd, const char * orig_filename, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout, struct image_part * parts);
 struct image * image_alloc_from_fds(int * fds, const char ** orig_filenames, int count, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout, struct image_part * parts);
 struct image * image_alloc_from_shared_fd(int fd, size_t size, size_t offset, uint16_t hash, const char * type, const char * device, const char * hwrevs, const char * version, const char * layout, struct image_part * parts);
+struct image * image_alloc_shared(struct image * image);
 void image_free(struct image * image);
+int image_load(struct image * image);
 void image_seek(struct image * image, size_t whence);
 size_t image_read(struct image * image, void * buf, size_t count);
 void image_print_info(struct image * image);
@@ -0,0 +1,209 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "image.h"
+#include "journal.h"
+#include "sha256.h"
+
+/* Journal is text file in home directory, one flashed image per line: */
+/* serial type sha256 size version */
+#define JOURNAL_FILE	".0xFFFF-journal"
+
+#define JOURNAL_BUF_SIZE	(1024 * 1024)
+
+static int journal_path(char * path, size_t size) {
+
+	const char * home = getenv("HOME");
+
+	if ( ! home || ! home[0] )
+		return -1;
+
+	if ( snprintf(path, size, "%s/%s", home, JOURNAL_FILE) >= (int)size )
+		return -1;
+
+	return 0;
+
+}
+
+/* Journal fields are separated by spaces, so replace all non printable characters */
+static void journal_escape(const char * str, char * out, size_t size) {
+
+	size_t i;
+
+	if ( ! str || ! str[0] ) {
+		strncpy(out, "-", size);
+		out[size-1] = 0;
+		return;
+	}
+
+	for ( i = 0; str[i] && i < size-1; ++i ) {
+		if ( str[i] > 32 && str[i] < 127 )
+			out[i] = str[i];
+		else
+			out[i] = '_';
+	}
+
+	out[i] = 0;
+
+}
+
+/* SHA-256 of image data in hex, 16-bit image hash is too weak to decide that image was already flashed */
+static int journal_digest(struct image * image, char digest[SHA256_SIZE * 2 + 1]) {
+
+	struct sha256 ctx;
+	unsigned char hash[SHA256_SIZE];
+	size_t done = 0;
+	size_t size;
+	char * buf;
+	int i;
+
+	buf = malloc(JOURNAL_BUF_SIZE);
+	if ( ! buf )
+		ALLOC_ERROR_RETURN(-1);
+
+	sha256_init(&ctx);
+	image_seek(image, 0);
+
+	while ( done < image->size ) {
+		size = image_read(image, buf, JOURNAL_BUF_SIZE);
+		if ( size == 0 )
+			break;
+		sha256_update(&ctx, buf, size);
+		done += size;
+	}
+
+	image_seek(image, 0);
+	free(buf);
+
+	if ( done != image->size )
+		ERROR_RETURN("Cannot read image", -1);
+
+	sha256_final(&ctx, hash);
+
+	for ( i = 0; i < SHA256_SIZE; ++i )
+		sprintf(digest + i * 2, "%02x", hash[i]);
+
+	return 0;
+
+}
+
+int journal_is_flashed(const char * serial, struct image * image) {
+
+	FILE * file;
+	char path[1024];
+	char line[1024];
+	char key[64];
+	char version[256];
+	char jserial[64];
+	char jtype[32];
+	char jversion[256];
+	char jdigest[SHA256_SIZE * 2 + 1];
+	char digest[SHA256_SIZE * 2 + 1];
+	unsigned long int jsize;
+	const char * type;
+	int found = 0;
+
+	if ( ! serial || ! serial[0] )
+		return 0;
+
+	type = image_type_to_string(image->type);
+	if ( ! type )
+		return 0;
+
+	if ( journal_path(path, sizeof(path)) != 0 )
+		return 0;
+
+	file = fopen(path, "r");
+	if ( ! file )
+		return 0;
+
+	journal_escape(serial, key, sizeof(key));
+	journal_escape(image->version, version, sizeof(version));
+	digest[0] = 0;
+
+	while ( fgets(line, sizeof(line), file) ) {
+
+		if ( sscanf(line, "%63s %31s %64s %lu %255s", jserial, jtype, jdigest, &jsize, jversion) != 5 )
+			continue;
+
+		if ( strcmp(jserial, key) != 0 || strcmp(jtype, type) != 0 )
+			continue;
+
+		/* Last record for device and image type wins, image is hashed only when some record can match */
+		found = ( jsize == image->size && strcmp(jversion, version) == 0 );
+		if ( found && ! digest[0] && journal_digest(image, digest) != 0 ) {
+			found = 0;
+			break;
+		}
+		found = found && strcmp(jdigest, digest) == 0;
+
+	}
+
+	fclose(file);
+
+	return found;
+
+}
+
+int journal_record(const char * serial, struct image * image) {
+
+	FILE * file;
+	char path[1024];
+	char key[64];
+	char version[256];
+	char digest[SHA256_SIZE * 2 + 1];
+	const char * type;
+
+	if ( simulate )
+		return 0;
+
+	if ( ! serial || ! serial[0] )
+		return -1;
+
+	type = image_type_to_string(image->type);
+	if ( ! type )
+		return -1;
+
+	if ( journal_path(path, sizeof(path)) != 0 )
+		ERROR_RETURN("Cannot find home directory for flash journal", -1);
+
+	if ( journal_digest(image, digest) != 0 )
+		return -1;
+
+	file = fopen(path, "a");
+	if ( ! file ) {
+		ERROR_INFO("Cannot open flash journal %s", path);
+		return -1;
+	}
+
+	journal_escape(serial, key, sizeof(key));
+	journal_escape(image->version, version, sizeof(version));
+
+	fprintf(file, "%s %s %s %lu %s\n", key, type, digest, (unsigned long int)image->size, version);
+
+	fclose(file);
+
+	return 0;
+
+}
@@ -0,0 +1,33 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "image.h"
+
+/* Host side journal of flashed images, keyed by USB serial number of device */
+
+/* Returns 1 if same image (type, SHA-256 of data, size and version) was already flashed to device with serial number */
+int journal_is_flashed(const char * serial, struct image * image);
+
+/* Record that image was successfully flashed to device with serial number */
+int journal_record(const char * serial, struct image * image);
+
+#endif
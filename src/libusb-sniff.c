@@ -20,6 +20,7 @@
 /* compile: gcc libusb-sniff.c -o libusb-sniff.so -W -Wall -O2 -fPIC -ldl -shared -m32 */
 /* usage: sudo USBSNIFF_WAIT=1 LD_PRELOAD=./libusb-sniff.so flasher-3.5 ... */
 /* usage: sudo USBSNIFF_SKIP_READ=1 USBSNIFF_SKIP_WRITE=1 LD_PRELOAD=./libusb-sniff.so flasher-3.5 ... */
+/* usage: sudo USBSNIFF_TRACE=/tmp/trace LD_PRELOAD=./libusb-sniff.so flasher-3.5 ... && usbsniff-decode /tmp/trace.<pid> */
 
 /* Enable RTLD_NEXT for glibc */
 #ifndef _GNU_SOURCE
@@ -29,13 +30,170 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dlfcn.h>
+#include <sys/mman.h>
+
+#include "libusb-sniff.h"
 
 struct usb_dev_handle;
 struct libusb_device_handle;
 typedef struct usb_dev_handle usb_dev_handle;
 typedef struct libusb_device_handle libusb_device_handle;
 
+/* Binary trace mode, enabled by USBSNIFF_TRACE, does not use stdio at all */
+static struct usbsniff_trace_header * trace;
+static int trace_state;
+static int trace_skip_read;
+static int trace_skip_write;
+static int trace_skip_control;
+
+static uint64_t trace_time(clockid_t clock) {
+
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+static void trace_open(void) {
+
+	struct usbsniff_trace_header * header;
+	const char * path;
+	const char * env;
+	char file[4096];
+	size_t payload_size = USBSNIFF_TRACE_PAYLOAD;
+	size_t size = USBSNIFF_TRACE_SIZE;
+	size_t slot_size;
+	size_t slot_count;
+	void * map;
+	int fd;
+
+	path = getenv("USBSNIFF_TRACE");
+	if ( ! path )
+		return;
+
+	trace_skip_read = getenv("USBSNIFF_SKIP_READ") != NULL;
+	trace_skip_write = getenv("USBSNIFF_SKIP_WRITE") != NULL;
+	trace_skip_control = getenv("USBSNIFF_SKIP_CONTROL") != NULL;
+
+	env = getenv("USBSNIFF_TRACE_PAYLOAD");
+	if ( env ) {
+		payload_size = strtoul(env, NULL, 0);
+		if ( payload_size > USBSNIFF_TRACE_PAYLOAD_MAX )
+			payload_size = USBSNIFF_TRACE_PAYLOAD_MAX;
+	}
+
+	env = getenv("USBSNIFF_TRACE_SIZE");
+	if ( env )
+		size = strtoul(env, NULL, 0);
+
+	slot_size = ( sizeof(struct usbsniff_trace_record) + payload_size + 7 ) & ~(size_t)7;
+	slot_count = ( size > sizeof(*header) ) ? ( size - sizeof(*header) ) / slot_size : 0;
+	if ( slot_count < 1 )
+		slot_count = 1;
+
+	size = sizeof(*header) + slot_count * slot_size;
+
+	if ( snprintf(file, sizeof(file), "%s.%d", path, (int)getpid()) >= (int)sizeof(file) )
+		return;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ( fd < 0 )
+		return;
+
+	if ( ftruncate(fd, size) != 0 ) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED )
+		return;
+
+	header = map;
+	header->version = USBSNIFF_TRACE_VERSION;
+	header->byte_order = USBSNIFF_TRACE_BYTE_ORDER;
+	header->header_size = sizeof(*header);
+	header->slot_size = slot_size;
+	header->slot_count = slot_count;
+	header->payload_size = payload_size;
+	header->next_seq = 0;
+	header->realtime_offset = (int64_t)( trace_time(CLOCK_REALTIME) - trace_time(CLOCK_MONOTONIC) );
+	header->pid = getpid();
+	memcpy(header->magic, USBSNIFF_TRACE_MAGIC, sizeof(header->magic));
+
+	trace = header;
+
+}
+
+/* Return nonzero if binary trace mode is enabled, first call opens trace file */
+static int trace_enabled(void) {
+
+	int state = 0;
+
+	if ( __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) == 2 )
+		return trace != NULL;
+
+	if ( __atomic_compare_exchange_n(&trace_state, &state, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+		trace_open();
+		__atomic_store_n(&trace_state, 2, __ATOMIC_RELEASE);
+	} else {
+		while ( __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) != 2 )
+			;
+	}
+
+	return trace != NULL;
+
+}
+
+static void trace_record(uint64_t start, int type, int ep, int requesttype, int request, int value, int index, const void * bytes, int size, int ret, int timeout) {
+
+	struct usbsniff_trace_record * record;
+	uint64_t seq;
+	uint32_t captured = 0;
+
+	/* Read data are valid only after transfer, write data during whole transfer */
+	if ( ( ep & 0x80 ) || ( type == USBSNIFF_TRACE_CONTROL && ( requesttype & 0x80 ) ) ) {
+		if ( ret > 0 )
+			captured = ret;
+	} else if ( size > 0 ) {
+		captured = size;
+	}
+
+	if ( captured > trace->payload_size )
+		captured = trace->payload_size;
+
+	seq = __atomic_fetch_add(&trace->next_seq, 1, __ATOMIC_RELAXED);
+	record = (struct usbsniff_trace_record *)((char *)trace + trace->header_size + ( seq % trace->slot_count ) * trace->slot_size);
+
+	__atomic_store_n(&record->seq, 0, __ATOMIC_RELEASE);
+
+	record->start = start;
+	record->end = trace_time(CLOCK_MONOTONIC);
+	record->type = type;
+	record->ep = ep;
+	record->requesttype = requesttype;
+	record->request = request;
+	record->value = value;
+	record->index = index;
+	record->size = size;
+	record->ret = ret;
+	record->captured = captured;
+	record->timeout = timeout;
+
+	if ( captured )
+		memcpy(record + 1, bytes, captured);
+
+	__atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+
+}
+
 static char to_ascii(char c) {
 
 	if ( c >= 32 && c <= 126 )
@@ -80,6 +238,18 @@ int usb_bulk_write(usb_dev_handle * dev, int ep, const char * bytes, int size, i
 	if ( ! real_usb_bulk_write )
 		*(void **)(&real_usb_bulk_write) = dlsym(RTLD_NEXT, "usb_bulk_write");
 
+	if ( trace_enabled() ) {
+
+		uint64_t start = trace_time(CLOCK_MONOTONIC);
+		int ret = real_usb_bulk_write(dev, ep, bytes, size, timeout);
+
+		if ( ! trace_skip_write )
+			trace_record(start, USBSNIFF_TRACE_BULK, ep & 0x7F, 0, 0, 0, 0, bytes, size, ret, timeout);
+
+		return ret;
+
+	}
+
 	if ( ! getenv("USBSNIFF_SKIP_WRITE") ) {
 
 		printf("\n==== usb_bulk_write (ep=%d size=%d timeout=%d) ====\n", ep, size, timeout);
@@ -104,6 +274,19 @@ int usb_bulk_read(usb_dev_handle * dev, int ep, char * bytes, int size, int time
 	if ( ! real_usb_bulk_read )
 		*(void **)(&real_usb_bulk_read) = dlsym(RTLD_NEXT, "usb_bulk_read");
 
+	if ( trace_enabled() ) {
+
+		uint64_t start = trace_time(CLOCK_MONOTONIC);
+
+		ret = real_usb_bulk_read(dev, ep, bytes, size, timeout);
+
+		if ( ! trace_skip_read )
+			trace_record(start, USBSNIFF_TRACE_BULK, ep | 0x80, 0, 0, 0, 0, bytes, size, ret, timeout);
+
+		return ret;
+
+	}
+
 	ret = real_usb_bulk_read(dev, ep, bytes, size, timeout);
 
 	if ( ! getenv("USBSNIFF_SKIP_READ") ) {
@@ -132,6 +315,19 @@ int libusb_bulk_transfer(libusb_device_handle *dev, unsigned char ep, unsigned c
 	if ( ! real_libusb_bulk_transfer )
 		*(void **)(&real_libusb_bulk_transfer) = dlsym(RTLD_NEXT, "libusb_bulk_transfer");
 
+	if ( trace_enabled() ) {
+
+		uint64_t start = trace_time(CLOCK_MONOTONIC);
+
+		ret = real_libusb_bulk_transfer(dev, ep, bytes, size, actual_length, timeout);
+
+		if ( ! ( ( ep & 0x80 ) ? trace_skip_read : trace_skip_write ) )
+			trace_record(start, USBSNIFF_TRACE_BULK, ep, 0, 0, 0, 0, bytes, size, ( ret < 0 ) ? ret : *actual_length, timeout);
+
+		return ret;
+
+	}
+
 	if ( ep == 0x81 ) {
 
 		ret = real_libusb_bulk_transfer(dev, ep, bytes, size, actual_length, timeout);
@@ -180,6 +376,19 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value
 	if ( ! real_usb_control_msg )
 		*(void **)(&real_usb_control_msg) = dlsym(RTLD_NEXT, "usb_control_msg");
 
+	if ( trace_enabled() ) {
+
+		uint64_t start = trace_time(CLOCK_MONOTONIC);
+
+		ret = real_usb_control_msg(dev, requesttype, request, value, index, bytes, size, timeout);
+
+		if ( ! trace_skip_control )
+			trace_record(start, USBSNIFF_TRACE_CONTROL, requesttype & 0x80, requesttype, request, value, index, bytes, size, ret, timeout);
+
+		return ret;
+
+	}
+
 	if ( requesttype == 64 && ! getenv("USBSNIFF_SKIP_CONTROL") ) {
 
 		printf("\n==== usb_control_msg(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%d) ====\n", requesttype, request, value, index, size, timeout);
@@ -220,6 +429,19 @@ int libusb_control_transfer(libusb_device_handle *dev, uint8_t requesttype, uint
 	if ( ! real_libusb_control_transfer )
 		*(void **)(&real_libusb_control_transfer) = dlsym(RTLD_NEXT, "libusb_control_transfer");
 
+	if ( trace_enabled() ) {
+
+		uint64_t start = trace_time(CLOCK_MONOTONIC);
+
+		ret = real_libusb_control_transfer(dev, requesttype, request, value, index, bytes, size, timeout);
+
+		if ( ! trace_skip_control )
+			trace_record(start, USBSNIFF_TRACE_CONTROL, requesttype & 0x80, requesttype, request, value, index, bytes, size, ret, timeout);
+
+		return ret;
+
+	}
+
 	if ( requesttype == 64 && ! getenv("USBSNIFF_SKIP_CONTROL") ) {
 
 		printf("\n==== usb_control_msg(requesttype=%d, request=%d, value=%d, index=%d, size=%d, timeout=%d) ====\n", (int)requesttype, (int)request, (int)value, (int)index, (int)size, (int)timeout);
@@ -0,0 +1,79 @@
+/*
+    libusb-sniff.h - Binary trace format of libusb-sniff
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef LIBUSB_SNIFF_H
+#define LIBUSB_SNIFF_H
+
+#include <stdint.h>
+
+/*
+ * Trace file is mmaped ring buffer: header followed by slot_count fixed size
+ * slots. Every slot contains one record followed by first payload_size bytes
+ * of transferred data. Transfer with sequence number seq is stored in slot
+ * seq % slot_count, so when ring is full oldest transfers are overwritten.
+ * Record is valid when its seq field is nonzero, it is written as last.
+ * All values are in host byte order, see byte_order field.
+ */
+
+#define USBSNIFF_TRACE_MAGIC		"USBSNIFF"
+#define USBSNIFF_TRACE_VERSION		1
+#define USBSNIFF_TRACE_BYTE_ORDER	0x1A2B3C4D
+
+#define USBSNIFF_TRACE_SIZE		(16 * 1024 * 1024)
+#define USBSNIFF_TRACE_PAYLOAD		64
+#define USBSNIFF_TRACE_PAYLOAD_MAX	65536
+
+/* Same values as usbmon transfer types */
+#define USBSNIFF_TRACE_CONTROL		2
+#define USBSNIFF_TRACE_BULK		3
+
+/* Wait for all queued bulk transfers, only in traces recorded by 0xFFFF (USB_RECORD) */
+#define USBSNIFF_TRACE_FLUSH		0x80
+
+struct usbsniff_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t slot_size;
+	uint32_t slot_count;
+	uint32_t payload_size;
+	uint64_t next_seq;	/* sequence number of next record */
+	int64_t realtime_offset;	/* add to record time for nanoseconds since epoch */
+	uint32_t pid;
+	uint32_t reserved;
+};
+
+struct usbsniff_trace_record {
+	uint64_t seq;	/* sequence number + 1, zero for empty or incomplete slot */
+	uint64_t start;	/* CLOCK_MONOTONIC nanoseconds when transfer was submitted */
+	uint64_t end;	/* CLOCK_MONOTONIC nanoseconds when transfer was completed */
+	uint8_t type;
+	uint8_t ep;	/* endpoint with direction bit, 0x00 or 0x80 for control transfer */
+	uint8_t requesttype;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	int32_t size;	/* requested size */
+	int32_t ret;	/* transferred size or negative error */
+	uint32_t captured;	/* number of payload bytes stored after record */
+	uint32_t timeout;
+};
+
+#endif
@@ -35,6 +35,10 @@
 #include "fiasco.h"
 #include "device.h"
 #include "operations.h"
+#include "journal.h"
+#include "parallel.h"
+#include "disk.h"
+#include "usb-replay.h"
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -54,10 +58,22 @@ static void show_usage(void) {
 		" -r              reboot device\n"
 		" -l              load kernel and initfs images to RAM\n"
 		" -f              flash all specified images\n"
+		" -j              incremental flash, skip images which are already flashed\n"
+		"                 and write only changed blocks of mmc images\n"
+		" -V              verify mmc images after flashing by reading them back\n"
 		" -c              cold flash 2nd and secondary images\n"
+		" -a              flash, cold flash or reboot all connected devices in parallel\n"
+		" -A list         like -a, but only devices with serial number or USB bus path\n"
+		"                 in comma separated list\n"
 		" -x [/dev/mtd]   check for bad blocks on mtd device (default: all)\n"
 		" -E file         dump all device images to one fiasco image\n"
 		" -e [dir]        dump all device images (or one -t) to directory (default: current)\n"
+		" -z              sparse dump, leave zero blocks of mmc images as holes\n"
+#ifdef WITH_ZSTD
+		" -Z              compress dumped mmc images to seekable zstd format\n"
+#endif
+		" -B file         incremental dump, write only mmc blocks changed since block\n"
+		"                 hash manifest file to existing dump, then update manifest\n"
 		"\n"
 
 		"Device configuration:\n"
@@ -375,6 +391,21 @@ void filter_images_by_device(enum device device, struct image_list ** image_firs
 
 }
 
+static void remove_images_by_type(enum image_type type, struct image_list ** image_first) {
+
+	struct image_list * image_ptr = *image_first;
+	while ( image_ptr ) {
+		struct image_list * next = image_ptr->next;
+		if ( image_ptr->image->type == type ) {
+			if ( image_ptr == *image_first )
+				*image_first = next;
+			image_list_del(image_ptr);
+		}
+		image_ptr = next;
+	}
+
+}
+
 void filter_images_by_hwrev(int16_t hwrev, struct image_list ** image_first) {
 
 	struct image_list * image_ptr = *image_first;
@@ -414,7 +445,7 @@ static const char * image_tmp_name(enum image_type type) {
 int main(int argc, char **argv) {
 
 	const char * optstring = ":"
-	"b:rlfcx:E:e:"
+	"b:rlfjVcaA:x:E:e:zB:"
 	"ID:U:R:F:H:K:T:N:S:C:"
 	"M:m:"
 	"t:d:w:"
@@ -423,6 +454,9 @@ int main(int argc, char **argv) {
 	"p"
 	"Q"
 	"snvh"
+#ifdef WITH_ZSTD
+	"Z"
+#endif
 	"";
 	int c;
 
@@ -434,6 +468,8 @@ int main(int argc, char **argv) {
 	char * dev_boot_arg = NULL;
 	int dev_load = 0;
 	int dev_cold_flash = 0;
+	int dev_parallel = 0;
+	char * dev_parallel_arg = NULL;
 
 	int dev_check = 0;
 	char * dev_check_arg = NULL;
@@ -443,6 +479,7 @@ int main(int argc, char **argv) {
 	char * dev_dump_arg = NULL;
 
 	int dev_flash = 0;
+	int dev_incremental = 0;
 	int dev_reboot = 0;
 	int dev_ident = 0;
 
@@ -577,6 +614,13 @@ int main(int argc, char **argv) {
 			case 'c':
 				dev_cold_flash = 1;
 				break;
+			case 'a':
+				dev_parallel = 1;
+				break;
+			case 'A':
+				dev_parallel = 1;
+				dev_parallel_arg = optarg;
+				break;
 
 			case 'x':
 				dev_check = 1;
@@ -596,10 +640,28 @@ int main(int argc, char **argv) {
 				else
 					--optind;
 				break;
+			case 'z':
+				disk_sparse = 1;
+				break;
+			case 'B':
+				disk_manifest = optarg;
+				break;
+#ifdef WITH_ZSTD
+			case 'Z':
+				disk_zstd = 1;
+				break;
+#endif
 
 			case 'f':
 				dev_flash = 1;
 				break;
+			case 'j':
+				dev_incremental = 1;
+				disk_compare = 1;
+				break;
+			case 'V':
+				disk_verify = 1;
+				break;
 			case 'r':
 				dev_reboot = 1;
 				break;
@@ -861,18 +923,9 @@ int main(int argc, char **argv) {
 
 	}
 
-	/* remove 2nd image when doing normal flash */
-	if ( dev_flash ) {
-		image_ptr = image_first;
-		while ( image_ptr ) {
-			struct image_list * next = image_ptr->next;
-			if ( image_ptr->image->type == IMAGE_2ND ) {
-				if ( image_ptr == image_first )
-					image_first = next;
-				image_list_del(image_ptr);
-			}
-			image_ptr = next;
-		}
+	/* remove 2nd image when doing normal flash, with cold flash it is removed after cold flashing */
+	if ( dev_flash && ! dev_cold_flash ) {
+		remove_images_by_type(IMAGE_2ND, &image_first);
 
 		/* make sure that fiasco_in has valid images */
 		if ( fiasco_in )
@@ -973,6 +1026,12 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if ( dev_incremental && ! dev_flash ) {
+		ERROR("Option incremental flash can be used only with flash");
+		ret = 1;
+		goto clean;
+	}
+
 	if ( dev_load && dev_flash ) {
 		ERROR("Options load and flash cannot be used together");
 		ret = 1;
@@ -991,6 +1050,19 @@ int main(int argc, char **argv) {
 		goto clean;
 	}
 
+	if ( dev_parallel && ( dev_boot || dev_load || dev_ident || dev_check || dev_dump_fiasco || dev_dump || set_root || set_usb || set_rd || set_rd_flags || set_hw || set_kernel || set_initfs || set_nolo || set_sw || set_emmc ) ) {
+		ERROR("Option parallel can be used only with flash, cold flash and reboot");
+		ret = 1;
+		goto clean;
+	}
+
+	/* flash more devices at once */
+	if ( dev_parallel && do_device ) {
+		ret = parallel_flash(dev_parallel_arg, dev_flash ? image_first : NULL, dev_cold_flash ? image_2nd : NULL, dev_cold_flash ? image_secondary : NULL, ( dev_flash && fiasco_in && fiasco_in->swver[0] ) ? fiasco_in->swver : NULL, dev_incremental, dev_reboot);
+		ret = ( ret == 0 ) ? 0 : 1;
+		goto clean;
+	}
+
 	/* operations */
 	if ( do_device ) {
 
@@ -1012,6 +1084,8 @@ int main(int argc, char **argv) {
 			/* cold flash */
 			if ( dev_cold_flash ) {
 
+				enum device cold_device = dev->detected_device;
+
 				ret = dev_cold_flash_images(dev, image_2nd, image_secondary);
 				dev_free(dev);
 				dev = NULL;
@@ -1025,6 +1099,13 @@ int main(int argc, char **argv) {
 					goto clean;
 
 				if ( dev_flash ) {
+					remove_images_by_type(IMAGE_2ND, &image_first);
+					image_2nd = NULL;
+					/* device is known from ASIC ID, so prepare images before device boots to NOLO */
+					if ( cold_device )
+						filter_images_by_device(cold_device, &image_first);
+					if ( fiasco_in )
+						fiasco_in->first = image_first;
 					dev_cold_flash = 0;
 					again = 1;
 					continue;
@@ -1212,6 +1293,83 @@ int main(int argc, char **argv) {
 
 			/* flash */
 			if ( dev_flash ) {
+				struct image_list * image_session = NULL;
+
+				/* skip images which device reports and flash journal records as already flashed */
+				if ( dev_incremental ) {
+					image_ptr = image_first;
+					while ( image_ptr ) {
+						struct image_list * next = image_ptr->next;
+						switch ( image_ptr->image->type ) {
+							case IMAGE_XLOADER:
+							case IMAGE_SECONDARY:
+								ptr = nolo_ver;
+								break;
+
+							case IMAGE_KERNEL:
+								ptr = kernel_ver;
+								break;
+
+							case IMAGE_INITFS:
+								ptr = initfs_ver;
+								break;
+
+							case IMAGE_ROOTFS:
+								ptr = sw_ver;
+								break;
+
+							case IMAGE_MMC:
+								ptr = content_ver;
+								break;
+
+							default:
+								ptr = NULL;
+								break;
+						}
+						if ( journal_is_flashed(dev_get_serial(dev), image_ptr->image) && ( ! ptr || ! ptr[0] || ! image_ptr->image->version || strcmp(ptr, image_ptr->image->version) == 0 ) ) {
+							printf("Skipping %s image, it is already flashed\n", image_type_to_string(image_ptr->image->type));
+							if ( image_ptr == image_first )
+								image_first = next;
+							image_list_del(image_ptr);
+						}
+						image_ptr = next;
+					}
+
+					if ( fiasco_in )
+						fiasco_in->first = image_first;
+				}
+
+				/* flash all images supported by current mode in one session without reconnecting device */
+				image_ptr = image_first;
+				while ( image_ptr ) {
+					struct image_list * next = image_ptr->next;
+					if ( dev_can_flash_image(dev, image_ptr->image) ) {
+						if ( image_ptr == image_first )
+							image_first = next;
+						image_list_add(&image_session, image_ptr->image);
+						image_list_unlink(image_ptr);
+						free(image_ptr);
+					}
+					image_ptr = next;
+				}
+
+				if ( fiasco_in )
+					fiasco_in->first = image_first;
+
+				if ( image_session ) {
+					ret = dev_flash_images(dev, image_session);
+					if ( ret == 0 && dev_incremental ) {
+						for ( image_ptr = image_session; image_ptr; image_ptr = image_ptr->next )
+							journal_record(dev_get_serial(dev), image_ptr->image);
+					}
+					while ( image_session ) {
+						struct image_list * next = image_session->next;
+						image_list_del(image_session);
+						image_session = next;
+					}
+				}
+
+				/* remaining images need to switch device to another mode */
 				image_ptr = image_first;
 				while ( image_ptr ) {
 					struct image_list * next = image_ptr->next;
@@ -1219,6 +1377,9 @@ int main(int argc, char **argv) {
 					if ( ret == -EAGAIN )
 						goto again;
 
+					if ( ret == 0 && dev_incremental )
+						journal_record(dev_get_serial(dev), image_ptr->image);
+
 					if ( image_ptr == image_first )
 						image_first = image_first->next;
 					if ( fiasco_in && image_ptr == fiasco_in->first )
@@ -1548,5 +1709,8 @@ clean:
 	if ( dev )
 		dev_free(dev);
 
+	if ( usb_replay_check() != 0 && ret == 0 )
+		ret = 1;
+
 	return ret;
 }
@@ -28,6 +28,7 @@
 #include "image.h"
 #include "device.h"
 #include "usb-device.h"
+#include "printf-utils.h"
 
 #define MKII_OUT	0x8810001B
 #define MKII_IN		0x8800101B
@@ -38,6 +39,60 @@
 #define MKII_REBOOT	0x0C
 #define MKII_RESPONCE	0x20
 
+#define MKII_IMAGE_START	0x03
+#define MKII_IMAGE_HEADER	0x04
+#define MKII_IMAGE_TRANSPORT	0x05
+#define MKII_IMAGE_STATUS	0x06
+#define MKII_IMAGE_DATA		0x08
+#define MKII_IMAGE_BUFFER	0x0B
+
+/* Raw image data are sent in chunks, every chunk is announced by MKII_IMAGE_DATA message */
+#define MKII_CHUNK_SIZE		(1024 * 1024)
+
+/* Maximal number of messages in one batch, see mkii_send_requests() */
+#define MKII_BATCH		8
+
+enum mkii_property {
+	MKII_PROTOCOL_VERSION,
+	MKII_PRODUCT_CODE,
+	MKII_HW_BUILD,
+	MKII_SUPPORTED_IMAGES,
+	MKII_SW_RELEASE,
+	MKII_PROPERTY_COUNT,
+};
+
+static const char * mkii_property_keys[] = {
+	[MKII_PROTOCOL_VERSION] = "/update/protocol_version",
+	[MKII_PRODUCT_CODE] = "/device/product_code",
+	[MKII_HW_BUILD] = "/device/hw_build",
+	[MKII_SUPPORTED_IMAGES] = "/update/supported_images",
+	[MKII_SW_RELEASE] = "/version/sw_release",
+};
+
+#define MKII_SUPPORT_SW_RELEASE	(1U << 0)
+#define MKII_UPDATE_MODE	(1U << 1)
+
+/* State of one connected Mk II device, allocated by mkii_init() and freed with device */
+struct mkii_session {
+	uint8_t seq;	/* sequence number of next message */
+	unsigned int flags;
+	unsigned long int images;	/* bitmap of supported image types */
+	unsigned int valid;	/* bitmap of cached properties */
+	char properties[MKII_PROPERTY_COUNT][256];	/* values returned by GET messages, they do not change while device is connected */
+	char out[MKII_BATCH * 512];	/* messages sent by host, more in one batch */
+	char in[2048];	/* last received message */
+};
+
+struct mkii_request {
+	uint8_t type;
+	const char * data;	/* for GET message key of property is sent */
+	size_t size;
+	int property;	/* property which is set from response of GET message, -1 for none */
+	int num;	/* sequence number of sent message */
+	int ret;	/* size of response data, negative when no valid response was received */
+	int status;	/* first byte of response data */
+};
+
 struct mkii_message {
 	uint32_t header;
 	uint16_t size;
@@ -48,34 +103,96 @@ struct mkii_message {
 } __attribute__((__packed__));
 
 
-static int mkii_send_receive(usb_dev_handle * udev, uint8_t type, struct mkii_message * in_msg, size_t data_size, struct mkii_message * out_msg, size_t out_size) {
+static const char * mkii_messages[] = {
+	[MKII_PING] = "ping",
+	[MKII_GET] = "get",
+	[MKII_TELL] = "tell",
+	[MKII_IMAGE_START] = "image start",
+	[MKII_IMAGE_HEADER] = "image header",
+	[MKII_IMAGE_TRANSPORT] = "image transport",
+	[MKII_IMAGE_STATUS] = "image status",
+	[MKII_IMAGE_DATA] = "image data",
+	[MKII_IMAGE_BUFFER] = "image buffer",
+	[MKII_REBOOT] = "reboot",
+};
+
+const char * mkii_message_to_string(int type) {
+
+	if ( type < 0 || (size_t)type >= sizeof(mkii_messages)/sizeof(mkii_messages[0]) )
+		return NULL;
+
+	return mkii_messages[type];
+
+}
+
+static struct mkii_session * mkii_session(struct usb_device_info * dev) {
+
+	if ( ! dev->protocol_data )
+		dev->protocol_data = calloc(1, sizeof(struct mkii_session));
+
+	return dev->protocol_data;
+
+}
 
+/* Message which is filled by caller and sent by mkii_send() */
+static struct mkii_message * mkii_request(struct usb_device_info * dev) {
+
+	return (struct mkii_message *)((struct mkii_session *)dev->protocol_data)->out;
+
+}
+
+/* Last message received by mkii_receive() */
+static struct mkii_message * mkii_response(struct usb_device_info * dev) {
+
+	return (struct mkii_message *)((struct mkii_session *)dev->protocol_data)->in;
+
+}
+
+/* Returns sequence number of sent message */
+static int mkii_send(struct usb_device_info * dev, uint8_t type, struct mkii_message * in_msg, size_t data_size) {
+
+	struct mkii_session * session = dev->protocol_data;
 	int ret;
-	static uint8_t number = 0;
 
 	in_msg->header = MKII_OUT;
 	in_msg->size = htons(data_size + 4);
 	in_msg->zero = 0;
-	in_msg->num = number++;
+	in_msg->num = session->seq++;
 	in_msg->type = type;
 
-	ret = usb_bulk_write(udev, USB_WRITE_EP, (char *)in_msg, data_size + sizeof(*in_msg), 5000);
+	dev->stats_request = type;
+
+	ret = usb_device_bulk_write(dev, USB_WRITE_EP, (char *)in_msg, data_size + sizeof(*in_msg), 5000);
 	if ( ret < 0 )
 		return ret;
 	if ( (size_t)ret != data_size + sizeof(*in_msg) )
 		return -1;
 
-	ret = usb_bulk_read(udev, USB_READ_EP, (char *)out_msg, out_size, 5000);
+	return in_msg->num;
+
+}
+
+/* Response is stored in mkii_response(), returns size of its data */
+static int mkii_receive(struct usb_device_info * dev, uint8_t type, uint8_t num) {
+
+	struct mkii_session * session = dev->protocol_data;
+	struct mkii_message * out_msg = mkii_response(dev);
+	int ret;
+
+	dev->stats_request = type;
+
+	/* Keep space for terminating null byte */
+	ret = usb_device_bulk_read(dev, USB_READ_EP, session->in, sizeof(session->in) - 1, 5000);
 	if ( ret < 0 )
 		return ret;
 
-	if ( out_msg->header != MKII_IN )
+	if ( (size_t)ret < sizeof(*out_msg) )
 		return -1;
 
-	if ( out_msg->type != (type | MKII_RESPONCE) )
+	if ( out_msg->header != MKII_IN )
 		return -1;
 
-	if ( (size_t)ret < sizeof(*out_msg) )
+	if ( out_msg->type != (type | MKII_RESPONCE) || out_msg->num != num )
 		return -1;
 
 	if ( ntohs(out_msg->size) != ret - sizeof(*out_msg) + 4 )
@@ -85,41 +202,214 @@ static int mkii_send_receive(usb_dev_handle * udev, uint8_t type, struct mkii_me
 
 }
 
+/* Send message filled in mkii_request() and wait for its response */
+static int mkii_send_receive(struct usb_device_info * dev, uint8_t type, size_t data_size) {
+
+	int num;
+
+	num = mkii_send(dev, type, mkii_request(dev), data_size);
+	if ( num < 0 )
+		return num;
+
+	return mkii_receive(dev, type, num);
+
+}
+
+/*
+ * Send all requests back to back and then read all responses. Responses are
+ * matched to requests by sequence number, so one exchange takes one round
+ * trip instead of one per message. Responses left from earlier failed
+ * exchange are skipped and on failure responses to already sent messages are
+ * drained, so next exchange stays in sync. Returns -1 when some response is
+ * missing. With one request this is ordinary lock-step exchange.
+ */
+static int mkii_send_requests(struct usb_device_info * dev, struct mkii_request * requests, int count) {
+
+	struct mkii_session * session;
+	struct mkii_message * msg;
+	size_t offset;
+	size_t size;
+	int pending;
+	int skipped;
+	int ret;
+	int i;
+
+	if ( count > MKII_BATCH )
+		return -1;
+
+	session = mkii_session(dev);
+	if ( ! session )
+		ALLOC_ERROR_RETURN(-1);
+
+	offset = 0;
+	pending = 0;
+	skipped = 0;
+
+	for ( i = 0; i < count; ++i ) {
+
+		if ( requests[i].type == MKII_GET && requests[i].property >= 0 ) {
+			requests[i].data = mkii_property_keys[requests[i].property];
+			requests[i].size = strlen(requests[i].data);
+		}
+
+		size = sizeof(*msg) + requests[i].size;
+		if ( offset + size > sizeof(session->out) )
+			goto err;
+
+		msg = (struct mkii_message *)(session->out + offset);
+		msg->header = MKII_OUT;
+		msg->size = htons(requests[i].size + 4);
+		msg->zero = 0;
+		msg->num = session->seq++;
+		msg->type = requests[i].type;
+		if ( requests[i].size )
+			memcpy(msg->data, requests[i].data, requests[i].size);
+
+		requests[i].num = msg->num;
+		requests[i].ret = -1;
+		requests[i].status = -1;
+
+		dev->stats_request = requests[i].type;
+		if ( usb_device_bulk_submit(dev, USB_WRITE_EP, (char *)msg, size, 5000) != 0 )
+			goto err;
+
+		++pending;
+		offset += size;
+
+	}
+
+	/* Device can answer first messages while later are still being sent */
+	while ( pending > 0 ) {
+
+		/* Responses usually come in order, so account transfer to oldest waiting request */
+		for ( i = 0; i < count; ++i )
+			if ( requests[i].ret < 0 )
+				break;
+		dev->stats_request = requests[i].type;
+
+		msg = mkii_response(dev);
+		ret = usb_device_bulk_read(dev, USB_READ_EP, session->in, sizeof(session->in) - 1, 5000);
+		if ( ret < (int)sizeof(*msg) || msg->header != MKII_IN || ntohs(msg->size) != ret - sizeof(*msg) + 4 )
+			goto err;
+
+		for ( i = 0; i < count; ++i )
+			if ( requests[i].ret < 0 && requests[i].num == msg->num && ( requests[i].type | MKII_RESPONCE ) == msg->type )
+				break;
+		if ( i == count ) {
+			/* Late response to message of earlier exchange */
+			if ( ++skipped > MKII_BATCH )
+				goto err;
+			continue;
+		}
+
+		--pending;
+		requests[i].ret = ret - sizeof(*msg);
+		requests[i].status = requests[i].ret > 0 ? (uint8_t)msg->data[0] : -1;
+
+		if ( requests[i].property >= 0 && requests[i].ret >= 2 && requests[i].status == 0 ) {
+			size = requests[i].ret - 1;
+			if ( size >= sizeof(session->properties[0]) )
+				size = sizeof(session->properties[0]) - 1;
+			memcpy(session->properties[requests[i].property], msg->data + 1, size);
+			session->properties[requests[i].property][size] = 0;
+			session->valid |= 1U << requests[i].property;
+		}
+
+	}
+
+	if ( usb_device_bulk_flush(dev) != 0 )
+		return -1;
+
+	return 0;
+
+err:
+	if ( pending > 0 ) {
+		/* Device answers every received message, stop at first timeout */
+		while ( pending-- > 0 && usb_device_bulk_read(dev, USB_READ_EP, session->in, sizeof(session->in) - 1, 1000) > 0 )
+			;
+		usb_device_bulk_flush(dev);
+	}
+	return -1;
+
+}
+
+/* Returns cached value of property, it is read from device only on first use */
+static const char * mkii_get_property(struct usb_device_info * dev, enum mkii_property property) {
+
+	struct mkii_session * session;
+	struct mkii_request request = { .type = MKII_GET, .property = property };
+
+	session = mkii_session(dev);
+	if ( ! session )
+		return NULL;
+
+	if ( ! ( session->valid & (1U << property) ) )
+		mkii_send_requests(dev, &request, 1);
+
+	if ( ! ( session->valid & (1U << property) ) )
+		return NULL;
+
+	return session->properties[property];
+
+}
+
+/*
+ * Original flasher was sniffed only sending one message and waiting for its
+ * response, so pipelining is used only when asked for by MKII_PIPELINE
+ * environment variable and transport can queue messages. With libusb 0.1
+ * every write blocks until device reads it.
+ */
+static int mkii_pipeline(struct usb_device_info * dev) {
+
+	return getenv("MKII_PIPELINE") && dev->transport->async;
+
+}
+
 int mkii_init(struct usb_device_info * dev) {
 
 	char buf[2048];
-	struct mkii_message * msg;
+	struct mkii_request ping = { .type = MKII_PING, .property = -1 };
+	struct mkii_request tell = { .type = MKII_TELL, .data = "/update/host_protocol_version\x00\x32", .size = sizeof("/update/host_protocol_version\x00\x32")-1, .property = -1 };
+	struct mkii_request requests[] = {
+		{ .type = MKII_GET, .property = MKII_PRODUCT_CODE },
+		{ .type = MKII_GET, .property = MKII_HW_BUILD },
+		{ .type = MKII_GET, .property = MKII_SUPPORTED_IMAGES },
+	};
+	struct mkii_session * session;
+	const char * version;
+	const char * images;
 	enum device device;
-	int ret;
 	char * newptr;
 	char * ptr;
 	enum image_type type;
 
 	printf("Initializing Mk II protocol...\n");
 
-	msg = (struct mkii_message *)buf;
+	session = mkii_session(dev);
+	if ( ! session )
+		ALLOC_ERROR_RETURN(-1);
 
-	ret = mkii_send_receive(dev->udev, MKII_PING, msg, 0, msg, sizeof(buf));
-	if ( ret != 0 )
+	if ( mkii_send_requests(dev, &ping, 1) != 0 || ping.ret != 0 )
 		ERROR_RETURN("Cannot ping device", -1);
 
-	memcpy(msg->data, "/update/protocol_version", sizeof("/update/protocol_version")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/update/protocol_version")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 )
-		ERROR_RETURN("Cannot get Mk II protocol version", -1);
+	/* Protocol version exchange must be first */
 
-	msg->data[ret] = 0;
+	version = mkii_get_property(dev, MKII_PROTOCOL_VERSION);
+	if ( ! version )
+		ERROR_RETURN("Cannot get Mk II protocol version", -1);
 
-	if ( ret == 2 && msg->data[1] == 0x32 )
-		dev->data |= MKII_SUPPORT_SW_RELEASE;
+	if ( strcmp(version, "2") == 0 )
+		session->flags |= MKII_SUPPORT_SW_RELEASE;
 
-	printf("Detected Mk II protocol version: %s\n", msg->data);
+	printf("Detected Mk II protocol version: %s\n", version);
 
-	memcpy(msg->data, "/update/host_protocol_version\x00\x32", sizeof("/update/host_protocol_version\x00\x32")-1);
-	ret = mkii_send_receive(dev->udev, MKII_TELL, msg, sizeof("/update/host_protocol_version\x00\x32")-1, msg, sizeof(buf));
-	if ( ret != 1 || msg->data[0] != 0 )
+	if ( mkii_send_requests(dev, &tell, 1) != 0 || tell.ret != 1 || tell.status != 0 )
 		ERROR_RETURN("Cannot send our protocol version", -1);
 
+	/* Properties not received in batch are read one by one on first use */
+	if ( mkii_pipeline(dev) )
+		mkii_send_requests(dev, requests, sizeof(requests)/sizeof(requests[0]));
+
 	device = mkii_get_device(dev);
 
 	if ( ! dev->device )
@@ -132,13 +422,12 @@ int mkii_init(struct usb_device_info * dev) {
 
 	dev->hwrev = mkii_get_hwrev(dev);
 
-	memcpy(msg->data, "/update/supported_images", sizeof("/update/supported_images")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/update/supported_images")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 )
+	images = mkii_get_property(dev, MKII_SUPPORTED_IMAGES);
+	if ( ! images )
 		ERROR_RETURN("Cannot get supported image types", -1);
 
-	msg->data[ret] = 0;
-	ptr = msg->data + 1;
+	snprintf(buf, sizeof(buf), "%s", images);
+	ptr = buf;
 
 	printf("Supported images by current device configuration:");
 
@@ -150,7 +439,7 @@ int mkii_init(struct usb_device_info * dev) {
 		}
 		type = image_type_from_string(ptr);
 		if ( type != IMAGE_UNKNOWN ) {
-			dev->data |= (1UL << type);
+			session->images |= (1UL << type);
 			printf(" %s", ptr);
 		}
 		ptr = newptr;
@@ -159,12 +448,12 @@ int mkii_init(struct usb_device_info * dev) {
 	printf("\n");
 
 	memset(buf, 0, sizeof(buf));
-	if ( usb_device(dev->udev)->descriptor.bNumConfigurations >= 1 )
+	if ( dev->udev && usb_device(dev->udev)->descriptor.bNumConfigurations >= 1 )
 		usb_get_string_simple(dev->udev, usb_device(dev->udev)->config[0].iConfiguration, buf, sizeof(buf));
 	if ( strncmp(buf, "Firmware Upgrade Configuration", sizeof("Firmware Upgrade Configuration")) == 0 )
-		dev->data |= MKII_UPDATE_MODE;
+		session->flags |= MKII_UPDATE_MODE;
 
-	printf("Mode: %s\n", (dev->data & MKII_UPDATE_MODE) ? "Update" : "PC Suite");
+	printf("Mode: %s\n", (session->flags & MKII_UPDATE_MODE) ? "Update" : "PC Suite");
 
 	return 0;
 
@@ -172,45 +461,188 @@ int mkii_init(struct usb_device_info * dev) {
 
 enum device mkii_get_device(struct usb_device_info * dev) {
 
-	char buf[2048];
+	const char * value;
+
+	value = mkii_get_property(dev, MKII_PRODUCT_CODE);
+	if ( ! value || ! value[0] )
+		return DEVICE_UNKNOWN;
+
+	return device_from_string(value);
+
+}
+
+
+/* Returns free space in device buffer for raw image data */
+static long int mkii_image_buffer(struct usb_device_info * dev) {
+
+	uint32_t size;
+	int ret;
+
+	memcpy(mkii_request(dev)->data, "\x00\x00\x00\x64", 4);
+	ret = mkii_send_receive(dev, MKII_IMAGE_BUFFER, 4);
+	if ( ret != 13 || mkii_response(dev)->data[0] != 0 )
+		return -1;
+
+	memcpy(&size, mkii_response(dev)->data + 8, 4);
+	return ntohl(size);
+
+}
+
+static int mkii_image_status(struct usb_device_info * dev) {
+
+	int ret;
+
+	memcpy(mkii_request(dev)->data, "\x00\x00\x00\x00", 4);
+	ret = mkii_send_receive(dev, MKII_IMAGE_STATUS, 4);
+	if ( ret != 21 || mkii_response(dev)->data[0] != 0 )
+		return -1;
+
+	return 0;
+
+}
+
+/* Wait until device has at least size bytes of free buffer space, returns free space */
+static long int mkii_image_wait_buffer(struct usb_device_info * dev, long int size) {
+
+	long int space;
+	long int last = -1;
+	int idle = 0;
+
+	while ( 1 ) {
+
+		space = mkii_image_buffer(dev);
+		if ( space < 0 || space >= size )
+			return space;
+
+		/* Device does not flash anything */
+		if ( space == last && ++idle > 3000 )
+			return -1;
+
+		if ( space != last )
+			idle = 0;
+
+		last = space;
+		MSLEEP(10);
+
+	}
+
+}
+
+/*
+ * Image data are sent in lock-step as in captured sessions: every chunk is
+ * announced by MKII_IMAGE_DATA message, its response is read and then chunk
+ * is sent as raw data on data endpoint. Before next chunk transfer status and
+ * buffer space are asked again. Chunk is read from image directly into
+ * transfer buffer and next chunk is read while previous one is transferred.
+ */
+static int mkii_send_image_data(struct usb_device_info * dev, struct image * image, char * buf, size_t size, long int space) {
+
 	struct mkii_message * msg;
+	uint32_t need;
+	uint32_t next;
+	uint32_t sent;
+	uint32_t len;
+	int raw;
+	int cur;
 	int ret;
 
-	msg = (struct mkii_message *)buf;
+	msg = mkii_request(dev);
+
+	image_seek(image, 0);
+	sent = 0;
+	cur = 0;
+	raw = 0;
+
+	need = image->size;
+	if ( need > size )
+		need = size;
+	need = image_read(image, buf, need);
+	if ( need == 0 )
+		goto err;
+
+	while ( sent < image->size ) {
+
+		if ( sent > 0 ) {
+			if ( mkii_image_status(dev) < 0 )
+				goto err;
+			space = mkii_image_wait_buffer(dev, need);
+			if ( space < 0 )
+				goto err;
+		} else if ( space < (long int)need ) {
+			space = mkii_image_wait_buffer(dev, need);
+			if ( space < 0 )
+				goto err;
+		}
 
-	memcpy(msg->data, "/device/product_code", sizeof("/device/product_code")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/device/product_code")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
-		return DEVICE_UNKNOWN;
+		len = htonl(need);
+		memcpy(msg->data, "\x00\x00\x00\x00", 4);
+		memcpy(msg->data + 4, &len, 4);
+
+		ret = mkii_send_receive(dev, MKII_IMAGE_DATA, 8);
+		if ( ret != 1 || mkii_response(dev)->data[0] != 0 )
+			goto err;
+
+		if ( usb_device_bulk_submit(dev, USB_WRITE_DATA_EP, buf + cur * size, need, 5000) != 0 )
+			goto err;
+		raw = 1;
+
+		sent += need;
+		printf_progressbar(sent, image->size);
+
+		/* Read next chunk while current one is transferred */
+		next = 0;
+		if ( sent < image->size ) {
+			next = image->size - sent;
+			if ( next > size )
+				next = size;
+			next = image_read(image, buf + !cur * size, next);
+			if ( next == 0 )
+				goto err;
+		}
+
+		raw = 0;
+		if ( usb_device_bulk_flush(dev) != 0 )
+			goto err;
+
+		need = next;
+		cur = !cur;
+
+	}
+
+	return 0;
 
-	msg->data[ret] = 0;
-	return device_from_string((char *)msg->data+1);
+err:
+	if ( raw )
+		usb_device_bulk_flush(dev);
+	PRINTF_END();
+	ERROR_RETURN("Sending image failed", -1);
 
 }
 
 int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 
-	char buf1[512];
-	char buf[2048];
-	struct mkii_message * msg1;
+	struct mkii_session * session;
 	struct mkii_message * msg;
 	char * ptr;
 	const char * type;
 	uint8_t len;
 	uint16_t hash;
 	uint32_t size;
+	long int space;
+	size_t chunk;
 	int ret;
 
-	ERROR("Not implemented yet");
-	return -1;
+	session = mkii_session(dev);
+	if ( ! session )
+		ALLOC_ERROR_RETURN(-1);
 
-	if ( ! ( dev->data & (1UL << image->type) ) ) {
+	if ( ! ( session->images & (1UL << image->type) ) ) {
 		ERROR("Flashing image %s is not supported in current device configuration", image_type_to_string(image->type));
 		return -1;
 	}
 
-	msg = (struct mkii_message *)buf;
-	msg1 = (struct mkii_message *)buf1;
+	/* Image header is prepared in request buffer, start message below has no data so it is kept */
+	msg = mkii_request(dev);
 	ptr = msg->data;
 
 	/* File data header */
@@ -326,15 +758,59 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 	memcpy(ptr, "\x00", 1);
 	ptr += 1;
 
-	ret = mkii_send_receive(dev->udev, 0x03, msg1, 0, msg1, sizeof(buf1));
-	if ( ret != 1 || msg1->data[0] != 0 )
-		return -1;
+	printf("Send and flash image:\n");
+	image_print_info(image);
 
-	ret = mkii_send_receive(dev->udev, 0x04, msg, ptr - msg->data, msg, sizeof(buf));
-	if ( ret != 9 )
+	if ( simulate ) {
+		printf("Done\n");
+		return 0;
+	}
+
+	printf("Sending image header...\n");
+
+	ret = mkii_send_receive(dev, MKII_IMAGE_START, 0);
+	if ( ret != 1 || mkii_response(dev)->data[0] != 0 )
+		ERROR_RETURN("Cannot start image transfer", -1);
+
+	ret = mkii_send_receive(dev, MKII_IMAGE_HEADER, ptr - msg->data);
+	if ( ret != 9 || mkii_response(dev)->data[0] != 0 )
+		ERROR_RETURN("Sending image header failed", -1);
+
+	memcpy(msg->data, "\x00\x00\x00\x00" "usb:raw", 4 + sizeof("usb:raw")-1);
+	ret = mkii_send_receive(dev, MKII_IMAGE_TRANSPORT, 4 + sizeof("usb:raw")-1);
+	if ( ret != 1 || mkii_response(dev)->data[0] != 0 )
+		ERROR_RETURN("Cannot select raw USB transport for image data", -1);
+
+	if ( mkii_image_status(dev) < 0 )
+		ERROR_RETURN("Cannot get image transfer status", -1);
+
+	space = mkii_image_buffer(dev);
+	if ( space <= 0 )
+		ERROR_RETURN("Cannot get size of device image buffer", -1);
+
+	chunk = MKII_CHUNK_SIZE;
+	if ( (long int)chunk > space )
+		chunk = space;
+
+	ptr = usb_device_buffer_alloc(dev, 2 * chunk);
+	if ( ! ptr )
+		ALLOC_ERROR_RETURN(-1);
+
+	printf("Sending and flashing image...\n");
+	printf_progressbar(0, image->size);
+
+	ret = mkii_send_image_data(dev, image, ptr, chunk, space);
+	usb_device_buffer_free(dev, ptr);
+	if ( ret < 0 )
 		return -1;
 
-	/* TODO: send image itself */
+	printf("Finishing flashing...\n");
+
+	/* Image is flashed when device buffer is empty again */
+	if ( mkii_image_wait_buffer(dev, space) < 0 || mkii_image_status(dev) < 0 )
+		ERROR_RETURN("Finishing failed", -1);
+
+	printf("Done\n");
 
 	return 0;
 
@@ -342,13 +818,14 @@ int mkii_flash_image(struct usb_device_info * dev, struct image * image) {
 
 int mkii_reboot_device(struct usb_device_info * dev, int update) {
 
-	char buf[2048];
-	struct mkii_message * msg;
+	struct mkii_session * session;
 	const char * str;
 	int len;
 	int ret;
 
-	msg = (struct mkii_message *)buf;
+	session = mkii_session(dev);
+	if ( ! session )
+		ALLOC_ERROR_RETURN(-1);
 
 	if ( update ) {
 		printf("Rebooting device to Update mode...\n");
@@ -360,20 +837,37 @@ int mkii_reboot_device(struct usb_device_info * dev, int update) {
 		str = "reboot";
 	}
 
-	memcpy(msg->data, str, len);
-	ret = mkii_send_receive(dev->udev, MKII_REBOOT, msg, len, msg, sizeof(buf));
-	if ( ret != 1 || msg->data[0] != 0 )
+	memcpy(mkii_request(dev)->data, str, len);
+	ret = mkii_send_receive(dev, MKII_REBOOT, len);
+	if ( ret != 1 || mkii_response(dev)->data[0] != 0 )
 		ERROR_RETURN("Cannot send reboot command", -1);
 
-	if (dev->data & MKII_UPDATE_MODE)
-		MSLEEP(100);
+	/* Do not find device again before it reboots */
+	if (session->flags & MKII_UPDATE_MODE)
+		usb_wait_for_disconnect(dev, 100);
 	else
-		MSLEEP(3000);
+		usb_wait_for_disconnect(dev, 3000);
 
 	return 0;
 
 }
 
+int mkii_is_update_mode(struct usb_device_info * dev) {
+
+	struct mkii_session * session = dev->protocol_data;
+
+	return session && ( session->flags & MKII_UPDATE_MODE );
+
+}
+
+int mkii_is_image_supported(struct usb_device_info * dev, enum image_type type) {
+
+	struct mkii_session * session = dev->protocol_data;
+
+	return session && ( session->images & (1UL << type) );
+
+}
+
 int mkii_get_root_device(struct usb_device_info * dev) {
 
 	ERROR("Not implemented yet");
@@ -446,19 +940,13 @@ int mkii_set_rd_flags(struct usb_device_info * dev, const char * flags) {
 
 int16_t mkii_get_hwrev(struct usb_device_info * dev) {
 
-	char buf[2048];
-	struct mkii_message * msg;
-	int ret;
+	const char * value;
 
-	msg = (struct mkii_message *)buf;
-
-	memcpy(msg->data, "/device/hw_build", sizeof("/device/hw_build")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/device/hw_build")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
+	value = mkii_get_property(dev, MKII_HW_BUILD);
+	if ( ! value || ! value[0] )
 		ERROR_RETURN("Cannot get hw revision", -1);
 
-	msg->data[ret] = 0;
-	return atoi(msg->data+1);
+	return atoi(value);
 
 }
 
@@ -530,22 +1018,17 @@ int mkii_set_nolo_ver(struct usb_device_info * dev, const char * ver) {
 
 int mkii_get_sw_ver(struct usb_device_info * dev, char * ver, size_t size) {
 
-	char buf[2048];
-	struct mkii_message * msg;
-	int ret;
+	struct mkii_session * session = dev->protocol_data;
+	const char * value;
 
-	if ( ! ( dev->data & MKII_SUPPORT_SW_RELEASE ) )
+	if ( ! session || ! ( session->flags & MKII_SUPPORT_SW_RELEASE ) )
 		return -1;
 
-	msg = (struct mkii_message *)buf;
-
-	memcpy(msg->data, "/version/sw_release", sizeof("/version/sw_release")-1);
-	ret = mkii_send_receive(dev->udev, MKII_GET, msg, sizeof("/version/sw_release")-1, msg, sizeof(buf));
-	if ( ret < 2 || msg->data[0] != 0 || msg->data[1] == 0 )
+	value = mkii_get_property(dev, MKII_SW_RELEASE);
+	if ( ! value || ! value[0] )
 		ERROR_RETURN("Cannot get sw release", -1);
 
-	msg->data[ret] = 0;
-	strncpy(ver, msg->data+1, size);
+	strncpy(ver, value, size);
 	ver[size-1] = 0;
 	return strlen(ver);
 
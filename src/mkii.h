@@ -24,16 +24,19 @@
 #include "device.h"
 #include "usb-device.h"
 
-#define MKII_SUPPORT_SW_RELEASE	(1UL << 30)
-#define MKII_UPDATE_MODE	(1UL << 31)
-
+/* Mk II session state is kept in usb_device_info.protocol_data */
 int mkii_init(struct usb_device_info * dev);
 
+const char * mkii_message_to_string(int type);
+
 enum device mkii_get_device(struct usb_device_info * dev);
 
 int mkii_flash_image(struct usb_device_info * dev, struct image * image);
 int mkii_reboot_device(struct usb_device_info * dev, int update);
 
+int mkii_is_update_mode(struct usb_device_info * dev);
+int mkii_is_image_supported(struct usb_device_info * dev, enum image_type type);
+
 int mkii_get_root_device(struct usb_device_info * dev);
 int mkii_set_root_device(struct usb_device_info * dev, int device);
 
@@ -76,6 +76,34 @@
 #define NOLO_BOOT_MODE_NORMAL		0
 #define NOLO_BOOT_MODE_UPDATE		1
 
+static const char * nolo_requests[] = {
+	[NOLO_STATUS] = "status",
+	[NOLO_GET_NOLO_VERSION] = "get_nolo_version",
+	[NOLO_IDENTIFY] = "identify",
+	[NOLO_ERROR_LOG] = "error_log",
+	[NOLO_SET] = "set",
+	[NOLO_GET] = "get",
+	[NOLO_STRING] = "string",
+	[NOLO_SET_STRING] = "set_string",
+	[NOLO_GET_STRING] = "get_string",
+	[NOLO_SEND_IMAGE] = "send_image",
+	[NOLO_SET_SW_RELEASE] = "set_sw_release",
+	[NOLO_FLASH_IMAGE] = "flash_image",
+	[NOLO_SEND_FLASH_FINISH] = "send_flash_finish",
+	[NOLO_SEND_FLASH_IMAGE] = "send_flash_image",
+	[NOLO_BOOT] = "boot",
+	[NOLO_REBOOT] = "reboot",
+};
+
+const char * nolo_request_to_string(int request) {
+
+	if ( request < 0 || (size_t)request >= sizeof(nolo_requests)/sizeof(nolo_requests[0]) )
+		return NULL;
+
+	return nolo_requests[request];
+
+}
+
 #define NOLO_ERROR_RETURN(str, ...) do { nolo_error_log(dev, str == NULL); ERROR_RETURN(str, __VA_ARGS__); } while (0)
 
 static void nolo_error_log(struct usb_device_info * dev, int only_clear) {
@@ -88,7 +116,7 @@ static void nolo_error_log(struct usb_device_info * dev, int only_clear) {
 
 		memset(buf, 0, sizeof(buf));
 
-		ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_ERROR_LOG, 0, 0, buf, sizeof(buf), 2000);
+		ret = usb_device_control_msg(dev, NOLO_QUERY, NOLO_ERROR_LOG, 0, 0, buf, sizeof(buf), 2000);
 		if ( ret < 0 )
 			break;
 
@@ -118,7 +146,7 @@ static int nolo_identify_string(struct usb_device_info * dev, const char * str,
 
 	memset(buf, 0, sizeof(buf));
 
-	ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_IDENTIFY, 0, 0, (char *)buf, sizeof(buf), 2000);
+	ret = usb_device_control_msg(dev, NOLO_QUERY, NOLO_IDENTIFY, 0, 0, (char *)buf, sizeof(buf), 2000);
 	if ( ret < 0 )
 		NOLO_ERROR_RETURN("NOLO_IDENTIFY failed", -1);
 
@@ -148,10 +176,10 @@ static int nolo_set_string(struct usb_device_info * dev, char * str, char * arg)
 	if ( simulate )
 		return 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_STRING failed", -1);
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET_STRING, 0, 0, arg, strlen(arg), 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET_STRING, 0, 0, arg, strlen(arg), 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_SET_STRING failed", -1);
 
 	return 0;
@@ -162,10 +190,10 @@ static int nolo_get_string(struct usb_device_info * dev, char * str, char * out,
 
 	int ret = 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_STRING, 0, 0, str, strlen(str), 2000) < 0 )
 		return -1;
 
-	if ( ( ret = usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET_STRING, 0, 0, out, size-1, 2000) ) < 0 )
+	if ( ( ret = usb_device_control_msg(dev, NOLO_QUERY, NOLO_GET_STRING, 0, 0, out, size-1, 2000) ) < 0 )
 		return -1;
 
 	if ( (size_t)ret > size-1 )
@@ -209,7 +237,7 @@ int nolo_init(struct usb_device_info * dev) {
 	printf("Initializing NOLO...\n");
 
 	while ( val != 0 )
-		if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_STATUS, 0, 0, (char *)&val, 4, 2000) == -1 )
+		if ( usb_device_control_msg(dev, NOLO_QUERY, NOLO_STATUS, 0, 0, (char *)&val, 4, 2000) == -1 )
 			NOLO_ERROR_RETURN("NOLO_STATUS failed", -1);
 
 	/* clear error log */
@@ -242,24 +270,16 @@ enum device nolo_get_device(struct usb_device_info * dev) {
 
 }
 
-static int nolo_send_image(struct usb_device_info * dev, struct image * image, int flash) {
+#define NOLO_BUF_SIZE		0x20000
+#define NOLO_HEADER_SIZE	1024
+
+static int nolo_image_header(struct usb_device_info * dev, struct image * image, int flash, char * buf) {
 
-	char buf[0x20000];
 	char * ptr;
 	const char * type;
 	uint8_t len;
 	uint16_t hash;
 	uint32_t size;
-	uint32_t need;
-	uint32_t sent;
-	int request;
-	int ret;
-
-	if ( flash )
-		printf("Send and flash image:\n");
-	else
-		printf("Load image:\n");
-	image_print_info(image);
 
 	if ( image->type == IMAGE_2ND || image->type == IMAGE_MMC )
 		ERROR_RETURN("Sending 2nd and mmc images are not supported", -1);
@@ -364,6 +384,31 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 		ptr += len;
 	}
 
+	return ptr - buf;
+
+}
+
+static size_t nolo_prefetch_image(struct image * image, char * buf, size_t size) {
+
+	if ( size > image->size )
+		size = image->size;
+
+	image_seek(image, 0);
+	return image_read(image, buf, size);
+
+}
+
+/* Buffer has two halves of given size, prefetched data are in first half */
+static int nolo_send_image_data(struct usb_device_info * dev, struct image * image, int flash, char * hdr, int hdr_size, char * buf, size_t size, size_t prefetched) {
+
+	uint32_t need;
+	uint32_t sent;
+	char * chunk;
+	int request;
+	int pending;
+	int cur;
+	int ret;
+
 	if ( flash )
 		request = NOLO_SEND_FLASH_IMAGE;
 	else
@@ -372,7 +417,7 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 	printf("Sending image header...\n");
 
 	if ( ! simulate ) {
-		if ( usb_control_msg(dev->udev, NOLO_WRITE, request, 0, 0, buf, ptr-buf, 2000) < 0 )
+		if ( usb_device_control_msg(dev, NOLO_WRITE, request, 0, 0, hdr, hdr_size, 2000) < 0 )
 			NOLO_ERROR_RETURN("Sending image header failed", -1);
 	}
 
@@ -381,29 +426,55 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 	else
 		printf("Sending image...\n");
 	printf_progressbar(0, image->size);
-	image_seek(image, 0);
+	if ( ! prefetched )
+		image_seek(image, 0);
 	sent = 0;
+	cur = 0;
+	pending = 0;
 	while ( sent < image->size ) {
-		need = image->size - sent;
-		if ( need > sizeof(buf) )
-			need = sizeof(buf);
-		ret = image_read(image, buf, need);
-		if ( ret == 0 )
-			break;
+		chunk = buf + cur * size;
+		if ( prefetched ) {
+			/* First chunk was already read while previous image was flashing */
+			ret = prefetched;
+			prefetched = 0;
+		} else {
+			/* Read next chunk while previous one is still transferred */
+			need = image->size - sent;
+			if ( need > size )
+				need = size;
+			ret = image_read(image, chunk, need);
+			if ( ret == 0 )
+				break;
+		}
 		if ( ! simulate ) {
-			if ( usb_bulk_write(dev->udev, USB_WRITE_DATA_EP, buf, ret, 5000) != ret ) {
+			/* Previous chunk must be finished before its buffer half is reused */
+			if ( ( pending && usb_device_bulk_flush(dev) != 0 ) || usb_device_bulk_submit(dev, USB_WRITE_DATA_EP, chunk, ret, 5000) != 0 ) {
+				usb_device_bulk_flush(dev);
 				PRINTF_END();
 				NOLO_ERROR_RETURN("Sending image failed", -1);
 			}
+			pending = 1;
 		}
 		sent += ret;
 		printf_progressbar(sent, image->size);
+		cur = !cur;
+	}
+
+	if ( pending && usb_device_bulk_flush(dev) != 0 ) {
+		PRINTF_END();
+		NOLO_ERROR_RETURN("Sending image failed", -1);
 	}
 
+	return 0;
+
+}
+
+static int nolo_send_image_finish(struct usb_device_info * dev, int flash) {
+
 	if ( flash ) {
 		printf("Finishing flashing...\n");
 		if ( ! simulate ) {
-			if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SEND_FLASH_FINISH, 0, 0, NULL, 0, 30000) < 0 )
+			if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SEND_FLASH_FINISH, 0, 0, NULL, 0, 30000) < 0 )
 				NOLO_ERROR_RETURN("Finishing failed", -1);
 		}
 	}
@@ -414,6 +485,36 @@ static int nolo_send_image(struct usb_device_info * dev, struct image * image, i
 
 }
 
+static int nolo_send_image(struct usb_device_info * dev, struct image * image, int flash) {
+
+	char * buf;
+	char hdr[NOLO_HEADER_SIZE];
+	int hdr_size;
+	int ret;
+
+	if ( flash )
+		printf("Send and flash image:\n");
+	else
+		printf("Load image:\n");
+	image_print_info(image);
+
+	hdr_size = nolo_image_header(dev, image, flash, hdr);
+	if ( hdr_size < 0 )
+		return -1;
+
+	buf = usb_device_buffer_alloc(dev, 2 * NOLO_BUF_SIZE);
+	if ( ! buf )
+		ALLOC_ERROR_RETURN(-1);
+
+	ret = nolo_send_image_data(dev, image, flash, hdr, hdr_size, buf, NOLO_BUF_SIZE, 0);
+	usb_device_buffer_free(dev, buf);
+	if ( ret < 0 )
+		return -1;
+
+	return nolo_send_image_finish(dev, flash);
+
+}
+
 int nolo_load_image(struct usb_device_info * dev, struct image * image) {
 
 	if ( image->type != IMAGE_KERNEL && image->type != IMAGE_INITFS )
@@ -423,10 +524,15 @@ int nolo_load_image(struct usb_device_info * dev, struct image * image) {
 
 }
 
-int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
+/* Rootfs is written by NOLO while receiving, other images are flashed after upload by NOLO_FLASH_IMAGE */
+static int nolo_image_flash_mode(struct image * image) {
+
+	return image->type == IMAGE_ROOTFS;
+
+}
+
+static int nolo_flash_image_finish(struct usb_device_info * dev, struct image * image, int flash) {
 
-	int ret;
-	int flash;
 	int index;
 	unsigned long long int part;
 	unsigned long long int total;
@@ -434,15 +540,6 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 	char buf[128];
 	char * ptr;
 
-	if ( image->type == IMAGE_ROOTFS )
-		flash = 1;
-	else
-		flash = 0;
-
-	ret = nolo_send_image(dev, image, flash);
-	if ( ret < 0 )
-		return ret;
-
 	if ( image->type == IMAGE_SECONDARY )
 		index = NOLO_IMAGE_BOOTLOADER;
 	else if ( image->type == IMAGE_KERNEL )
@@ -460,7 +557,7 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 		printf("Flashing image...\n");
 
 		if ( ! simulate ) {
-			if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_FLASH_IMAGE, 0, index, NULL, 0, 10000) )
+			if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_FLASH_IMAGE, 0, index, NULL, 0, 10000) )
 				NOLO_ERROR_RETURN("Flashing failed", -1);
 		}
 
@@ -555,6 +652,97 @@ int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
 
 }
 
+int nolo_flash_image(struct usb_device_info * dev, struct image * image) {
+
+	int ret;
+	int flash;
+
+	flash = nolo_image_flash_mode(image);
+
+	ret = nolo_send_image(dev, image, flash);
+	if ( ret < 0 )
+		return ret;
+
+	return nolo_flash_image_finish(dev, image, flash);
+
+}
+
+int nolo_flash_images(struct usb_device_info * dev, struct image_list * images) {
+
+	struct image_list * ptr;
+	char * buf[2] = { NULL, NULL };
+	char * hdrs = NULL;
+	int * hdr_sizes = NULL;
+	size_t prefetched[2] = { 0, 0 };
+	int count, i, cur;
+	int flash;
+	int ret = 0;
+
+	count = 0;
+	for ( ptr = images; ptr; ptr = ptr->next )
+		++count;
+
+	if ( count == 0 )
+		return 0;
+
+	buf[0] = usb_device_buffer_alloc(dev, 2 * NOLO_BUF_SIZE);
+	buf[1] = usb_device_buffer_alloc(dev, 2 * NOLO_BUF_SIZE);
+	hdrs = malloc(count * NOLO_HEADER_SIZE);
+	hdr_sizes = malloc(count * sizeof(*hdr_sizes));
+	if ( ! buf[0] || ! buf[1] || ! hdrs || ! hdr_sizes ) {
+		ALLOC_ERROR();
+		ret = -1;
+		goto clean;
+	}
+
+	/* Prepare all image headers before device is touched, so invalid image does not break session in the middle */
+	for ( ptr = images, i = 0; ptr; ptr = ptr->next, ++i ) {
+		hdr_sizes[i] = nolo_image_header(dev, ptr->image, nolo_image_flash_mode(ptr->image), hdrs + i * NOLO_HEADER_SIZE);
+		if ( hdr_sizes[i] < 0 ) {
+			ERROR("Cannot prepare header for %s image", image_type_to_string(ptr->image->type));
+			ret = -1;
+			goto clean;
+		}
+	}
+
+	printf("Flashing %d images in one session...\n", count);
+
+	cur = 0;
+	prefetched[cur] = nolo_prefetch_image(images->image, buf[cur], NOLO_BUF_SIZE);
+
+	for ( ptr = images, i = 0; ptr; ptr = ptr->next, ++i ) {
+
+		flash = nolo_image_flash_mode(ptr->image);
+
+		printf("Send and flash image:\n");
+		image_print_info(ptr->image);
+
+		if ( nolo_send_image_data(dev, ptr->image, flash, hdrs + i * NOLO_HEADER_SIZE, hdr_sizes[i], buf[cur], NOLO_BUF_SIZE, prefetched[cur]) < 0 ) {
+			ret = -1;
+			if ( ptr->next )
+				prefetched[!cur] = 0;
+		} else {
+			/* Read first chunk of next image before device starts writing current one */
+			if ( ptr->next )
+				prefetched[!cur] = nolo_prefetch_image(ptr->next->image, buf[!cur], NOLO_BUF_SIZE);
+			if ( nolo_send_image_finish(dev, flash) < 0 || nolo_flash_image_finish(dev, ptr->image, flash) < 0 )
+				ret = -1;
+		}
+
+		cur = !cur;
+
+	}
+
+clean:
+	usb_device_buffer_free(dev, buf[0]);
+	usb_device_buffer_free(dev, buf[1]);
+	free(hdrs);
+	free(hdr_sizes);
+	return ret;
+
+}
+
+
 int nolo_boot_device(struct usb_device_info * dev, const char * cmdline) {
 
 	int size = 0;
@@ -581,7 +769,7 @@ int nolo_boot_device(struct usb_device_info * dev, const char * cmdline) {
 		cmdline = NULL;
 	}
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_BOOT, mode, 0, (char *)cmdline, size, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_BOOT, mode, 0, (char *)cmdline, size, 2000) < 0 )
 		NOLO_ERROR_RETURN("Booting failed", -1);
 
 	return 0;
@@ -591,7 +779,7 @@ int nolo_boot_device(struct usb_device_info * dev, const char * cmdline) {
 int nolo_reboot_device(struct usb_device_info * dev) {
 
 	printf("Rebooting device...\n");
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_REBOOT, 0, 0, NULL, 0, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_REBOOT, 0, 0, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_REBOOT failed", -1);
 	return 0;
 
@@ -600,7 +788,7 @@ int nolo_reboot_device(struct usb_device_info * dev) {
 int nolo_get_root_device(struct usb_device_info * dev) {
 
 	uint8_t device = 0;
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_ROOT_DEVICE, (char *)&device, 1, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_QUERY, NOLO_GET, 0, NOLO_ROOT_DEVICE, (char *)&device, 1, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get root device", -1);
 	return device;
 
@@ -611,7 +799,7 @@ int nolo_set_root_device(struct usb_device_info * dev, int device) {
 	printf("Setting root device to %d...\n", device);
 	if ( simulate )
 		return 0;
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, device, NOLO_ROOT_DEVICE, NULL, 0, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET, device, NOLO_ROOT_DEVICE, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot set root device", -1);
 	return 0;
 
@@ -620,7 +808,7 @@ int nolo_set_root_device(struct usb_device_info * dev, int device) {
 int nolo_get_usb_host_mode(struct usb_device_info * dev) {
 
 	uint32_t enabled = 0;
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_USB_HOST_MODE, (void *)&enabled, 4, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_QUERY, NOLO_GET, 0, NOLO_USB_HOST_MODE, (void *)&enabled, 4, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get USB host mode status", -1);
 	return enabled ? 1 : 0;
 
@@ -631,7 +819,7 @@ int nolo_set_usb_host_mode(struct usb_device_info * dev, int enable) {
 	printf("%s USB host mode...\n", enable ? "Enabling" : "Disabling");
 	if ( simulate )
 		return 0;
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, enable, NOLO_USB_HOST_MODE, NULL, 0, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET, enable, NOLO_USB_HOST_MODE, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot change USB host mode status", -1);
 	return 0;
 
@@ -640,7 +828,7 @@ int nolo_set_usb_host_mode(struct usb_device_info * dev, int enable) {
 int nolo_get_rd_mode(struct usb_device_info * dev) {
 
 	uint8_t enabled = 0;
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_RD_MODE, (char *)&enabled, 1, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_QUERY, NOLO_GET, 0, NOLO_RD_MODE, (char *)&enabled, 1, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get R&D mode status", -1);
 	return enabled ? 1 : 0;
 
@@ -651,7 +839,7 @@ int nolo_set_rd_mode(struct usb_device_info * dev, int enable) {
 	printf("%s R&D mode...\n", enable ? "Enabling" : "Disabling");
 	if ( simulate )
 		return 0;
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, enable, NOLO_RD_MODE, NULL, 0, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET, enable, NOLO_RD_MODE, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot change R&D mode status", -1);
 	return 0;
 
@@ -664,7 +852,7 @@ int nolo_get_rd_flags(struct usb_device_info * dev, char * flags, size_t size) {
 	uint16_t add_flags = 0;
 	char * ptr = flags;
 
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET, 0, NOLO_ADD_RD_FLAGS, (char *)&add_flags, 2, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_QUERY, NOLO_GET, 0, NOLO_ADD_RD_FLAGS, (char *)&add_flags, 2, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get R&D flags", -1);
 
 	if ( add_flags & NOLO_RD_FLAG_NO_OMAP_WD )
@@ -764,10 +952,10 @@ int nolo_set_rd_flags(struct usb_device_info * dev, const char * flags) {
 	if ( simulate )
 		return 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, add_flags, NOLO_ADD_RD_FLAGS, NULL, 0, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET, add_flags, NOLO_ADD_RD_FLAGS, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot add R&D flags", -1);
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET, del_flags, NOLO_DEL_RD_FLAGS, NULL, 0, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET, del_flags, NOLO_DEL_RD_FLAGS, NULL, 0, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot del R&D flags", -1);
 
 	return 0;
@@ -827,7 +1015,7 @@ int nolo_get_nolo_ver(struct usb_device_info * dev, char * ver, size_t size) {
 
 	uint32_t version = 0;
 
-	if ( usb_control_msg(dev->udev, NOLO_QUERY, NOLO_GET_NOLO_VERSION, 0, 0, (char *)&version, 4, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_QUERY, NOLO_GET_NOLO_VERSION, 0, 0, (char *)&version, 4, 2000) < 0 )
 		NOLO_ERROR_RETURN("Cannot get NOLO version", -1);
 
 	if ( (version & 255) > 1 )
@@ -886,7 +1074,7 @@ int nolo_set_sw_ver(struct usb_device_info * dev, const char * ver) {
 	memcpy(ptr, ver, len);
 	ptr += len;
 
-	if ( usb_control_msg(dev->udev, NOLO_WRITE, NOLO_SET_SW_RELEASE, 0, 0, buf, ptr-buf, 2000) < 0 )
+	if ( usb_device_control_msg(dev, NOLO_WRITE, NOLO_SET_SW_RELEASE, 0, 0, buf, ptr-buf, 2000) < 0 )
 		NOLO_ERROR_RETURN("NOLO_SET_SW_RELEASE failed", -1);
 
 	return 0;
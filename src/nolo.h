@@ -25,10 +25,13 @@
 
 int nolo_init(struct usb_device_info * dev);
 
+const char * nolo_request_to_string(int request);
+
 enum device nolo_get_device(struct usb_device_info * dev);
 
 int nolo_load_image(struct usb_device_info * dev, struct image * image);
 int nolo_flash_image(struct usb_device_info * dev, struct image * image);
+int nolo_flash_images(struct usb_device_info * dev, struct image_list * images);
 int nolo_boot_device(struct usb_device_info * dev, const char * cmdline);
 int nolo_reboot_device(struct usb_device_info * dev);
 
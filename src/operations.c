@@ -30,18 +30,64 @@
 
 #include "operations.h"
 
-struct device_info * dev_detect(void) {
+/* Initialize protocol on already opened USB device, takes ownership of usb */
+struct device_info * dev_open_usb(struct usb_device_info * usb) {
 
 	int ret = 0;
 	struct device_info * dev = NULL;
-	struct usb_device_info * usb = NULL;
 
 	dev = calloc(1, sizeof(struct device_info));
-	if ( ! dev )
+	if ( ! dev ) {
+		ALLOC_ERROR();
+		goto clean;
+	}
+
+	dev->method = METHOD_USB;
+	dev->usb = usb;
+
+	if ( dev->usb->flash_device->protocol == FLASH_NOLO )
+		ret = nolo_init(dev->usb);
+	else if ( dev->usb->flash_device->protocol == FLASH_COLD )
+		ret = init_cold_flash(dev->usb);
+	else if ( dev->usb->flash_device->protocol == FLASH_MKII )
+		ret = mkii_init(dev->usb);
+	else if ( dev->usb->flash_device->protocol == FLASH_DISK )
+		ret = disk_init(dev->usb);
+	else {
+		ERROR("Unknown USB mode");
+		goto clean;
+	}
+
+	if ( ret < 0 )
 		goto clean;
 
+	dev->detected_device = dev_get_device(dev);
+	dev->detected_hwrev = dev_get_hwrev(dev);
+
+	if ( dev->detected_device && dev->usb->device && dev->detected_device != dev->usb->device ) {
+		ERROR("Bad device, expected %s, got %s", device_to_string(dev->usb->device), device_to_string(dev->detected_device));
+		goto clean;
+	}
+
+	return dev;
+
+clean:
+	usb_close_device(usb);
+	free(dev);
+	return NULL;
+
+}
+
+struct device_info * dev_detect(void) {
+
+	struct device_info * dev = NULL;
+	struct usb_device_info * usb = NULL;
+
 	/* LOCAL */
 	if ( local_init() == 0 ) {
+		dev = calloc(1, sizeof(struct device_info));
+		if ( ! dev )
+			return NULL;
 		dev->method = METHOD_LOCAL;
 		dev->detected_device = local_get_device();
 		dev->detected_hwrev = local_get_hwrev();
@@ -50,41 +96,9 @@ struct device_info * dev_detect(void) {
 
 	/* USB */
 	usb = usb_open_and_wait_for_device();
-	if ( usb ) {
-		dev->method = METHOD_USB;
-		dev->usb = usb;
-
-		if ( dev->usb->flash_device->protocol == FLASH_NOLO )
-			ret = nolo_init(dev->usb);
-		else if ( dev->usb->flash_device->protocol == FLASH_COLD )
-			ret = init_cold_flash(dev->usb);
-		else if ( dev->usb->flash_device->protocol == FLASH_MKII )
-			ret = mkii_init(dev->usb);
-		else if ( dev->usb->flash_device->protocol == FLASH_DISK )
-			ret = disk_init(dev->usb);
-		else {
-			ERROR("Unknown USB mode");
-			goto clean;
-		}
-
-		if ( ret < 0 )
-			goto clean;
-
-		dev->detected_device = dev_get_device(dev);
-		dev->detected_hwrev = dev_get_hwrev(dev);
-
-		if ( dev->detected_device && dev->usb->device && dev->detected_device != dev->usb->device ) {
-			ERROR("Bad device, expected %s, got %s", device_to_string(dev->usb->device), device_to_string(dev->detected_device));
-			goto clean;
-		}
-
-		return dev;
-	}
-
-clean:
 	if ( usb )
-		usb_close_device(usb);
-	free(dev);
+		return dev_open_usb(usb);
+
 	return NULL;
 
 }
@@ -110,7 +124,7 @@ enum device dev_get_device(struct device_info * dev) {
 		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
 
 		if ( protocol == FLASH_COLD )
-			return DEVICE_UNKNOWN;
+			return ( dev->usb->device == DEVICE_ANY ) ? DEVICE_UNKNOWN : dev->usb->device;
 		else if ( protocol == FLASH_NOLO )
 			return nolo_get_device(dev->usb);
 		else if ( protocol == FLASH_MKII )
@@ -124,6 +138,15 @@ enum device dev_get_device(struct device_info * dev) {
 
 }
 
+const char * dev_get_serial(struct device_info * dev) {
+
+	if ( dev->method == METHOD_USB && dev->usb->serial[0] )
+		return dev->usb->serial;
+
+	return NULL;
+
+}
+
 int dev_load_image(struct device_info * dev, struct image * image) {
 
 	if ( dev->method == METHOD_LOCAL ) {
@@ -185,7 +208,7 @@ int dev_flash_image(struct device_info * dev, struct image * image) {
 			usb_switch_to_update(dev->usb);
 			return -EAGAIN;
 		} else if ( protocol == FLASH_MKII ) {
-			if ( dev->usb->data & (1UL << image->type) )
+			if ( mkii_is_image_supported(dev->usb, image->type) )
 				return mkii_flash_image(dev->usb, image);
 		}
 
@@ -198,6 +221,42 @@ int dev_flash_image(struct device_info * dev, struct image * image) {
 
 }
 
+int dev_can_flash_image(struct device_info * dev, struct image * image) {
+
+	if ( dev->method == METHOD_LOCAL )
+		return 1;
+
+	if ( dev->method == METHOD_USB ) {
+
+		enum usb_flash_protocol protocol = dev->usb->flash_device->protocol;
+
+		if ( protocol == FLASH_NOLO )
+			return image->type != IMAGE_MMC;
+		else if ( protocol == FLASH_MKII )
+			return mkii_is_image_supported(dev->usb, image->type);
+
+	}
+
+	return 0;
+
+}
+
+int dev_flash_images(struct device_info * dev, struct image_list * images) {
+
+	int ret = 0;
+
+	if ( dev->method == METHOD_USB && dev->usb->flash_device->protocol == FLASH_NOLO )
+		return nolo_flash_images(dev->usb, images);
+
+	for ( ; images; images = images->next ) {
+		if ( dev_flash_image(dev, images->image) != 0 )
+			ret = -1;
+	}
+
+	return ret;
+
+}
+
 int dev_dump_image(struct device_info * dev, enum image_type image, const char * file) {
 
 	if ( dev->method == METHOD_LOCAL )
@@ -37,13 +37,17 @@ struct device_info {
 };
 
 struct device_info * dev_detect(void);
+struct device_info * dev_open_usb(struct usb_device_info * usb);
 void dev_free(struct device_info * dev);
 
 enum device dev_get_device(struct device_info * dev);
+const char * dev_get_serial(struct device_info * dev);
 
 int dev_cold_flash_images(struct device_info * dev, struct image * x2nd, struct image * secondary);
 int dev_load_image(struct device_info * dev, struct image * image);
 int dev_flash_image(struct device_info * dev, struct image * image);
+int dev_can_flash_image(struct device_info * dev, struct image * image);
+int dev_flash_images(struct device_info * dev, struct image_list * images);
 int dev_dump_image(struct device_info * dev, enum image_type image, const char * file);
 int dev_check_badblocks(struct device_info * dev, const char * device);
 
@@ -0,0 +1,638 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "global.h"
+#include "image.h"
+#include "device.h"
+#include "usb-device.h"
+#include "operations.h"
+#include "printf-utils.h"
+#include "journal.h"
+#include "parallel.h"
+
+/* Job which needs more reconnects is stuck in switching modes */
+#define PARALLEL_MAX_RECONNECTS	8
+
+enum parallel_state {
+	PARALLEL_RUNNING = 0,	/* worker thread is running */
+	PARALLEL_WAITING,	/* waiting until device is connected again */
+	PARALLEL_DONE,
+	PARALLEL_FAILED,
+	PARALLEL_IGNORED,	/* device does not match list of devices */
+};
+
+struct parallel;
+
+struct parallel_job {
+	struct parallel_job * next;
+	struct parallel * parallel;
+	enum parallel_state state;
+	pthread_t thread;
+	int joinable;
+	int reconnects;
+	char path[32];
+	char serial[64];
+	struct usb_device_info * usb;	/* opened device passed to worker */
+	struct image_list * images;	/* not flashed images, shared copies */
+	struct image * x2nd;
+	struct image * secondary;
+};
+
+struct parallel {
+	pthread_mutex_t lock;
+	struct parallel_job * jobs;
+	char * devices;	/* list of devices with ',' replaced by '\0' */
+	size_t devices_size;
+	struct image_list * images;
+	struct image * x2nd;
+	struct image * secondary;
+	const char * swver;
+	int incremental;
+	int reboot;
+};
+
+static const char * parallel_state_to_string(enum parallel_state state) {
+
+	switch ( state ) {
+		case PARALLEL_RUNNING:
+			return "running";
+		case PARALLEL_WAITING:
+			return "waiting for reconnect";
+		case PARALLEL_DONE:
+			return "done";
+		case PARALLEL_FAILED:
+			return "failed";
+		default:
+			return "ignored";
+	}
+
+}
+
+static void parallel_images_free(struct image_list ** images) {
+
+	while ( *images ) {
+		struct image_list * next = (*images)->next;
+		image_list_del(*images);
+		*images = next;
+	}
+
+}
+
+static void parallel_images_filter_device(enum device device, struct image_list ** images) {
+
+	struct image_list * image_ptr = *images;
+	while ( image_ptr ) {
+		struct image_list * next = image_ptr->next;
+		struct device_list * device_ptr = image_ptr->image->devices;
+		int match = 0;
+		while ( device_ptr ) {
+			if ( device_ptr->device == device || device_ptr->device == DEVICE_ANY ) {
+				match = 1;
+				break;
+			}
+			device_ptr = device_ptr->next;
+		}
+		if ( ! match ) {
+			if ( image_ptr == *images )
+				*images = next;
+			image_list_del(image_ptr);
+		}
+		image_ptr = next;
+	}
+
+}
+
+static void parallel_images_filter_hwrev(int16_t hwrev, struct image_list ** images) {
+
+	struct image_list * image_ptr = *images;
+	while ( image_ptr ) {
+		struct image_list * next = image_ptr->next;
+		if ( ! image_hwrev_is_valid(image_ptr->image, hwrev) ) {
+			if ( image_ptr == *images )
+				*images = next;
+			image_list_del(image_ptr);
+		}
+		image_ptr = next;
+	}
+
+}
+
+/* Same check as incremental flashing in main */
+static int parallel_is_flashed(struct parallel_job * job, struct device_info * dev, struct image * image) {
+
+	char ver[512];
+	int ret;
+
+	pthread_mutex_lock(&job->parallel->lock);
+	ret = journal_is_flashed(dev_get_serial(dev), image);
+	pthread_mutex_unlock(&job->parallel->lock);
+
+	if ( ! ret || ! image->version )
+		return ret;
+
+	ver[0] = 0;
+
+	switch ( image->type ) {
+		case IMAGE_XLOADER:
+		case IMAGE_SECONDARY:
+			dev_get_nolo_ver(dev, ver, sizeof(ver));
+			break;
+		case IMAGE_KERNEL:
+			dev_get_kernel_ver(dev, ver, sizeof(ver));
+			break;
+		case IMAGE_INITFS:
+			dev_get_initfs_ver(dev, ver, sizeof(ver));
+			break;
+		case IMAGE_ROOTFS:
+			dev_get_sw_ver(dev, ver, sizeof(ver));
+			break;
+		case IMAGE_MMC:
+			dev_get_content_ver(dev, ver, sizeof(ver));
+			break;
+		default:
+			break;
+	}
+
+	return ! ver[0] || strcmp(ver, image->version) == 0;
+
+}
+
+static void parallel_journal_record(struct parallel_job * job, struct device_info * dev, struct image * image) {
+
+	if ( ! job->parallel->incremental )
+		return;
+
+	pthread_mutex_lock(&job->parallel->lock);
+	journal_record(dev_get_serial(dev), image);
+	pthread_mutex_unlock(&job->parallel->lock);
+
+}
+
+/* Do as much as possible in current mode of device, returns new state of job */
+static enum parallel_state parallel_job_run(struct parallel_job * job, struct device_info * dev) {
+
+	struct parallel * parallel = job->parallel;
+	struct image_list * image_session = NULL;
+	struct image_list * image_ptr;
+	char ver[512];
+	enum device device;
+	int ret;
+
+	if ( dev->usb->flash_device->protocol == FLASH_DISK ) {
+		ERROR("Device %s: Mass Storage Mode is not supported for flashing more devices", job->path);
+		return PARALLEL_FAILED;
+	}
+
+	/* cold flash */
+	if ( job->x2nd ) {
+
+		device = dev->detected_device;
+
+		ret = dev_cold_flash_images(dev, job->x2nd, job->secondary);
+		if ( ret == -EAGAIN )
+			return PARALLEL_WAITING;
+		if ( ret != 0 )
+			return PARALLEL_FAILED;
+
+		image_free(job->x2nd);
+		image_free(job->secondary);
+		job->x2nd = NULL;
+		job->secondary = NULL;
+
+		if ( ! job->images )
+			return PARALLEL_DONE;
+
+		/* device is known from ASIC ID, device boots to NOLO after cold flashing */
+		if ( device )
+			parallel_images_filter_device(device, &job->images);
+
+		return PARALLEL_WAITING;
+
+	}
+
+	/* filter images by device & hwrev, same as in main */
+	if ( dev->detected_device )
+		parallel_images_filter_device(dev->detected_device, &job->images);
+	if ( dev->detected_hwrev > 0 )
+		parallel_images_filter_hwrev(dev->detected_hwrev, &job->images);
+
+	/* skip images which device reports and flash journal records as already flashed */
+	if ( parallel->incremental ) {
+		image_ptr = job->images;
+		while ( image_ptr ) {
+			struct image_list * next = image_ptr->next;
+			if ( parallel_is_flashed(job, dev, image_ptr->image) ) {
+				printf("Device %s: Skipping %s image, it is already flashed\n", job->path, image_type_to_string(image_ptr->image->type));
+				if ( image_ptr == job->images )
+					job->images = next;
+				image_list_del(image_ptr);
+			}
+			image_ptr = next;
+		}
+	}
+
+	/* flash all images supported by current mode in one session */
+	image_ptr = job->images;
+	while ( image_ptr ) {
+		struct image_list * next = image_ptr->next;
+		if ( dev_can_flash_image(dev, image_ptr->image) ) {
+			if ( image_ptr == job->images )
+				job->images = next;
+			image_list_add(&image_session, image_ptr->image);
+			image_list_unlink(image_ptr);
+			free(image_ptr);
+		}
+		image_ptr = next;
+	}
+
+	if ( image_session ) {
+		ret = dev_flash_images(dev, image_session);
+		if ( ret == 0 ) {
+			for ( image_ptr = image_session; image_ptr; image_ptr = image_ptr->next )
+				parallel_journal_record(job, dev, image_ptr->image);
+		}
+		parallel_images_free(&image_session);
+		if ( ret != 0 )
+			return PARALLEL_FAILED;
+	}
+
+	/* remaining images need to switch device to another mode */
+	while ( job->images ) {
+		struct image_list * next = job->images->next;
+		ret = dev_flash_image(dev, job->images->image);
+		if ( ret == -EAGAIN )
+			return PARALLEL_WAITING;
+		if ( ret != 0 )
+			return PARALLEL_FAILED;
+		parallel_journal_record(job, dev, job->images->image);
+		image_list_del(job->images);
+		job->images = next;
+	}
+
+	if ( parallel->swver ) {
+		ver[0] = 0;
+		dev_get_sw_ver(dev, ver, sizeof(ver));
+		if ( ver[0] && strcmp(ver, parallel->swver) != 0 ) {
+			ret = dev_set_sw_ver(dev, parallel->swver);
+			if ( ret == -EAGAIN )
+				return PARALLEL_WAITING;
+		}
+	}
+
+	if ( parallel->reboot )
+		dev_reboot_device(dev);
+
+	return PARALLEL_DONE;
+
+}
+
+static void * parallel_job_thread(void * data) {
+
+	struct parallel_job * job = data;
+	struct device_info * dev;
+	enum parallel_state state;
+
+	dev = dev_open_usb(job->usb);
+	job->usb = NULL;
+
+	if ( ! dev )
+		state = PARALLEL_FAILED;
+	else {
+		state = parallel_job_run(job, dev);
+		dev_free(dev);
+	}
+
+	if ( state == PARALLEL_WAITING && ++job->reconnects > PARALLEL_MAX_RECONNECTS ) {
+		ERROR("Device %s: Too many reconnects", job->path);
+		state = PARALLEL_FAILED;
+	}
+
+	printf("Device %s: %s\n", job->path, parallel_state_to_string(state));
+
+	pthread_mutex_lock(&job->parallel->lock);
+	job->state = state;
+	pthread_mutex_unlock(&job->parallel->lock);
+
+	return NULL;
+
+}
+
+static struct parallel_job * parallel_job_find(struct parallel * parallel, const char * path) {
+
+	struct parallel_job * job;
+
+	for ( job = parallel->jobs; job; job = job->next )
+		if ( strcmp(job->path, path) == 0 )
+			return job;
+
+	return NULL;
+
+}
+
+/* Check if serial number or bus path is in list of devices */
+static int parallel_device_match(struct parallel * parallel, const char * path, const char * serial) {
+
+	const char * ptr;
+
+	if ( ! parallel->devices )
+		return 1;
+
+	for ( ptr = parallel->devices; ptr < parallel->devices + parallel->devices_size; ptr += strlen(ptr) + 1 ) {
+		if ( ! ptr[0] )
+			continue;
+		if ( strcmp(ptr, path) == 0 || ( serial[0] && strcmp(ptr, serial) == 0 ) )
+			return 1;
+	}
+
+	return 0;
+
+}
+
+static int parallel_job_start(struct parallel_job * job, struct usb_device_info * usb) {
+
+	job->usb = usb;
+	job->state = PARALLEL_RUNNING;
+
+	if ( pthread_create(&job->thread, NULL, parallel_job_thread, job) != 0 ) {
+		ERROR("Device %s: Cannot create thread", job->path);
+		usb_close_device(usb);
+		job->usb = NULL;
+		job->state = PARALLEL_FAILED;
+		return -1;
+	}
+
+	job->joinable = 1;
+	return 0;
+
+}
+
+static struct parallel_job * parallel_job_alloc(struct parallel * parallel, struct usb_device_info * usb) {
+
+	struct parallel_job * job;
+	struct image_list * image_ptr;
+	struct image * image;
+
+	job = calloc(1, sizeof(struct parallel_job));
+	if ( ! job )
+		ALLOC_ERROR_RETURN(NULL);
+
+	job->parallel = parallel;
+	memcpy(job->path, usb->path, sizeof(job->path));
+	memcpy(job->serial, usb->serial, sizeof(job->serial));
+
+	/* every job reads images from its own shared copy */
+	for ( image_ptr = parallel->images; image_ptr; image_ptr = image_ptr->next ) {
+		if ( image_ptr->image->type == IMAGE_2ND )
+			continue;
+		image = image_alloc_shared(image_ptr->image);
+		if ( ! image )
+			goto clean;
+		image_list_add(&job->images, image);
+	}
+
+	if ( parallel->x2nd ) {
+		job->x2nd = image_alloc_shared(parallel->x2nd);
+		job->secondary = image_alloc_shared(parallel->secondary);
+		if ( ! job->x2nd || ! job->secondary )
+			goto clean;
+	}
+
+	return job;
+
+clean:
+	parallel_images_free(&job->images);
+	image_free(job->x2nd);
+	image_free(job->secondary);
+	free(job);
+	return NULL;
+
+}
+
+static int parallel_busy(const char * path, void * data) {
+
+	struct parallel * parallel = data;
+	struct parallel_job * job;
+	int ret;
+
+	pthread_mutex_lock(&parallel->lock);
+	job = parallel_job_find(parallel, path);
+	ret = ( job && job->state != PARALLEL_WAITING );
+	pthread_mutex_unlock(&parallel->lock);
+
+	return ret;
+
+}
+
+static int parallel_found(struct usb_device_info * usb, void * data) {
+
+	struct parallel * parallel = data;
+	struct parallel_job * job;
+
+	pthread_mutex_lock(&parallel->lock);
+	job = parallel_job_find(parallel, usb->path);
+	pthread_mutex_unlock(&parallel->lock);
+
+	/* device reconnected, previous worker thread has already finished */
+	if ( job ) {
+		if ( job->joinable ) {
+			pthread_join(job->thread, NULL);
+			job->joinable = 0;
+		}
+		if ( ! job->serial[0] )
+			memcpy(job->serial, usb->serial, sizeof(job->serial));
+		printf("Device %s: reconnected\n", job->path);
+		pthread_mutex_lock(&parallel->lock);
+		parallel_job_start(job, usb);
+		pthread_mutex_unlock(&parallel->lock);
+		return 0;
+	}
+
+	if ( parallel_device_match(parallel, usb->path, usb->serial) ) {
+		job = parallel_job_alloc(parallel, usb);
+		if ( ! job ) {
+			usb_close_device(usb);
+			return 0;
+		}
+		printf("Device %s: claimed (serial number: %s)\n", job->path, job->serial[0] ? job->serial : "(not detected)");
+	} else {
+		/* remember device, so it is not opened again */
+		job = calloc(1, sizeof(struct parallel_job));
+		if ( ! job ) {
+			usb_close_device(usb);
+			ALLOC_ERROR_RETURN(0);
+		}
+		job->parallel = parallel;
+		job->state = PARALLEL_IGNORED;
+		memcpy(job->path, usb->path, sizeof(job->path));
+		memcpy(job->serial, usb->serial, sizeof(job->serial));
+		usb_close_device(usb);
+	}
+
+	pthread_mutex_lock(&parallel->lock);
+	job->next = parallel->jobs;
+	parallel->jobs = job;
+	if ( job->state != PARALLEL_IGNORED )
+		parallel_job_start(job, usb);
+	pthread_mutex_unlock(&parallel->lock);
+
+	return 0;
+
+}
+
+/* Stop when all requested devices were claimed and all jobs finished */
+static int parallel_stop(void * data) {
+
+	struct parallel * parallel = data;
+	struct parallel_job * job;
+	const char * ptr;
+	int claimed = 0;
+	int ret = 1;
+
+	pthread_mutex_lock(&parallel->lock);
+
+	for ( job = parallel->jobs; job; job = job->next ) {
+		if ( job->state == PARALLEL_IGNORED )
+			continue;
+		if ( job->state == PARALLEL_RUNNING || job->state == PARALLEL_WAITING )
+			ret = 0;
+		claimed = 1;
+	}
+
+	if ( ! claimed )
+		ret = 0;
+
+	if ( ret && parallel->devices ) {
+		for ( ptr = parallel->devices; ptr < parallel->devices + parallel->devices_size; ptr += strlen(ptr) + 1 ) {
+			if ( ! ptr[0] )
+				continue;
+			for ( job = parallel->jobs; job; job = job->next )
+				if ( job->state != PARALLEL_IGNORED && ( strcmp(ptr, job->path) == 0 || strcmp(ptr, job->serial) == 0 ) )
+					break;
+			if ( ! job ) {
+				ret = 0;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&parallel->lock);
+
+	return ret;
+
+}
+
+int parallel_flash(const char * devices, struct image_list * images, struct image * x2nd, struct image * secondary, const char * swver, int incremental, int reboot) {
+
+	struct parallel parallel;
+	struct parallel_job * job;
+	struct image_list * image_ptr;
+	struct usb_scan scan;
+	size_t i;
+	int done = 0;
+	int failed = 0;
+
+	/* Jobs are found by bus path, device without stable path would be flashed again after reconnect */
+	if ( ! usb_path_is_stable() )
+		ERROR_RETURN("Flashing more devices is not supported on this system, USB port path of device is not available", -1);
+
+	memset(&parallel, 0, sizeof(parallel));
+	pthread_mutex_init(&parallel.lock, NULL);
+	parallel.images = images;
+	parallel.x2nd = x2nd;
+	parallel.secondary = secondary;
+	parallel.swver = swver;
+	parallel.incremental = incremental;
+	parallel.reboot = reboot;
+
+	if ( devices ) {
+		parallel.devices_size = strlen(devices) + 1;
+		parallel.devices = strdup(devices);
+		if ( ! parallel.devices )
+			ALLOC_ERROR_RETURN(-1);
+		for ( i = 0; i < parallel.devices_size; ++i )
+			if ( parallel.devices[i] == ',' )
+				parallel.devices[i] = 0;
+	}
+
+	/* read all images before first device is claimed, threads share them */
+	printf("Loading images to memory...\n");
+
+	for ( image_ptr = images; image_ptr; image_ptr = image_ptr->next ) {
+		if ( image_ptr->image->type != IMAGE_2ND && image_load(image_ptr->image) != 0 ) {
+			free(parallel.devices);
+			return -1;
+		}
+	}
+
+	if ( ( x2nd && image_load(x2nd) != 0 ) || ( secondary && image_load(secondary) != 0 ) ) {
+		free(parallel.devices);
+		return -1;
+	}
+
+	scan.busy = parallel_busy;
+	scan.found = parallel_found;
+	scan.stop = parallel_stop;
+	scan.data = &parallel;
+
+	printf_noprogress = 1;
+
+	if ( usb_scan_devices(&scan) != 0 )
+		printf("Interrupted, waiting for running jobs...\n");
+
+	for ( job = parallel.jobs; job; job = job->next ) {
+		if ( job->joinable ) {
+			pthread_join(job->thread, NULL);
+			job->joinable = 0;
+		}
+	}
+
+	printf_noprogress = 0;
+
+	printf("\nSummary:\n");
+
+	while ( parallel.jobs ) {
+		job = parallel.jobs;
+		parallel.jobs = job->next;
+		if ( job->state != PARALLEL_IGNORED ) {
+			printf("  %-20s %-20s %s\n", job->path, job->serial[0] ? job->serial : "-", parallel_state_to_string(job->state));
+			if ( job->state == PARALLEL_DONE )
+				++done;
+			else
+				++failed;
+		}
+		parallel_images_free(&job->images);
+		image_free(job->x2nd);
+		image_free(job->secondary);
+		free(job);
+	}
+
+	printf("Flashed %d device(s), %d failed\n", done, failed);
+
+	free(parallel.devices);
+	pthread_mutex_destroy(&parallel.lock);
+
+	return ( failed || ! done ) ? -1 : 0;
+
+}
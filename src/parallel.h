@@ -0,0 +1,39 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "image.h"
+
+/*
+  Flash all connected USB devices at once, one thread per device. Devices are
+  tracked by USB bus path, so device which reconnects in another mode (e.g.
+  after cold flashing) is handled by same job. Images are read to memory only
+  once and all threads share them.
+
+  devices is comma separated list of serial numbers or USB bus paths, NULL for
+  all devices. x2nd and secondary are set for cold flashing. swver is SW release
+  version which is set after flashing images, can be NULL.
+
+  Returns 0 when all devices were successfully flashed.
+*/
+int parallel_flash(const char * devices, struct image_list * images, struct image * x2nd, struct image * secondary, const char * swver, int incremental, int reboot);
+
+#endif
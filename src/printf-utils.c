@@ -30,7 +30,8 @@
 
 #include "printf-utils.h"
 
-int printf_prev = 0;
+__thread int printf_prev = 0;
+int printf_noprogress = 0;
 
 void printf_progressbar(unsigned long long part, unsigned long long total) {
 
@@ -38,6 +39,9 @@ void printf_progressbar(unsigned long long part, unsigned long long total) {
 	int pc;
 	int tmp, cols = 80;
 
+	if ( printf_noprogress )
+		return;
+
 	/* percentage calculation */
 	pc = total == 0 ? 100 : (int)(part*100/total);
 	( pc < 0 ) ? pc = 0 : ( pc > 100 ) ? pc = 100 : 0;
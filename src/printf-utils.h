@@ -22,7 +22,11 @@
 
 #include "global.h"
 
-extern int printf_prev;
+/* Each thread has its own line state */
+extern __thread int printf_prev;
+
+/* Disable progress bars, e.g. when more devices are flashed at once */
+extern int printf_noprogress;
 
 #define PRINTF_BACK() do { if ( printf_prev ) { printf("\r%-*s\r", printf_prev, ""); printf_prev = 0; } } while (0)
 #define PRINTF_ADD(...) do { printf_prev += printf(__VA_ARGS__); } while (0)
@@ -0,0 +1,168 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256.h"
+
+/* FIPS 180-4 */
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n)	( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+static void sha256_block(uint32_t * state, const unsigned char * data) {
+
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t s0, s1, t1, t2;
+	int i;
+
+	for ( i = 0; i < 16; ++i )
+		w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | (uint32_t)data[i * 4 + 3];
+
+	for ( i = 16; i < 64; ++i ) {
+		s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ ( w[i - 15] >> 3 );
+		s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ ( w[i - 2] >> 10 );
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for ( i = 0; i < 64; ++i ) {
+		s1 = SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25);
+		t1 = h + s1 + ( ( e & f ) ^ ( ~e & g ) ) + sha256_k[i] + w[i];
+		s0 = SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22);
+		t2 = s0 + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+
+}
+
+void sha256_init(struct sha256 * ctx) {
+
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->count = 0;
+
+}
+
+void sha256_update(struct sha256 * ctx, const void * data, size_t size) {
+
+	const unsigned char * bytes = data;
+	size_t used = ctx->count % 64;
+	size_t len;
+
+	ctx->count += size;
+
+	if ( used ) {
+		len = 64 - used;
+		if ( len > size )
+			len = size;
+		memcpy(ctx->buf + used, bytes, len);
+		bytes += len;
+		size -= len;
+		if ( used + len < 64 )
+			return;
+		sha256_block(ctx->state, ctx->buf);
+	}
+
+	while ( size >= 64 ) {
+		sha256_block(ctx->state, bytes);
+		bytes += 64;
+		size -= 64;
+	}
+
+	memcpy(ctx->buf, bytes, size);
+
+}
+
+void sha256_final(struct sha256 * ctx, unsigned char hash[SHA256_SIZE]) {
+
+	uint64_t bits = ctx->count * 8;
+	size_t used = ctx->count % 64;
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if ( used > 56 ) {
+		memset(ctx->buf + used, 0, 64 - used);
+		sha256_block(ctx->state, ctx->buf);
+		used = 0;
+	}
+
+	memset(ctx->buf + used, 0, 56 - used);
+	for ( i = 0; i < 8; ++i )
+		ctx->buf[56 + i] = bits >> ( 56 - i * 8 );
+	sha256_block(ctx->state, ctx->buf);
+
+	for ( i = 0; i < 8; ++i ) {
+		hash[i * 4] = ctx->state[i] >> 24;
+		hash[i * 4 + 1] = ctx->state[i] >> 16;
+		hash[i * 4 + 2] = ctx->state[i] >> 8;
+		hash[i * 4 + 3] = ctx->state[i];
+	}
+
+}
+
+void sha256(const void * data, size_t size, unsigned char hash[SHA256_SIZE]) {
+
+	struct sha256 ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, size);
+	sha256_final(&ctx, hash);
+
+}
@@ -0,0 +1,41 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE	32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buf[64];
+};
+
+void sha256_init(struct sha256 * ctx);
+void sha256_update(struct sha256 * ctx, const void * data, size_t size);
+void sha256_final(struct sha256 * ctx, unsigned char hash[SHA256_SIZE]);
+
+/* Hash of whole buffer */
+void sha256(const void * data, size_t size, unsigned char hash[SHA256_SIZE]);
+
+#endif
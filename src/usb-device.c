@@ -17,7 +17,7 @@
 
 */
 
-/* Enable RTLD_DEFAULT for glibc */
+/* Enable RTLD_DEFAULT, RTLD_NOLOAD and dladdr for glibc */
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
@@ -38,11 +38,26 @@
 #include "nolo.h"
 #include "cold-flash.h"
 #include "mkii.h"
+#ifdef WITH_LIBUSB1
+#include "usb-libusb1.h"
+#endif
+#ifdef __linux__
+#include "usb-usbfs.h"
+#endif
+#include "usb-emulator.h"
+#include "usb-stats.h"
+#include "usb-replay.h"
+#include "libusb-sniff.h"
 
 #ifdef __linux__
 #ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
 #include <sys/ioctl.h>
 #endif
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #endif
 
 static struct usb_flash_device usb_devices[] = {
@@ -116,21 +131,216 @@ static void usb_reattach_kernel_driver(usb_dev_handle * udev, int interface) {
 
 }
 
-static void usb_descriptor_info_print(usb_dev_handle * udev, struct usb_device * dev, char * product, size_t size) {
+/* libusb 0.1 transport, always available */
 
-	char buf[1024];
-	char buf2[1024];
-	unsigned int x;
+static int usb_libusb0_open(struct usb_device_info * dev) {
+
+	(void)dev;
+	return 0;
+
+}
+
+static void usb_libusb0_close(struct usb_device_info * dev) {
+
+	(void)dev;
+
+}
+
+static int usb_libusb0_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	return usb_control_msg(dev->udev, requesttype, request, value, index, bytes, size, timeout);
+
+}
+
+static int usb_libusb0_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	return usb_bulk_read(dev->udev, ep, bytes, size, timeout);
+
+}
+
+static int usb_libusb0_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	return usb_bulk_write(dev->udev, ep, (char *)bytes, size, timeout);
+
+}
+
+/* libusb 0.1 does not have asynchronous API, so submitted transfer is written immediately */
+static int usb_libusb0_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	if ( usb_bulk_write(dev->udev, ep, (char *)bytes, size, timeout) != size )
+		return -1;
+
+	return 0;
+
+}
+
+static int usb_libusb0_bulk_flush(struct usb_device_info * dev) {
+
+	(void)dev;
+	return 0;
+
+}
+
+static const struct usb_transport usb_transport_libusb0 = {
+	.name = "libusb0",
+	.open = usb_libusb0_open,
+	.close = usb_libusb0_close,
+	.control_msg = usb_libusb0_control_msg,
+	.bulk_read = usb_libusb0_bulk_read,
+	.bulk_write = usb_libusb0_bulk_write,
+	.bulk_submit = usb_libusb0_bulk_submit,
+	.bulk_flush = usb_libusb0_bulk_flush,
+};
+
+/* Transports in order of preference, last one is fallback and never fails */
+static const struct usb_transport * usb_transports[] = {
+#ifdef WITH_LIBUSB1
+	&usb_transport_libusb1,
+#endif
+#ifdef __linux__
+	&usb_transport_usbfs,
+#endif
+	&usb_transport_libusb0,
+};
+
+/* Transport which was not tested with real devices yet, used only when selected by USB_TRANSPORT */
+static int usb_transport_is_experimental(const struct usb_transport * transport) {
+
+#ifdef __linux__
+	if ( transport == &usb_transport_usbfs )
+		return 1;
+#endif
+
+	(void)transport;
+	return 0;
+
+}
+
+/* Attach transport to device, transport can be forced by USB_TRANSPORT environment variable */
+static void usb_transport_attach(struct usb_device_info * dev) {
+
+	const char * name = getenv("USB_TRANSPORT");
+	size_t count = sizeof(usb_transports)/sizeof(usb_transports[0]);
+	size_t i;
+
+	for ( i = 0; i < count; ++i ) {
+		if ( name && name[0] && strcmp(name, usb_transports[i]->name) != 0 && i != count - 1 )
+			continue;
+		if ( ( ! name || ! name[0] ) && usb_transport_is_experimental(usb_transports[i]) )
+			continue;
+		dev->transport = usb_transports[i];
+		dev->transport_data = NULL;
+		if ( dev->transport->open(dev) == 0 )
+			break;
+	}
+
+	if ( verbose )
+		printf("Using USB transport: %s\n", dev->transport->name);
+
+}
+
+int usb_device_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	uint64_t start = usb_stats_start();
 	int ret;
-	int i;
+
+	/* NOLO request is control request */
+	if ( dev->flash_device->protocol == FLASH_NOLO )
+		dev->stats_request = request;
+
+	ret = dev->transport->control_msg(dev, requesttype, request, value, index, bytes, size, timeout);
+	usb_stats_record(dev, USB_STATS_CONTROL, size, ret, start);
+	usb_record(dev, USBSNIFF_TRACE_CONTROL, requesttype & 0x80, requesttype, request, value, index, bytes, size, ret, timeout, start);
+	return ret;
+
+}
+
+int usb_device_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	uint64_t start = usb_stats_start();
+	int ret;
+
+	ret = dev->transport->bulk_read(dev, ep, bytes, size, timeout);
+	usb_stats_record(dev, USB_STATS_BULK_READ, size, ret, start);
+	usb_record(dev, USBSNIFF_TRACE_BULK, ep, 0, 0, 0, 0, bytes, size, ret, timeout, start);
+	return ret;
+
+}
+
+int usb_device_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	uint64_t start = usb_stats_start();
+	int ret;
+
+	ret = dev->transport->bulk_write(dev, ep, bytes, size, timeout);
+	usb_stats_record(dev, USB_STATS_BULK_WRITE, size, ret, start);
+	usb_record(dev, USBSNIFF_TRACE_BULK, ep, 0, 0, 0, 0, bytes, size, ret, timeout, start);
+	return ret;
+
+}
+
+int usb_device_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	uint64_t start = usb_stats_start();
+	int ret;
+
+	ret = dev->transport->bulk_submit(dev, ep, bytes, size, timeout);
+	usb_stats_record(dev, USB_STATS_BULK_SUBMIT, size, ret, start);
+	usb_record(dev, USBSNIFF_TRACE_BULK, ep, 0, 0, 0, 0, bytes, size, ( ret == 0 ) ? size : ret, timeout, start);
+	return ret;
+
+}
+
+int usb_device_bulk_flush(struct usb_device_info * dev) {
+
+	uint64_t start = usb_stats_start();
+	int ret;
+
+	ret = dev->transport->bulk_flush(dev);
+	usb_stats_record(dev, USB_STATS_BULK_FLUSH, 0, ret, start);
+	usb_record(dev, USBSNIFF_TRACE_FLUSH, 0, 0, 0, 0, 0, NULL, 0, ret, 0, start);
+	return ret;
+
+}
+
+void * usb_device_buffer_alloc(struct usb_device_info * dev, size_t size) {
+
+	if ( dev->transport->buffer_alloc )
+		return dev->transport->buffer_alloc(dev, size);
+
+	return malloc(size);
+
+}
+
+void usb_device_buffer_free(struct usb_device_info * dev, void * ptr) {
+
+	if ( dev->transport->buffer_free )
+		dev->transport->buffer_free(dev, ptr);
+	else
+		free(ptr);
+
+}
+
+static void usb_descriptor_product(usb_dev_handle * udev, struct usb_device * dev, char * product, size_t size) {
+
+	char buf[1024];
 
 	memset(buf, 0, sizeof(buf));
 	usb_get_string_simple(udev, dev->descriptor.iProduct, buf, sizeof(buf));
 	PRINTF_LINE("USB device product string: %s", buf[0] ? buf : "(not detected)");
 	PRINTF_END();
 
-	if ( product && buf[0] )
-		strncpy(product, buf, size);
+	snprintf(product, size, "%s", buf);
+
+}
+
+static void usb_descriptor_serial(usb_dev_handle * udev, struct usb_device * dev, char * serial, size_t size) {
+
+	char buf[1024];
+	char buf2[1024];
+	unsigned int x;
+	int ret;
+	int i;
 
 	memset(buf, 0, sizeof(buf));
 	memset(buf2, 0, sizeof(buf2));
@@ -151,12 +361,205 @@ static void usb_descriptor_info_print(usb_dev_handle * udev, struct usb_device *
 	PRINTF_LINE("USB device serial number string: %s", buf2[0] ? buf2 : ( buf[0] ? buf : "(not detected)" ));
 	PRINTF_END();
 
+	snprintf(serial, size, "%s", buf2[0] ? buf2 : buf);
+
 }
 
-static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
+static const struct usb_product {
+	const char * product;
+	enum device device;
+} usb_products[] = {
+	{ "Nokia 770", DEVICE_SU_18 },
+	{ "Nokia 770 (Update mode)", DEVICE_SU_18 },
+	{ "Nokia N800 Internet Tablet", DEVICE_RX_34 },
+	{ "Nokia N800 (Update mode)", DEVICE_RX_34 },
+	{ "Nokia N810 Internet Tablet", DEVICE_RX_44 },
+	{ "Nokia N810 (Update mode)", DEVICE_RX_44 },
+	{ "Nokia N810 Internet Tablet WiMAX Edition", DEVICE_RX_48 },
+	{ "Nokia-RX48 (Update mode)", DEVICE_RX_48 },
+	{ "N900 (Storage Mode)", DEVICE_RX_51 },
+	{ "Nokia N900 (Update mode)", DEVICE_RX_51 },
+	{ "N900 (PC-Suite Mode)", DEVICE_RX_51 },
+	{ "N900 (U-Boot)", DEVICE_RX_51 },
+	{ "Nokia N950", DEVICE_RM_680 },
+	{ "N950 (Update mode)", DEVICE_RM_680 },
+	{ "Nokia N9", DEVICE_RM_696 },
+	{ "N9 (Update mode)", DEVICE_RM_696 },
+	{ "Nokia N9 RNDIS/Ethernet", DEVICE_RM_696 },
+	{ "Nokia USB ROM", DEVICE_ANY },
+	{ "Sync Mode", DEVICE_ANY },
+	{ "Nxy (Update mode)", DEVICE_ANY },
+};
+
+static enum device usb_product_to_device(const char * product) {
+
+	size_t i;
+
+	for ( i = 0; i < sizeof(usb_products)/sizeof(usb_products[0]); ++i )
+		if ( strcmp(product, usb_products[i].product) == 0 )
+			return usb_products[i].device;
+
+	return DEVICE_UNKNOWN;
+
+}
+
+/*
+ * Identity of device cached by port path and serial number. Device reconnects
+ * several times during flashing, so after reconnect only serial number is read
+ * to confirm that it is same device. Product string differs between modes and
+ * some of them (e.g. Nokia USB ROM or Sync Mode) do not identify device, so only
+ * specific device is cached and it is used also in those generic modes.
+ */
+#define USB_IDENTITY_CACHE	16
+
+struct usb_identity {
+	char path[32];
+	char serial[64];
+	enum device device;
+};
+
+static struct usb_identity usb_identities[USB_IDENTITY_CACHE];
+static unsigned int usb_identities_next;
+
+static struct usb_identity * usb_identity_find(const char * path, const char * serial) {
+
+	size_t i;
+
+	if ( ! serial[0] )
+		return NULL;
+
+	for ( i = 0; i < USB_IDENTITY_CACHE; ++i )
+		if ( usb_identities[i].path[0] && strcmp(usb_identities[i].path, path) == 0 && strcmp(usb_identities[i].serial, serial) == 0 )
+			return &usb_identities[i];
+
+	return NULL;
+
+}
+
+static void usb_identity_store(const char * path, const char * serial, enum device device) {
+
+	struct usb_identity * identity;
+	size_t i;
+
+	/* Generic identification must not hide specific one read in other mode */
+	if ( ! serial[0] || device == DEVICE_UNKNOWN || device == DEVICE_ANY )
+		return;
+
+	/* Replace entry of device which was previously connected to same port */
+	identity = NULL;
+	for ( i = 0; i < USB_IDENTITY_CACHE; ++i ) {
+		if ( strcmp(usb_identities[i].path, path) == 0 ) {
+			identity = &usb_identities[i];
+			break;
+		}
+	}
+
+	if ( ! identity )
+		identity = &usb_identities[usb_identities_next++ % USB_IDENTITY_CACHE];
+
+	snprintf(identity->path, sizeof(identity->path), "%s", path);
+	snprintf(identity->serial, sizeof(identity->serial), "%s", serial);
+	identity->device = device;
+
+}
+
+/* Set when known device was found but could not be opened */
+static int usb_retry;
+
+#ifdef __linux__
+
+#define USB_SYSFS_PATH		"/sys/bus/usb/devices"
+
+static int usb_sysfs_read_int(const char * dir, const char * name) {
+
+	char path[sizeof(USB_SYSFS_PATH) + 512];
+	FILE * file;
+	int value;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", USB_SYSFS_PATH, dir, name);
+
+	file = fopen(path, "r");
+	if ( ! file )
+		return -1;
+
+	if ( fscanf(file, "%d", &value) != 1 )
+		value = -1;
+
+	fclose(file);
+	return value;
+
+}
+
+/* Find port path (e.g. 1-1.2) of device in sysfs */
+static int usb_sysfs_path(int busnum, int devnum, char * path, size_t size) {
+
+	DIR * dir;
+	struct dirent * entry;
+	int ret = -1;
+
+	dir = opendir(USB_SYSFS_PATH);
+	if ( ! dir )
+		return -1;
+
+	while ( ( entry = readdir(dir) ) ) {
+
+		/* Root hubs do not have '-' in name and interfaces have ':' */
+		if ( ! strchr(entry->d_name, '-') || strchr(entry->d_name, ':') )
+			continue;
+
+		if ( usb_sysfs_read_int(entry->d_name, "busnum") != busnum || usb_sysfs_read_int(entry->d_name, "devnum") != devnum )
+			continue;
+
+		if ( strlen(entry->d_name) < size ) {
+			strcpy(path, entry->d_name);
+			ret = 0;
+		}
+
+		break;
+
+	}
+
+	closedir(dir);
+	return ret;
+
+}
+
+#endif
+
+/* Port path is preferred because it stays same when device reconnects in another mode */
+static void usb_device_path(struct usb_device * dev, char * path, size_t size) {
+
+#ifdef __linux__
+	if ( dev->bus && usb_sysfs_path(atoi(dev->bus->dirname), atoi(dev->filename), path, size) == 0 )
+		return;
+#endif
+
+	snprintf(path, size, "%.15s/%.15s", dev->bus ? dev->bus->dirname : "", dev->filename);
+
+}
+
+int usb_path_is_stable(void) {
+
+	if ( usb_emulator_count() > 0 || usb_replay_enabled() )
+		return 1;
+
+#ifdef __linux__
+	return access(USB_SYSFS_PATH, F_OK) == 0;
+#else
+	/* Only bus and device number is available, device number changes on every reconnect */
+	return 0;
+#endif
+
+}
+
+static struct usb_device_info * usb_device_is_valid(struct usb_device * dev, struct usb_scan * scan) {
 
 	size_t i;
 	char product[1024];
+	char serial[64];
+	char path[32];
+	struct usb_identity * identity;
+	enum device device;
 	struct usb_device_info * ret = NULL;
 
 	for ( i = 0; i < sizeof(usb_devices)/sizeof(usb_devices[0]); ++i ) {
@@ -178,6 +581,13 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 				}
 			}
 
+			usb_device_path(dev, path, sizeof(path));
+			if ( scan->busy && scan->busy(path, scan->data) )
+				break;
+
+			/* If opening fails, try it again soon */
+			usb_retry = 1;
+
 			printf("\b\b  ");
 			PRINTF_END();
 			PRINTF_ADD("Found ");
@@ -192,7 +602,16 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 				return NULL;
 			}
 
-			usb_descriptor_info_print(udev, dev, product, sizeof(product));
+			usb_descriptor_serial(udev, dev, serial, sizeof(serial));
+
+			identity = usb_identity_find(path, serial);
+			if ( identity ) {
+				device = identity->device;
+			} else {
+				usb_descriptor_product(udev, dev, product, sizeof(product));
+				device = usb_product_to_device(product);
+				usb_identity_store(path, serial, device);
+			}
 
 			if ( usb_devices[i].interface >= 0 ) {
 
@@ -231,24 +650,7 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 				return NULL;
 			}
 
-			if ( strcmp(product, "Nokia 770") == 0 || strcmp(product, "Nokia 770 (Update mode)") == 0 )
-				ret->device = DEVICE_SU_18;
-			else if ( strcmp(product, "Nokia N800 Internet Tablet") == 0 || strcmp(product, "Nokia N800 (Update mode)") == 0 )
-				ret->device = DEVICE_RX_34;
-			else if ( strcmp(product, "Nokia N810 Internet Tablet") == 0 || strcmp(product, "Nokia N810 (Update mode)") == 0 )
-				ret->device = DEVICE_RX_44;
-			else if ( strcmp(product, "Nokia N810 Internet Tablet WiMAX Edition") == 0 || strcmp(product, "Nokia-RX48 (Update mode)") == 0 )
-				ret->device = DEVICE_RX_48;
-			else if ( strcmp(product, "N900 (Storage Mode)") == 0 || strcmp(product, "Nokia N900 (Update mode)") == 0 || strcmp(product, "N900 (PC-Suite Mode)") == 0 || strcmp(product, "N900 (U-Boot)") == 0 )
-				ret->device = DEVICE_RX_51;
-			else if ( strcmp(product, "Nokia N950") == 0 || strcmp(product, "N950 (Update mode)") == 0 )
-				ret->device = DEVICE_RM_680;
-			else if ( strcmp(product, "Nokia N9") == 0 || strcmp(product, "N9 (Update mode)") == 0 || strcmp(product, "Nokia N9 RNDIS/Ethernet") == 0 )
-				ret->device = DEVICE_RM_696;
-			else if ( strcmp(product, "Nokia USB ROM") == 0 || strcmp(product, "Sync Mode") == 0 || strcmp(product, "Nxy (Update mode)") == 0 )
-				ret->device = DEVICE_ANY;
-			else
-				ret->device = DEVICE_UNKNOWN;
+			ret->device = device;
 
 			if ( device_to_string(ret->device) )
 				PRINTF_LINE("Detected USB device: %s", device_to_string(ret->device));
@@ -283,6 +685,9 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 			ret->hwrev = -1;
 			ret->flash_device = &usb_devices[i];
 			ret->udev = udev;
+			memcpy(ret->serial, serial, sizeof(ret->serial));
+			memcpy(ret->path, path, sizeof(ret->path));
+			usb_transport_attach(ret);
 			break;
 		}
 	}
@@ -291,28 +696,341 @@ static struct usb_device_info * usb_device_is_valid(struct usb_device * dev) {
 
 }
 
-static struct usb_device_info * usb_search_device(struct usb_device * dev, int level) {
+/* Returns nonzero when scanning should be stopped */
+static int usb_search_device(struct usb_device * dev, int level, struct usb_scan * scan) {
 
 	int i;
-	struct usb_device_info * ret = NULL;
+	struct usb_device_info * ret;
 
 	if ( ! dev )
-		return NULL;
+		return 0;
+
+	ret = usb_device_is_valid(dev, scan);
+	if ( ret && scan->found(ret, scan->data) )
+		return 1;
+
+	for ( i = 0; i < dev->num_children; i++ )
+		if ( usb_search_device(dev->children[i], level + 1, scan) )
+			return 1;
+
+	return 0;
+
+}
+
+#ifdef __linux__
+
+#define USB_DEVFS_PATH		"/dev/bus/usb"
+#define USB_HOTPLUG_MASK	( IN_CREATE | IN_DELETE | IN_ATTRIB )
+
+/* Watch descriptor of USB_DEVFS_PATH, new bus directories are created there */
+static int usb_hotplug_root;
+
+static void usb_hotplug_watch_bus(int fd, const char * name) {
+
+	char path[sizeof(USB_DEVFS_PATH) + 256];
+
+	if ( name[0] == '.' )
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", USB_DEVFS_PATH, name);
+	inotify_add_watch(fd, path, USB_HOTPLUG_MASK);
+
+}
+
+/* Watch usbfs device nodes, so bus is rescanned only after device was (re)enumerated */
+static int usb_hotplug_init(void) {
+
+	int fd;
+	DIR * dir;
+	struct dirent * entry;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ( fd < 0 )
+		return -1;
+
+	usb_hotplug_root = inotify_add_watch(fd, USB_DEVFS_PATH, IN_CREATE);
+	if ( usb_hotplug_root < 0 ) {
+		close(fd);
+		return -1;
+	}
+
+	dir = opendir(USB_DEVFS_PATH);
+	if ( ! dir ) {
+		close(fd);
+		return -1;
+	}
+
+	while ( ( entry = readdir(dir) ) )
+		usb_hotplug_watch_bus(fd, entry->d_name);
+
+	closedir(dir);
+	return fd;
+
+}
+
+/* Wait for change in usbfs or timeout */
+static void usb_hotplug_wait(int fd, int timeout) {
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event * event;
+	struct pollfd pfd;
+	ssize_t len;
+	char * ptr;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if ( poll(&pfd, 1, timeout) <= 0 )
+		return;
 
-	ret = usb_device_is_valid(dev);
-	if ( ret )
-		return ret;
+	while ( ( len = read(fd, buf, sizeof(buf)) ) > 0 ) {
+		for ( ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len ) {
+			event = (const struct inotify_event *)ptr;
+			if ( event->wd == usb_hotplug_root && event->len > 0 )
+				usb_hotplug_watch_bus(fd, event->name);
+		}
+	}
+
+}
+
+#else
+
+static int usb_hotplug_init(void) {
+
+	return -1;
+
+}
+
+static void usb_hotplug_wait(int fd, int timeout) {
+
+	(void)fd;
+	(void)timeout;
+
+}
+
+#endif
+
+/* Without change in usbfs bus is rescanned after this timeout (ms) */
+#define USB_HOTPLUG_TIMEOUT	1000
+
+/* Found device which could not be opened yet (e.g. permissions are not set by udev yet) is tried again after this time (ms) */
+#define USB_RETRY_INTERVAL	10
+
+/* Interval of disconnect probes (ms) */
+#define USB_DISCONNECT_INTERVAL	10
+
+static long long int usb_time_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+
+}
+
+/* Returns nonzero when device is not connected anymore */
+static int usb_disconnected(struct usb_device_info * dev, const char * node) {
+
+	char status[2];
+	int ret;
+
+#ifdef __linux__
+	if ( node )
+		return access(node, F_OK) != 0;
+#else
+	(void)node;
+#endif
+
+	/* Standard GET_STATUS request fails with ENODEV after disconnect */
+	errno = 0;
+	ret = dev->transport->control_msg(dev, USB_ENDPOINT_IN, USB_REQ_GET_STATUS, 0, 0, status, sizeof(status), 100);
+	return ret == -ENODEV || ( ret < 0 && errno == ENODEV );
+
+}
+
+int usb_wait_for_disconnect(struct usb_device_info * dev, int timeout) {
+
+	long long int start = usb_time_ms();
+	long long int elapsed;
+	const char * node = NULL;
+#ifdef __linux__
+	char path[sizeof(USB_DEVFS_PATH) + 2 * PATH_MAX + 2];
+	struct usb_device * device;
+#endif
+
+	/* Emulated and replayed devices disconnect when they are closed */
+	if ( ! dev->udev )
+		return 0;
+
+#ifdef __linux__
+	/* Device node is removed by kernel after disconnect */
+	device = usb_device(dev->udev);
+	if ( device && device->bus ) {
+		snprintf(path, sizeof(path), "%s/%s/%s", USB_DEVFS_PATH, device->bus->dirname, device->filename);
+		if ( access(path, F_OK) == 0 )
+			node = path;
+	}
+#endif
+
+	while ( ! usb_disconnected(dev, node) ) {
+
+		elapsed = usb_time_ms() - start;
+		if ( elapsed >= timeout ) {
+			if ( verbose )
+				printf("Device did not disconnect within %d ms\n", timeout);
+			return -1;
+		}
+
+		MSLEEP(USB_DISCONNECT_INTERVAL);
+
+	}
 
-	for ( i = 0; i < dev->num_children; i++ ) {
-		ret = usb_search_device(dev->children[i], level + 1);
-		if ( ret )
+	if ( verbose )
+		printf("Device disconnected after %lld ms\n", usb_time_ms() - start);
+
+	return 0;
+
+}
+
+/* Open emulated or replayed device instead of real one */
+static struct usb_device_info * usb_virtual_open_device(enum usb_flash_protocol protocol, enum device device, const char * path, const char * serial, const struct usb_transport * transport) {
+
+	struct usb_device_info * ret;
+	enum device * ptr;
+	size_t i;
+
+	for ( i = 0; i < sizeof(usb_devices)/sizeof(usb_devices[0]); ++i ) {
+		if ( usb_devices[i].protocol != protocol )
+			continue;
+		for ( ptr = usb_devices[i].devices; *ptr; ++ptr )
+			if ( *ptr == device )
+				break;
+		if ( *ptr )
 			break;
 	}
 
+	if ( i == sizeof(usb_devices)/sizeof(usb_devices[0]) )
+		ERROR_RETURN("Emulated device does not support requested mode", NULL);
+
+	PRINTF_BACK();
+	printf("\n");
+	PRINTF_ADD("Found %s ", transport == &usb_transport_replay ? "replayed" : "emulated");
+	usb_flash_device_info_print(&usb_devices[i]);
+	PRINTF_END();
+
+	ret = calloc(1, sizeof(struct usb_device_info));
+	if ( ! ret )
+		ALLOC_ERROR_RETURN(NULL);
+
+	/* Boot ROM does not report device */
+	ret->device = ( protocol == FLASH_COLD ) ? DEVICE_ANY : device;
+	ret->hwrev = -1;
+	ret->flash_device = &usb_devices[i];
+	snprintf(ret->serial, sizeof(ret->serial), "%s", serial);
+	snprintf(ret->path, sizeof(ret->path), "%s", path);
+	ret->transport = transport;
+
+	if ( ret->transport->open(ret) != 0 ) {
+		free(ret);
+		return NULL;
+	}
+
+	printf("\n");
 	return ret;
 
 }
 
+/* Returns nonzero when scanning should be stopped */
+static int usb_emulator_search(struct usb_scan * scan) {
+
+	struct usb_device_info * dev;
+	enum usb_flash_protocol protocol;
+	char serial[64];
+	char path[32];
+	int i;
+
+	for ( i = 0; i < usb_emulator_count(); ++i ) {
+
+		protocol = usb_emulator_protocol(i);
+		if ( protocol == FLASH_UNKN )
+			continue;
+
+		snprintf(path, sizeof(path), "%s%d", USB_EMULATOR_PATH, i);
+		if ( scan->busy && scan->busy(path, scan->data) )
+			continue;
+
+		snprintf(serial, sizeof(serial), "EMULATOR%d", i);
+		dev = usb_virtual_open_device(protocol, usb_emulator_device(), path, serial, &usb_transport_emulator);
+		if ( dev && scan->found(dev, scan->data) )
+			return 1;
+
+	}
+
+	return 0;
+
+}
+
+/* Returns nonzero when scanning should be stopped */
+static int usb_replay_search(struct usb_scan * scan) {
+
+	struct usb_device_info * dev;
+	enum usb_flash_protocol protocol;
+
+	protocol = usb_replay_protocol();
+	if ( protocol == FLASH_UNKN )
+		return 0;
+
+	if ( scan->busy && scan->busy(USB_REPLAY_PATH, scan->data) )
+		return 0;
+
+	dev = usb_virtual_open_device(protocol, usb_replay_device(), USB_REPLAY_PATH, "REPLAY", &usb_transport_replay);
+	if ( dev && scan->found(dev, scan->data) )
+		return 1;
+
+	return 0;
+
+}
+
+/* libusb-compat implements libusb 0.1 API on top of libusb 1.0 and has slow listing of usb devices */
+static int usb_is_libusb_compat(void) {
+
+#ifdef WITH_LIBUSB1
+	Dl_info info;
+	void * handle;
+	void * main_handle;
+	void * sym;
+	int ret = 0;
+
+	/* Native transport itself needs libusb_init, so check only library which provides usb_init and its dependencies */
+	sym = dlsym(RTLD_DEFAULT, "usb_init");
+	if ( ! sym || ! dladdr(sym, &info) || ! info.dli_fname )
+		return 0;
+
+	handle = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+	main_handle = dlopen(NULL, RTLD_LAZY);
+
+	/* Symbol resolved to main program (PLT entry or static linking), try library by its soname */
+	if ( handle && handle == main_handle ) {
+		dlclose(handle);
+		handle = dlopen("libusb-0.1.so.4", RTLD_LAZY | RTLD_NOLOAD);
+	}
+
+	if ( handle ) {
+		ret = ( dlsym(handle, "libusb_init") != NULL );
+		dlclose(handle);
+	}
+
+	if ( main_handle )
+		dlclose(main_handle);
+
+	return ret;
+#else
+	return dlsym(RTLD_DEFAULT, "libusb_init") != NULL;
+#endif
+
+}
+
 static volatile sig_atomic_t signal_quit;
 
 static void signal_handler(int signum) {
@@ -322,19 +1040,33 @@ static void signal_handler(int signum) {
 
 }
 
-struct usb_device_info * usb_open_and_wait_for_device(void) {
+/* Wait for devices and pass all opened ones to caller until it stops scanning, returns -1 when interrupted by SIGINT */
+int usb_scan_devices(struct usb_scan * scan) {
 
 	struct usb_bus * bus;
-	struct usb_device_info * ret = NULL;
 	int i = 0;
+	int hotplug = -1;
+	int changes;
+	int rescan = 1;
+	int stop = 0;
+	int emulated;
 	void (*prev)(int);
 	static char progress[] = {'/','-','\\', '|'};
 
-	if ( dlsym(RTLD_DEFAULT, "libusb_init") )
-		ERROR_RETURN("You are trying to use broken libusb-1.0 library (either directly or via wrapper) which has slow listing of usb devices. It cannot be used for flashing or cold-flashing. Please use libusb 0.1.", NULL);
+	usb_stats_init();
+	usb_record_init();
+
+	emulated = ( usb_emulator_count() > 0 || usb_replay_enabled() );
 
-	usb_init();
-	usb_find_busses();
+	if ( ! emulated ) {
+
+		if ( usb_is_libusb_compat() )
+			ERROR_RETURN("You are trying to use broken libusb-1.0 library (either directly or via wrapper) which has slow listing of usb devices. It cannot be used for flashing or cold-flashing. Please use libusb 0.1.", -1);
+
+		usb_init();
+		usb_find_busses();
+
+	}
 
 	PRINTF_BACK();
 	printf("\n");
@@ -343,45 +1075,98 @@ struct usb_device_info * usb_open_and_wait_for_device(void) {
 
 	prev = signal(SIGINT, signal_handler);
 
-	while ( ! signal_quit ) {
+	if ( ! emulated )
+		hotplug = usb_hotplug_init();
+
+	while ( ! signal_quit && ! stop ) {
+
+		if ( scan->stop && scan->stop(scan->data) )
+			break;
+
+		usb_stats_poll();
+
+		if ( ! printf_noprogress )
+			PRINTF_LINE("Waiting for USB device... %c", progress[++i%sizeof(progress)]);
 
-		PRINTF_LINE("Waiting for USB device... %c", progress[++i%sizeof(progress)]);
+		if ( emulated ) {
+			if ( usb_replay_enabled() )
+				stop = usb_replay_search(scan);
+			else
+				stop = usb_emulator_search(scan);
+			if ( ! stop )
+				MSLEEP(50);
+			continue;
+		}
+
+		/* Walk all buses only when device list changed or previously found device should be opened again */
+		changes = usb_find_devices();
+		if ( changes <= 0 && ! rescan && ! usb_retry ) {
+			if ( hotplug >= 0 )
+				usb_hotplug_wait(hotplug, USB_HOTPLUG_TIMEOUT);
+			else
+				MSLEEP(50);
+			continue;
+		}
 
-		usb_find_devices();
+		rescan = 0;
+		usb_retry = 0;
 
-		for ( bus = usb_get_busses(); bus; bus = bus->next ) {
+		for ( bus = usb_get_busses(); bus && ! stop; bus = bus->next ) {
 
 			if ( bus->root_dev )
-				ret = usb_search_device(bus->root_dev, 0);
+				stop = usb_search_device(bus->root_dev, 0, scan);
 			else {
 				struct usb_device *dev;
-				for ( dev = bus->devices; dev; dev = dev->next ) {
-					ret = usb_search_device(dev, 0);
-					if ( ret )
-						break;
-				}
+				for ( dev = bus->devices; dev && ! stop; dev = dev->next )
+					stop = usb_search_device(dev, 0, scan);
 			}
 
-			if ( ret )
-				break;
-
 		}
 
-		if ( ret )
+		if ( stop )
 			break;
 
-		MSLEEP(50);
+		if ( usb_retry )
+			MSLEEP(USB_RETRY_INTERVAL);
+		else if ( hotplug >= 0 )
+			usb_hotplug_wait(hotplug, USB_HOTPLUG_TIMEOUT);
+		else
+			MSLEEP(50);
 
 	}
 
+#ifdef __linux__
+	if ( hotplug >= 0 )
+		close(hotplug);
+#endif
+
 	if ( prev != SIG_ERR )
 		signal(SIGINT, prev);
 
 	PRINTF_BACK();
 	printf("\n");
 
-	if ( ! ret )
-		return NULL;
+	return signal_quit ? -1 : 0;
+
+}
+
+static int usb_open_found(struct usb_device_info * dev, void * data) {
+
+	*(struct usb_device_info **)data = dev;
+	return 1;
+
+}
+
+struct usb_device_info * usb_open_and_wait_for_device(void) {
+
+	struct usb_device_info * ret = NULL;
+	struct usb_scan scan = { NULL, usb_open_found, NULL, &ret };
+	long long int start = usb_time_ms();
+
+	usb_scan_devices(&scan);
+
+	if ( ret && verbose )
+		printf("USB device found after %lld ms\n", usb_time_ms() - start);
 
 	return ret;
 
@@ -389,9 +1174,13 @@ struct usb_device_info * usb_open_and_wait_for_device(void) {
 
 void usb_close_device(struct usb_device_info * dev) {
 
-	if ( dev->flash_device->protocol != FLASH_COLD )
-		usb_reattach_kernel_driver(dev->udev, dev->flash_device->interface);
-	usb_close(dev->udev);
+	dev->transport->close(dev);
+	if ( dev->udev ) {
+		if ( dev->flash_device->protocol != FLASH_COLD )
+			usb_reattach_kernel_driver(dev->udev, dev->flash_device->interface);
+		usb_close(dev->udev);
+	}
+	free(dev->protocol_data);
 	free(dev);
 
 }
@@ -430,7 +1219,7 @@ void usb_switch_to_update(struct usb_device_info * dev) {
 		leave_cold_flash(dev);
 	else if ( dev->flash_device->protocol == FLASH_NOLO )
 		nolo_boot_device(dev, "update");
-	else if ( dev->flash_device->protocol == FLASH_MKII && ! ( dev->data & MKII_UPDATE_MODE ) )
+	else if ( dev->flash_device->protocol == FLASH_MKII && ! mkii_is_update_mode(dev) )
 		mkii_reboot_device(dev, 1);
 	else if ( dev->flash_device->protocol == FLASH_DISK )
 		printf_and_wait("Unplug USB cable, turn device off, press ENTER and plug USB cable again");
@@ -447,7 +1236,7 @@ void usb_switch_to_disk(struct usb_device_info * dev) {
 		nolo_boot_device(dev, NULL);
 		printf_and_wait("Wait until device start, choose USB Mass Storage Mode and press ENTER");
 	} else if ( dev->flash_device->protocol == FLASH_MKII ) {
-		if ( dev->data & MKII_UPDATE_MODE )
+		if ( mkii_is_update_mode(dev) )
 			mkii_reboot_device(dev, 0);
 		else
 			printf_and_wait("Unplug USB cable, plug again, choose USB Mass Storage Mode and press ENTER");
@@ -20,6 +20,7 @@
 #ifndef USB_DEVICE_H
 #define USB_DEVICE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* u_int*_t types are not defined without _GNU_SOURCE but usb.h needs them */
@@ -53,18 +54,74 @@ struct usb_flash_device {
 	enum device devices[DEVICE_COUNT];
 };
 
+struct usb_device_info;
+struct cold_flash_profile;
+
+/* USB transport backend used for I/O on opened device, device discovery is always done via libusb 0.1 */
+struct usb_transport {
+	const char * name;
+	/* Attach to device opened and claimed via libusb 0.1, return 0 on success */
+	int (*open)(struct usb_device_info * dev);
+	void (*close)(struct usb_device_info * dev);
+	int (*control_msg)(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout);
+	int (*bulk_read)(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout);
+	int (*bulk_write)(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout);
+	/* Non zero when bulk_submit only queues transfer, otherwise it writes synchronously like bulk_write */
+	int async;
+	/* Queue bulk write, bytes must be valid until flush, return 0 on success */
+	int (*bulk_submit)(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout);
+	/* Wait for all queued bulk writes, return 0 if all were fully written */
+	int (*bulk_flush)(struct usb_device_info * dev);
+	/* Allocate buffer suitable for bulk transfers, NULL for malloc */
+	void * (*buffer_alloc)(struct usb_device_info * dev, size_t size);
+	void (*buffer_free)(struct usb_device_info * dev, void * ptr);
+};
+
 struct usb_device_info {
 	enum device device;
 	int16_t hwrev;
 	const struct usb_flash_device * flash_device;
 	usb_dev_handle * udev;
+	const struct usb_transport * transport;
+	void * transport_data;
 	int data;
+	const struct cold_flash_profile * cold_flash_profile;	/* transfer profile selected from ASIC ID, NULL when not known */
+	void * protocol_data;	/* protocol specific state, freed with device */
+	int stats_request;	/* protocol request of next transfers, see usb-stats.h */
+	char serial[64];
+	char path[32];	/* USB bus path, on Linux port path which does not change on reconnect */
+};
+
+/* Callbacks for usb_scan_devices(), data is passed to all of them */
+struct usb_scan {
+	/* Return nonzero if device on USB bus path is in use and must not be opened */
+	int (*busy)(const char * path, void * data);
+	/* Opened device is passed to caller, return nonzero to stop scanning */
+	int (*found)(struct usb_device_info * dev, void * data);
+	/* Return nonzero to stop waiting for devices, can be NULL */
+	int (*stop)(void * data);
+	void * data;
 };
 
 const char * usb_flash_protocol_to_string(enum usb_flash_protocol protocol);
 struct usb_device_info * usb_open_and_wait_for_device(void);
+int usb_scan_devices(struct usb_scan * scan);
+
+/* Returns nonzero when USB bus path of device stays same after it reconnects in another mode */
+int usb_path_is_stable(void);
 void usb_close_device(struct usb_device_info * dev);
 
+/* Wait until device disconnects (e.g. after reboot command), returns -1 when it is still connected after timeout (ms) */
+int usb_wait_for_disconnect(struct usb_device_info * dev, int timeout);
+
+int usb_device_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout);
+int usb_device_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout);
+int usb_device_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout);
+int usb_device_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout);
+int usb_device_bulk_flush(struct usb_device_info * dev);
+void * usb_device_buffer_alloc(struct usb_device_info * dev, size_t size);
+void usb_device_buffer_free(struct usb_device_info * dev, void * ptr);
+
 void usb_switch_to_nolo(struct usb_device_info * dev);
 void usb_switch_to_cold(struct usb_device_info * dev);
 void usb_switch_to_update(struct usb_device_info * dev);
@@ -0,0 +1,901 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "device.h"
+#include "usb-device.h"
+#include "usb-emulator.h"
+
+/* Must match definitions in nolo.c */
+#define NOLO_WRITE		64
+#define NOLO_QUERY		192
+
+#define NOLO_STATUS		1
+#define NOLO_GET_NOLO_VERSION	3
+#define NOLO_IDENTIFY		4
+#define NOLO_ERROR_LOG		5
+#define NOLO_SET		16
+#define NOLO_GET		17
+#define NOLO_STRING		18
+#define NOLO_SET_STRING		19
+#define NOLO_GET_STRING		20
+#define NOLO_SEND_IMAGE		66
+#define NOLO_SET_SW_RELEASE	67
+#define NOLO_FLASH_IMAGE	80
+#define NOLO_SEND_FLASH_FINISH	82
+#define NOLO_SEND_FLASH_IMAGE	84
+#define NOLO_BOOT		130
+#define NOLO_REBOOT		131
+
+#define NOLO_RD_MODE		0
+#define NOLO_ROOT_DEVICE	1
+#define NOLO_USB_HOST_MODE	2
+#define NOLO_ADD_RD_FLAGS	3
+#define NOLO_DEL_RD_FLAGS	4
+
+/* Must match definitions in mkii.c */
+#define MKII_OUT	0x8810001B
+#define MKII_IN		0x8800101B
+#define MKII_PING	0x00
+#define MKII_GET	0x01
+#define MKII_TELL	0x02
+#define MKII_REBOOT	0x0C
+#define MKII_RESPONCE	0x20
+#define MKII_IMAGE_START	0x03
+#define MKII_IMAGE_HEADER	0x04
+#define MKII_IMAGE_TRANSPORT	0x05
+#define MKII_IMAGE_STATUS	0x06
+#define MKII_IMAGE_DATA		0x08
+#define MKII_IMAGE_BUFFER	0x0B
+
+/* Size of image buffer in softupd and speed of flashing data from it */
+#define MKII_BUFFER_SIZE	(32 * 1024 * 1024)
+#define MKII_FLASH_RATE		(16 * 1024 * 1024)
+
+/* Must match definitions in cold-flash.c */
+#define OMAP_PERIPHERAL_MSG	0xF0030002
+#define OMAP_MEMORY_MSG		0
+#define XLOADER_MSG_TYPE_PING	0x6301326E
+#define XLOADER_MSG_TYPE_SEND	0x6302326E
+
+enum cold_state {
+	COLD_PERIPHERAL,	/* waiting for peripheral boot message */
+	COLD_SIZE,	/* waiting for 2nd X-Loader size */
+	COLD_2ND,	/* receiving 2nd X-Loader */
+	COLD_XLOADER,	/* waiting for X-Loader message */
+	COLD_SECONDARY,	/* receiving Secondary image */
+};
+
+#define EMULATOR_STRINGS	16
+#define EMULATOR_RESPONSES	16
+
+struct usb_emulator_string {
+	char key[64];
+	char value[256];
+};
+
+struct usb_emulator {
+	int index;
+	enum usb_flash_protocol protocol;
+	enum device device;
+	long latency;	/* usec per transfer */
+	long bandwidth;	/* bytes per second */
+	struct timespec busy;	/* time when all queued transfers are finished */
+	char responses[EMULATOR_RESPONSES][512];	/* queue of data for next bulk reads */
+	int response_sizes[EMULATOR_RESPONSES];
+	int response_first;
+	int response_count;
+	struct usb_emulator_string strings[EMULATOR_STRINGS];
+	char key[64];	/* key for NOLO_SET_STRING and NOLO_GET_STRING */
+	uint32_t image_size;
+	uint32_t image_received;
+	uint8_t rd_mode;
+	uint8_t root_device;
+	uint32_t usb_host_mode;
+	uint16_t rd_flags;
+	enum cold_state cold_state;
+	uint32_t cold_size;
+	uint32_t cold_received;
+	uint32_t mkii_announced;	/* raw data announced by MKII_IMAGE_DATA and not received yet */
+	uint32_t mkii_buffered;	/* received raw data which are not flashed yet */
+	long long int mkii_drained;	/* time when buffer was last drained */
+	unsigned long int transfers;
+	unsigned long long int bytes;
+};
+
+/* Mode of every emulated device is kept across reconnects */
+static pthread_mutex_t usb_emulator_lock = PTHREAD_MUTEX_INITIALIZER;
+static int usb_emulator_initialized;
+static int usb_emulator_devices;
+static enum usb_flash_protocol usb_emulator_modes[USB_EMULATOR_MAX];
+static enum device usb_emulator_dev = DEVICE_RX_51;
+
+static void usb_emulator_init(void) {
+
+	enum usb_flash_protocol mode;
+	const char * env;
+	const char * ptr;
+	size_t len;
+	int i;
+
+	pthread_mutex_lock(&usb_emulator_lock);
+
+	if ( usb_emulator_initialized ) {
+		pthread_mutex_unlock(&usb_emulator_lock);
+		return;
+	}
+
+	usb_emulator_initialized = 1;
+
+	env = getenv("USB_EMULATOR");
+	if ( ! env || ! env[0] ) {
+		pthread_mutex_unlock(&usb_emulator_lock);
+		return;
+	}
+
+	ptr = strchr(env, ':');
+	len = ptr ? (size_t)(ptr - env) : strlen(env);
+
+	if ( len == 4 && strncmp(env, "nolo", 4) == 0 )
+		mode = FLASH_NOLO;
+	else if ( len == 4 && strncmp(env, "mkii", 4) == 0 )
+		mode = FLASH_MKII;
+	else if ( len == 4 && strncmp(env, "cold", 4) == 0 )
+		mode = FLASH_COLD;
+	else {
+		ERROR("Unknown emulated USB mode %s", env);
+		pthread_mutex_unlock(&usb_emulator_lock);
+		return;
+	}
+
+	if ( ptr && ptr[1] ) {
+		usb_emulator_dev = device_from_string(ptr+1);
+		if ( usb_emulator_dev == DEVICE_UNKNOWN || usb_emulator_dev == DEVICE_ANY ) {
+			ERROR("Unknown emulated device %s", ptr+1);
+			pthread_mutex_unlock(&usb_emulator_lock);
+			return;
+		}
+	}
+
+	usb_emulator_devices = 1;
+
+	env = getenv("USB_EMULATOR_COUNT");
+	if ( env && env[0] ) {
+		usb_emulator_devices = atoi(env);
+		if ( usb_emulator_devices < 1 || usb_emulator_devices > USB_EMULATOR_MAX ) {
+			ERROR("Number of emulated devices must be between 1 and %d", USB_EMULATOR_MAX);
+			usb_emulator_devices = 0;
+		}
+	}
+
+	for ( i = 0; i < usb_emulator_devices; ++i )
+		usb_emulator_modes[i] = mode;
+
+	pthread_mutex_unlock(&usb_emulator_lock);
+
+}
+
+int usb_emulator_count(void) {
+
+	usb_emulator_init();
+	return usb_emulator_devices;
+
+}
+
+enum usb_flash_protocol usb_emulator_protocol(int index) {
+
+	enum usb_flash_protocol mode;
+
+	usb_emulator_init();
+
+	if ( index < 0 || index >= usb_emulator_devices )
+		return FLASH_UNKN;
+
+	pthread_mutex_lock(&usb_emulator_lock);
+	mode = usb_emulator_modes[index];
+	pthread_mutex_unlock(&usb_emulator_lock);
+
+	return mode;
+
+}
+
+enum device usb_emulator_device(void) {
+
+	usb_emulator_init();
+	return usb_emulator_dev;
+
+}
+
+/* Emulated device switches mode after it is disconnected */
+static void usb_emulator_set_mode(struct usb_emulator * emu, enum usb_flash_protocol mode) {
+
+	pthread_mutex_lock(&usb_emulator_lock);
+	usb_emulator_modes[emu->index] = mode;
+	pthread_mutex_unlock(&usb_emulator_lock);
+
+}
+
+static struct usb_emulator_string * usb_emulator_string(struct usb_emulator * emu, const char * key, int create) {
+
+	int i;
+
+	for ( i = 0; i < EMULATOR_STRINGS; ++i )
+		if ( emu->strings[i].key[0] && strcmp(emu->strings[i].key, key) == 0 )
+			return &emu->strings[i];
+
+	if ( ! create || strlen(key) >= sizeof(emu->strings[0].key) )
+		return NULL;
+
+	for ( i = 0; i < EMULATOR_STRINGS; ++i ) {
+		if ( ! emu->strings[i].key[0] ) {
+			strcpy(emu->strings[i].key, key);
+			return &emu->strings[i];
+		}
+	}
+
+	return NULL;
+
+}
+
+static const char * usb_emulator_get(struct usb_emulator * emu, const char * key) {
+
+	struct usb_emulator_string * str = usb_emulator_string(emu, key, 0);
+
+	return str ? str->value : "";
+
+}
+
+static void usb_emulator_set(struct usb_emulator * emu, const char * key, const char * value) {
+
+	struct usb_emulator_string * str = usb_emulator_string(emu, key, 1);
+	size_t len = strlen(value);
+
+	if ( ! str )
+		return;
+
+	if ( len >= sizeof(str->value) )
+		len = sizeof(str->value) - 1;
+
+	memcpy(str->value, value, len);
+	str->value[len] = 0;
+
+}
+
+/* Timing model: transfers are serialized on emulated bus */
+
+static long long int usb_emulator_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+}
+
+static void usb_emulator_transfer(struct usb_emulator * emu, size_t size) {
+
+	long long int busy = emu->busy.tv_sec * 1000000000LL + emu->busy.tv_nsec;
+	long long int now = usb_emulator_now();
+
+	if ( busy < now )
+		busy = now;
+
+	busy += emu->latency * 1000LL;
+	if ( emu->bandwidth > 0 )
+		busy += (long long int)size * 1000000000LL / emu->bandwidth;
+
+	emu->busy.tv_sec = busy / 1000000000LL;
+	emu->busy.tv_nsec = busy % 1000000000LL;
+
+	emu->transfers++;
+	emu->bytes += size;
+
+}
+
+static void usb_emulator_wait(struct usb_emulator * emu) {
+
+	long long int busy = emu->busy.tv_sec * 1000000000LL + emu->busy.tv_nsec;
+	long long int now = usb_emulator_now();
+	struct timespec ts;
+
+	if ( busy <= now )
+		return;
+
+	ts.tv_sec = (busy - now) / 1000000000LL;
+	ts.tv_nsec = (busy - now) % 1000000000LL;
+	nanosleep(&ts, NULL);
+
+}
+
+static void usb_emulator_respond(struct usb_emulator * emu, const void * data, int size) {
+
+	int slot;
+
+	if ( emu->response_count >= EMULATOR_RESPONSES )
+		return;
+
+	if ( size > (int)sizeof(emu->responses[0]) )
+		size = sizeof(emu->responses[0]);
+
+	slot = ( emu->response_first + emu->response_count++ ) % EMULATOR_RESPONSES;
+	memcpy(emu->responses[slot], data, size);
+	emu->response_sizes[slot] = size;
+
+}
+
+static int usb_emulator_open(struct usb_device_info * dev) {
+
+	struct usb_emulator * emu;
+	const char * env;
+	char asic_id[69];
+	uint32_t chip;
+
+	emu = calloc(1, sizeof(*emu));
+	if ( ! emu )
+		ALLOC_ERROR_RETURN(-1);
+
+	if ( sscanf(dev->path, USB_EMULATOR_PATH "%d", &emu->index) != 1 || emu->index < 0 || emu->index >= usb_emulator_count() ) {
+		free(emu);
+		ERROR_RETURN("Unknown emulated device", -1);
+	}
+
+	emu->protocol = usb_emulator_protocol(emu->index);
+	emu->device = usb_emulator_device();
+
+	env = getenv("USB_EMULATOR_LATENCY");
+	if ( env )
+		emu->latency = atol(env);
+
+	env = getenv("USB_EMULATOR_BANDWIDTH");
+	if ( env )
+		emu->bandwidth = atol(env);
+
+	usb_emulator_set(emu, "hw_rev", emu->device == DEVICE_RX_51 ? "2101" : "1501");
+	usb_emulator_set(emu, "version:kernel", "2.6.28-20103103+0m5");
+	usb_emulator_set(emu, "version:initfs", "2.0");
+	usb_emulator_set(emu, "version:sw-release", "RX-51_2009SE_21.2011.38-1_PR_MR0");
+	usb_emulator_set(emu, "version:content", "RX-51_2009SE_21.2011.38-1.002");
+	usb_emulator_set(emu, "cmt:status", "idle");
+
+	/* Boot ROM sends ASIC ID immediately after enumeration */
+	if ( emu->protocol == FLASH_COLD ) {
+		memset(asic_id, 0, sizeof(asic_id));
+		memcpy(asic_id, "\x05\x01\x05\x01", 4);
+		chip = ( emu->device == DEVICE_RX_51 ) ? 0x3430 : 0x3630;
+		asic_id[4] = chip >> 8;
+		asic_id[5] = chip & 0xFF;
+		asic_id[6] = 0x07;
+		asic_id[7] = 0x10;
+		memcpy(asic_id+8, "\x13\x02\x01", 3);
+		memcpy(asic_id+12, "\x12\x15\x01", 3);
+		memcpy(asic_id+35, "\x14\x15\x01", 3);
+		memcpy(asic_id+58, "\x15\x09\x01", 3);
+		usb_emulator_respond(emu, asic_id, sizeof(asic_id));
+	}
+
+	dev->transport_data = emu;
+	return 0;
+
+}
+
+static void usb_emulator_close(struct usb_device_info * dev) {
+
+	struct usb_emulator * emu = dev->transport_data;
+
+	if ( ! emu )
+		return;
+
+	usb_emulator_wait(emu);
+
+	if ( verbose )
+		printf("USB emulator: %lu transfers, %llu bytes\n", emu->transfers, emu->bytes);
+
+	free(emu);
+	dev->transport_data = NULL;
+
+}
+
+static int usb_emulator_nolo_query(struct usb_emulator * emu, int request, int index, char * bytes, int size) {
+
+	char buf[512];
+	uint32_t val;
+	int len = 0;
+
+	switch ( request ) {
+
+		case NOLO_STATUS:
+			val = 0;
+			memcpy(buf, &val, 4);
+			len = 4;
+			break;
+
+		case NOLO_ERROR_LOG:
+			len = 0;
+			break;
+
+		case NOLO_IDENTIFY:
+			len = snprintf(buf, sizeof(buf), "prod_code%c%s%chw_rev%c%s", 0, device_to_string(emu->device), 0, 0, usb_emulator_get(emu, "hw_rev")) + 1;
+			break;
+
+		case NOLO_GET_NOLO_VERSION:
+			val = 1 << 20 | 4 << 16 | 14 << 8;
+			memcpy(buf, &val, 4);
+			len = 4;
+			break;
+
+		case NOLO_GET_STRING:
+			len = snprintf(buf, sizeof(buf), "%s", usb_emulator_get(emu, emu->key));
+			break;
+
+		case NOLO_GET:
+			if ( index == NOLO_RD_MODE ) {
+				memcpy(buf, &emu->rd_mode, 1);
+				len = 1;
+			} else if ( index == NOLO_ROOT_DEVICE ) {
+				memcpy(buf, &emu->root_device, 1);
+				len = 1;
+			} else if ( index == NOLO_USB_HOST_MODE ) {
+				memcpy(buf, &emu->usb_host_mode, 4);
+				len = 4;
+			} else if ( index == NOLO_ADD_RD_FLAGS ) {
+				memcpy(buf, &emu->rd_flags, 2);
+				len = 2;
+			} else {
+				return -1;
+			}
+			break;
+
+		default:
+			return -1;
+
+	}
+
+	if ( len > size )
+		len = size;
+
+	memcpy(bytes, buf, len);
+	return len;
+
+}
+
+static int usb_emulator_nolo_write(struct usb_emulator * emu, int request, int value, int index, char * bytes, int size) {
+
+	char buf[257];
+	uint32_t image_size;
+	int len;
+
+	switch ( request ) {
+
+		case NOLO_STRING:
+			if ( size >= (int)sizeof(emu->key) )
+				return -1;
+			memcpy(emu->key, bytes, size);
+			emu->key[size] = 0;
+			break;
+
+		case NOLO_SET_STRING:
+			if ( size >= (int)sizeof(buf) )
+				return -1;
+			memcpy(buf, bytes, size);
+			buf[size] = 0;
+			usb_emulator_set(emu, emu->key, buf);
+			break;
+
+		case NOLO_SET_SW_RELEASE:
+			/* 0xe8, length, "OSSO UART+USB", 0x31, length, release string */
+			if ( size < 2 || size < 2 + (uint8_t)bytes[1] + 2 )
+				return -1;
+			len = 2 + (uint8_t)bytes[1];
+			if ( bytes[len] != 0x31 || (uint8_t)bytes[len+1] == 0 || size < len + 2 + (uint8_t)bytes[len+1] )
+				return -1;
+			memcpy(buf, bytes + len + 2, (uint8_t)bytes[len+1]);
+			buf[(uint8_t)bytes[len+1]] = 0;
+			usb_emulator_set(emu, "version:sw-release", buf);
+			break;
+
+		case NOLO_SET:
+			if ( index == NOLO_RD_MODE )
+				emu->rd_mode = value;
+			else if ( index == NOLO_ROOT_DEVICE )
+				emu->root_device = value;
+			else if ( index == NOLO_USB_HOST_MODE )
+				emu->usb_host_mode = value;
+			else if ( index == NOLO_ADD_RD_FLAGS )
+				emu->rd_flags |= value;
+			else if ( index == NOLO_DEL_RD_FLAGS )
+				emu->rd_flags &= ~value;
+			else
+				return -1;
+			break;
+
+		case NOLO_SEND_IMAGE:
+		case NOLO_SEND_FLASH_IMAGE:
+			/* Image header: file data (5 bytes), hash (2 bytes), type (12 bytes), size (4 bytes) */
+			if ( size < 23 )
+				return -1;
+			memcpy(&image_size, bytes + 19, 4);
+			emu->image_size = ntohl(image_size);
+			emu->image_received = 0;
+			break;
+
+		case NOLO_SEND_FLASH_FINISH:
+			if ( emu->image_received != emu->image_size )
+				return -1;
+			break;
+
+		case NOLO_FLASH_IMAGE:
+			if ( emu->image_received != emu->image_size )
+				return -1;
+			break;
+
+		case NOLO_BOOT:
+			/* Booted system is in PC Suite or Update mode */
+			usb_emulator_set_mode(emu, FLASH_MKII);
+			break;
+
+		case NOLO_REBOOT:
+			/* Boot ROM enumerates on every boot */
+			usb_emulator_set_mode(emu, FLASH_COLD);
+			break;
+
+		default:
+			return -1;
+
+	}
+
+	return size;
+
+}
+
+static int usb_emulator_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	struct usb_emulator * emu = dev->transport_data;
+
+	(void)timeout;
+
+	usb_emulator_transfer(emu, size);
+	usb_emulator_wait(emu);
+
+	if ( emu->protocol != FLASH_NOLO )
+		return -1;
+
+	if ( requesttype == NOLO_QUERY )
+		return usb_emulator_nolo_query(emu, request, index, bytes, size);
+	else if ( requesttype == NOLO_WRITE )
+		return usb_emulator_nolo_write(emu, request, value, index, bytes, size);
+
+	return -1;
+
+}
+
+/* Device flashes buffered image data at constant rate */
+static void usb_emulator_mkii_drain(struct usb_emulator * emu) {
+
+	long long int now = usb_emulator_now();
+	long long int done;
+
+	done = ( now - emu->mkii_drained ) / 1000 * MKII_FLASH_RATE / 1000000;
+	if ( done <= 0 )
+		return;
+
+	if ( done > emu->mkii_buffered )
+		done = emu->mkii_buffered;
+
+	emu->mkii_buffered -= done;
+	emu->mkii_drained = now;
+
+}
+
+static void usb_emulator_mkii(struct usb_emulator * emu, const char * bytes, int size) {
+
+	char buf[2048];
+	char in[1024];
+	uint32_t header;
+	uint32_t val;
+	uint8_t type;
+	const char * value = NULL;
+	int len;
+
+	if ( size < 10 || size - 10 >= (int)sizeof(in) )
+		return;
+
+	memcpy(&header, bytes, 4);
+	if ( header != MKII_OUT )
+		return;
+
+	type = bytes[9];
+	memcpy(in, bytes + 10, size - 10);
+	in[size - 10] = 0;
+
+	/* Status byte, 0 means success */
+	buf[10] = 0;
+	len = 1;
+
+	switch ( type ) {
+
+		case MKII_PING:
+			len = 0;
+			break;
+
+		case MKII_GET:
+			if ( strcmp(in, "/update/protocol_version") == 0 )
+				value = "2";
+			else if ( strcmp(in, "/update/supported_images") == 0 )
+				value = "xloader,secondary,kernel,initfs,rootfs,mmc";
+			else if ( strcmp(in, "/device/product_code") == 0 )
+				value = device_to_string(emu->device);
+			else if ( strcmp(in, "/device/hw_build") == 0 )
+				value = usb_emulator_get(emu, "hw_rev");
+			else if ( strcmp(in, "/version/sw_release") == 0 )
+				value = usb_emulator_get(emu, "version:sw-release");
+			if ( value ) {
+				len = 1 + snprintf(buf + 11, sizeof(buf) - 11, "%s", value);
+			} else {
+				buf[10] = 1;
+			}
+			break;
+
+		case MKII_TELL:
+			break;
+
+		case MKII_REBOOT:
+			usb_emulator_set_mode(emu, ( strcmp(in, "reboot=update") == 0 ) ? FLASH_MKII : FLASH_COLD);
+			break;
+
+		case MKII_IMAGE_START:
+			emu->image_size = 0;
+			emu->image_received = 0;
+			emu->mkii_announced = 0;
+			emu->mkii_buffered = 0;
+			break;
+
+		case MKII_IMAGE_HEADER:
+			if ( size < 10 + 23 ) {
+				buf[10] = 1;
+				break;
+			}
+			memcpy(&val, bytes + 10 + 19, 4);
+			emu->image_size = ntohl(val);
+			/* Status and 8 bytes of image info */
+			memset(buf + 10, 0, 9);
+			len = 9;
+			break;
+
+		case MKII_IMAGE_TRANSPORT:
+			if ( size < 10 + 11 || memcmp(bytes + 14, "usb:raw", 7) != 0 )
+				buf[10] = 1;
+			break;
+
+		case MKII_IMAGE_STATUS:
+			usb_emulator_mkii_drain(emu);
+			memset(buf + 10, 0, 21);
+			buf[13] = ( emu->mkii_buffered || emu->image_received < emu->image_size ) ? 3 : 1;
+			len = 21;
+			break;
+
+		case MKII_IMAGE_BUFFER:
+			usb_emulator_mkii_drain(emu);
+			memset(buf + 10, 0, 13);
+			buf[13] = 1;
+			val = htonl(MKII_BUFFER_SIZE - emu->mkii_buffered);
+			memcpy(buf + 18, &val, 4);
+			len = 13;
+			break;
+
+		case MKII_IMAGE_DATA:
+			if ( size < 10 + 8 ) {
+				buf[10] = 1;
+				break;
+			}
+			memcpy(&val, bytes + 14, 4);
+			val = ntohl(val);
+			if ( emu->image_received + emu->mkii_announced + val > emu->image_size )
+				buf[10] = 1;
+			else
+				emu->mkii_announced += val;
+			break;
+
+		default:
+			buf[10] = 1;
+			break;
+
+	}
+
+	header = MKII_IN;
+	memcpy(buf, &header, 4);
+	buf[4] = ( len + 4 ) >> 8;
+	buf[5] = ( len + 4 ) & 0xFF;
+	buf[6] = 0;
+	buf[7] = 0;
+	buf[8] = bytes[8];
+	buf[9] = type | MKII_RESPONCE;
+
+	usb_emulator_respond(emu, buf, 10 + len);
+
+}
+
+static int usb_emulator_cold(struct usb_emulator * emu, const char * bytes, int size) {
+
+	static const uint32_t response = 0;
+	uint32_t val;
+
+	switch ( emu->cold_state ) {
+
+		case COLD_PERIPHERAL:
+			if ( size != 4 )
+				break;
+			memcpy(&val, bytes, 4);
+			if ( val == OMAP_PERIPHERAL_MSG )
+				emu->cold_state = COLD_SIZE;
+			else if ( val == OMAP_MEMORY_MSG )
+				usb_emulator_set_mode(emu, FLASH_NOLO);
+			break;
+
+		case COLD_SIZE:
+			if ( size != 4 )
+				break;
+			memcpy(&emu->cold_size, bytes, 4);
+			emu->cold_received = 0;
+			emu->cold_state = COLD_2ND;
+			break;
+
+		case COLD_2ND:
+			/* Transfer must not continue behind end of image, those bytes would be next message */
+			if ( emu->cold_received + size > emu->cold_size )
+				return -1;
+			emu->cold_received += size;
+			if ( emu->cold_received >= emu->cold_size )
+				emu->cold_state = COLD_XLOADER;
+			break;
+
+		case COLD_XLOADER:
+			if ( size == 4 ) {
+				memcpy(&val, bytes, 4);
+				if ( val == OMAP_MEMORY_MSG )
+					usb_emulator_set_mode(emu, FLASH_NOLO);
+				break;
+			}
+			if ( size != 16 )
+				break;
+			memcpy(&val, bytes, 4);
+			if ( val == XLOADER_MSG_TYPE_PING ) {
+				usb_emulator_respond(emu, &response, 4);
+			} else if ( val == XLOADER_MSG_TYPE_SEND ) {
+				memcpy(&emu->cold_size, bytes + 4, 4);
+				emu->cold_received = 0;
+				emu->cold_state = COLD_SECONDARY;
+				usb_emulator_respond(emu, &response, 4);
+			}
+			break;
+
+		case COLD_SECONDARY:
+			if ( emu->cold_received + size > emu->cold_size )
+				return -1;
+			emu->cold_received += size;
+			if ( emu->cold_received >= emu->cold_size ) {
+				/* Secondary bootloader is booted and device reconnects in NOLO mode */
+				emu->cold_state = COLD_XLOADER;
+				usb_emulator_set_mode(emu, FLASH_NOLO);
+				usb_emulator_respond(emu, &response, 4);
+			}
+			break;
+
+	}
+
+	return 0;
+
+}
+
+static int usb_emulator_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	struct usb_emulator * emu = dev->transport_data;
+
+	(void)timeout;
+
+	usb_emulator_transfer(emu, size);
+
+	if ( emu->protocol == FLASH_NOLO && ep == USB_WRITE_DATA_EP ) {
+		if ( emu->image_received + size > emu->image_size )
+			return -1;
+		emu->image_received += size;
+	} else if ( emu->protocol == FLASH_MKII && ep == USB_WRITE_EP ) {
+		usb_emulator_mkii(emu, bytes, size);
+	} else if ( emu->protocol == FLASH_MKII && ep == USB_WRITE_DATA_EP ) {
+		/* Raw image data must be announced and must fit into buffer */
+		usb_emulator_mkii_drain(emu);
+		if ( (uint32_t)size > emu->mkii_announced || emu->mkii_buffered + size > MKII_BUFFER_SIZE )
+			return -1;
+		if ( ! emu->mkii_buffered )
+			emu->mkii_drained = usb_emulator_now();
+		emu->mkii_announced -= size;
+		emu->mkii_buffered += size;
+		emu->image_received += size;
+	} else if ( emu->protocol == FLASH_COLD && ep == USB_WRITE_EP ) {
+		if ( usb_emulator_cold(emu, bytes, size) != 0 )
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return 0;
+
+}
+
+static int usb_emulator_bulk_flush(struct usb_device_info * dev) {
+
+	usb_emulator_wait(dev->transport_data);
+	return 0;
+
+}
+
+static int usb_emulator_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	if ( usb_emulator_bulk_submit(dev, ep, bytes, size, timeout) != 0 )
+		return -1;
+
+	usb_emulator_bulk_flush(dev);
+	return size;
+
+}
+
+static int usb_emulator_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	struct usb_emulator * emu = dev->transport_data;
+	int len;
+
+	if ( ep != USB_READ_EP || emu->response_count <= 0 ) {
+		/* Nothing to read, emulate timeout */
+		MSLEEP(timeout);
+		return -1;
+	}
+
+	len = emu->response_sizes[emu->response_first];
+	if ( len > size )
+		len = size;
+
+	usb_emulator_transfer(emu, len);
+	usb_emulator_wait(emu);
+
+	memcpy(bytes, emu->responses[emu->response_first], len);
+	emu->response_first = ( emu->response_first + 1 ) % EMULATOR_RESPONSES;
+	emu->response_count--;
+	return len;
+
+}
+
+const struct usb_transport usb_transport_emulator = {
+	.name = "emulator",
+	.open = usb_emulator_open,
+	.close = usb_emulator_close,
+	.control_msg = usb_emulator_control_msg,
+	.bulk_read = usb_emulator_bulk_read,
+	.bulk_write = usb_emulator_bulk_write,
+	.async = 1,
+	.bulk_submit = usb_emulator_bulk_submit,
+	.bulk_flush = usb_emulator_bulk_flush,
+};
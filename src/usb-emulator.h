@@ -0,0 +1,50 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef USB_EMULATOR_H
+#define USB_EMULATOR_H
+
+#include "device.h"
+#include "usb-device.h"
+
+/*
+  In-process emulator of NOLO, Mk II and Cold Flash devices, configured by environment variables:
+  USB_EMULATOR=mode[:device]   mode is nolo, mkii or cold, device defaults to RX-51
+  USB_EMULATOR_COUNT=n         number of emulated devices (default 1), all start in same mode
+  USB_EMULATOR_LATENCY=usec    latency of every transfer
+  USB_EMULATOR_BANDWIDTH=B/s   bandwidth of bulk transfers, 0 for unlimited
+*/
+
+#define USB_EMULATOR_MAX	64
+
+/* USB bus path of emulated device is this prefix followed by its index */
+#define USB_EMULATOR_PATH	"emulator-"
+
+/* Number of emulated devices, 0 when emulator is disabled */
+int usb_emulator_count(void);
+
+/* Protocol of emulated device in its current mode */
+enum usb_flash_protocol usb_emulator_protocol(int index);
+
+/* Emulated device */
+enum device usb_emulator_device(void);
+
+extern const struct usb_transport usb_transport_emulator;
+
+#endif
@@ -0,0 +1,281 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libusb.h>
+
+#include "global.h"
+#include "usb-device.h"
+#include "usb-libusb1.h"
+
+/* Device is found and claimed via libusb 0.1, libusb 1.0 handle is opened for same bus and address */
+
+struct usb_libusb1 {
+	libusb_device_handle * handle;
+	int interface;
+	int pending;	/* number of submitted and not completed transfers */
+	int completed;	/* all submitted transfers completed */
+	int error;	/* errno of first failed submitted transfer */
+};
+
+static libusb_context * usb_libusb1_ctx;
+
+static int usb_libusb1_open(struct usb_device_info * dev) {
+
+	struct usb_device * device = usb_device(dev->udev);
+	struct usb_libusb1 * data;
+	libusb_device ** list;
+	libusb_device_handle * handle = NULL;
+	ssize_t count, i;
+	int busnum;
+
+	if ( ! usb_libusb1_ctx && libusb_init(&usb_libusb1_ctx) != 0 ) {
+		usb_libusb1_ctx = NULL;
+		return -1;
+	}
+
+	/* libusb 0.1 on Linux names buses and devices by usbfs numbers */
+	busnum = atoi(device->bus->dirname);
+
+	count = libusb_get_device_list(usb_libusb1_ctx, &list);
+	if ( count < 0 )
+		return -1;
+
+	for ( i = 0; i < count; ++i ) {
+		if ( libusb_get_bus_number(list[i]) == busnum && libusb_get_device_address(list[i]) == device->devnum ) {
+			if ( libusb_open(list[i], &handle) != 0 )
+				handle = NULL;
+			break;
+		}
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if ( ! handle )
+		return -1;
+
+	/* Move claimed interface from libusb 0.1 handle */
+	if ( dev->flash_device->interface >= 0 ) {
+		usb_release_interface(dev->udev, dev->flash_device->interface);
+		if ( libusb_claim_interface(handle, dev->flash_device->interface) != 0 ) {
+			usb_claim_interface(dev->udev, dev->flash_device->interface);
+			libusb_close(handle);
+			return -1;
+		}
+		if ( dev->flash_device->alternate >= 0 && libusb_set_interface_alt_setting(handle, dev->flash_device->interface, dev->flash_device->alternate) != 0 ) {
+			libusb_release_interface(handle, dev->flash_device->interface);
+			usb_claim_interface(dev->udev, dev->flash_device->interface);
+			libusb_close(handle);
+			return -1;
+		}
+	}
+
+	data = calloc(1, sizeof(*data));
+	if ( ! data ) {
+		if ( dev->flash_device->interface >= 0 ) {
+			libusb_release_interface(handle, dev->flash_device->interface);
+			usb_claim_interface(dev->udev, dev->flash_device->interface);
+		}
+		libusb_close(handle);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	data->handle = handle;
+	data->interface = dev->flash_device->interface;
+	dev->transport_data = data;
+	return 0;
+
+}
+
+static int usb_libusb1_flush(struct usb_device_info * dev);
+
+static void usb_libusb1_close(struct usb_device_info * dev) {
+
+	struct usb_libusb1 * data = dev->transport_data;
+
+	if ( ! data )
+		return;
+
+	usb_libusb1_flush(dev);
+
+	if ( data->interface >= 0 )
+		libusb_release_interface(data->handle, data->interface);
+
+	libusb_close(data->handle);
+	free(data);
+	dev->transport_data = NULL;
+
+}
+
+/* Convert libusb 1.0 error code to libusb 0.1 style -1 return value with errno, usb_wait_for_disconnect() checks ENODEV */
+static int usb_libusb1_error(int ret) {
+
+	if ( ret >= 0 )
+		return ret;
+
+	switch ( ret ) {
+		case LIBUSB_ERROR_INVALID_PARAM: errno = EINVAL; break;
+		case LIBUSB_ERROR_ACCESS: errno = EACCES; break;
+		case LIBUSB_ERROR_NO_DEVICE: errno = ENODEV; break;
+		case LIBUSB_ERROR_NOT_FOUND: errno = ENOENT; break;
+		case LIBUSB_ERROR_BUSY: errno = EBUSY; break;
+		case LIBUSB_ERROR_TIMEOUT: errno = ETIMEDOUT; break;
+		case LIBUSB_ERROR_OVERFLOW: errno = EOVERFLOW; break;
+		case LIBUSB_ERROR_PIPE: errno = EPIPE; break;
+		case LIBUSB_ERROR_INTERRUPTED: errno = EINTR; break;
+		case LIBUSB_ERROR_NO_MEM: errno = ENOMEM; break;
+		case LIBUSB_ERROR_NOT_SUPPORTED: errno = ENOSYS; break;
+		default: errno = EIO; break;
+	}
+
+	return -1;
+
+}
+
+/* Same for status of asynchronous transfer */
+static int usb_libusb1_status_errno(enum libusb_transfer_status status) {
+
+	switch ( status ) {
+		case LIBUSB_TRANSFER_TIMED_OUT: return ETIMEDOUT;
+		case LIBUSB_TRANSFER_CANCELLED: return ECANCELED;
+		case LIBUSB_TRANSFER_STALL: return EPIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE: return ENODEV;
+		case LIBUSB_TRANSFER_OVERFLOW: return EOVERFLOW;
+		default: return EIO;
+	}
+
+}
+
+static int usb_libusb1_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	struct usb_libusb1 * data = dev->transport_data;
+
+	return usb_libusb1_error(libusb_control_transfer(data->handle, requesttype, request, value, index, (unsigned char *)bytes, size, timeout));
+
+}
+
+static int usb_libusb1_bulk_transfer(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	struct usb_libusb1 * data = dev->transport_data;
+	int transferred = 0;
+	int ret;
+
+	ret = libusb_bulk_transfer(data->handle, ep, (unsigned char *)bytes, size, &transferred, timeout);
+	if ( ret != 0 && transferred == 0 )
+		return usb_libusb1_error(ret);
+
+	return transferred;
+
+}
+
+static int usb_libusb1_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	return usb_libusb1_bulk_transfer(dev, ep, bytes, size, timeout);
+
+}
+
+static int usb_libusb1_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	return usb_libusb1_bulk_transfer(dev, ep, (char *)bytes, size, timeout);
+
+}
+
+static void LIBUSB_CALL usb_libusb1_callback(struct libusb_transfer * transfer) {
+
+	struct usb_libusb1 * data = transfer->user_data;
+
+	if ( ! data->error && transfer->status != LIBUSB_TRANSFER_COMPLETED )
+		data->error = usb_libusb1_status_errno(transfer->status);
+	else if ( ! data->error && transfer->actual_length != transfer->length )
+		data->error = EIO;
+
+	/* Callback can be called from thread which flushes another device */
+	if ( __sync_sub_and_fetch(&data->pending, 1) == 0 )
+		data->completed = 1;
+
+	libusb_free_transfer(transfer);
+
+}
+
+static int usb_libusb1_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	struct usb_libusb1 * data = dev->transport_data;
+	struct libusb_transfer * transfer;
+	int ret;
+
+	transfer = libusb_alloc_transfer(0);
+	if ( ! transfer )
+		ALLOC_ERROR_RETURN(-1);
+
+	libusb_fill_bulk_transfer(transfer, data->handle, ep, (unsigned char *)bytes, size, usb_libusb1_callback, data, timeout);
+
+	__sync_add_and_fetch(&data->pending, 1);
+	data->completed = 0;
+
+	ret = libusb_submit_transfer(transfer);
+	if ( ret != 0 ) {
+		if ( __sync_sub_and_fetch(&data->pending, 1) == 0 )
+			data->completed = 1;
+		libusb_free_transfer(transfer);
+		return usb_libusb1_error(ret);
+	}
+
+	return 0;
+
+}
+
+static int usb_libusb1_flush(struct usb_device_info * dev) {
+
+	struct usb_libusb1 * data = dev->transport_data;
+	int ret;
+
+	while ( __sync_add_and_fetch(&data->pending, 0) > 0 ) {
+		ret = libusb_handle_events_completed(usb_libusb1_ctx, &data->completed);
+		if ( ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED ) {
+			usb_libusb1_error(ret);
+			if ( ! data->error )
+				data->error = errno;
+			break;
+		}
+	}
+
+	if ( ! data->error )
+		return 0;
+
+	errno = data->error;
+	data->error = 0;
+	return -1;
+
+}
+
+const struct usb_transport usb_transport_libusb1 = {
+	.name = "libusb1",
+	.open = usb_libusb1_open,
+	.close = usb_libusb1_close,
+	.control_msg = usb_libusb1_control_msg,
+	.bulk_read = usb_libusb1_bulk_read,
+	.bulk_write = usb_libusb1_bulk_write,
+	.async = 1,
+	.bulk_submit = usb_libusb1_bulk_submit,
+	.bulk_flush = usb_libusb1_flush,
+};
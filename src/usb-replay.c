@@ -0,0 +1,881 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "global.h"
+#include "device.h"
+#include "usb-device.h"
+#include "usb-replay.h"
+#include "usb-stats.h"
+#include "libusb-sniff.h"
+
+#define USB_RECORD_PAYLOAD	4096
+
+/* How many recorded transfers can be skipped when replayed session does not match */
+#define USB_REPLAY_LOOKAHEAD	32
+
+#define USB_REPLAY_PHASES	64
+
+#define MKII_OUT	0x8810001B
+#define MKII_IN		0x8800101B
+#define OMAP_PERIPHERAL_MSG	0xF0030002
+#define OMAP_MEMORY_MSG		0
+#define XLOADER_MSG_TYPE_PING	0x6301326E
+#define XLOADER_MSG_TYPE_SEND	0x6302326E
+
+static uint64_t usb_replay_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+/* Recorder */
+
+static pthread_mutex_t usb_record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int usb_record_initialized;
+static int usb_record_fd = -1;
+static struct usbsniff_trace_header usb_record_header;
+static char * usb_record_slot;
+
+void usb_record_init(void) {
+
+	struct timespec realtime;
+	const char * file;
+	const char * env;
+	size_t payload_size = USB_RECORD_PAYLOAD;
+	int fd;
+
+	pthread_mutex_lock(&usb_record_lock);
+
+	if ( usb_record_initialized ) {
+		pthread_mutex_unlock(&usb_record_lock);
+		return;
+	}
+
+	usb_record_initialized = 1;
+
+	file = getenv("USB_RECORD");
+	if ( ! file || ! file[0] ) {
+		pthread_mutex_unlock(&usb_record_lock);
+		return;
+	}
+
+	env = getenv("USB_RECORD_PAYLOAD");
+	if ( env ) {
+		payload_size = strtoul(env, NULL, 0);
+		if ( payload_size > USBSNIFF_TRACE_PAYLOAD_MAX )
+			payload_size = USBSNIFF_TRACE_PAYLOAD_MAX;
+	}
+
+	memcpy(usb_record_header.magic, USBSNIFF_TRACE_MAGIC, sizeof(usb_record_header.magic));
+	usb_record_header.version = USBSNIFF_TRACE_VERSION;
+	usb_record_header.byte_order = USBSNIFF_TRACE_BYTE_ORDER;
+	usb_record_header.header_size = sizeof(usb_record_header);
+	usb_record_header.slot_size = ( sizeof(struct usbsniff_trace_record) + payload_size + 7 ) & ~(size_t)7;
+	usb_record_header.payload_size = payload_size;
+	usb_record_header.pid = getpid();
+
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	usb_record_header.realtime_offset = (int64_t)( (uint64_t)realtime.tv_sec * 1000000000 + realtime.tv_nsec - usb_replay_now() );
+
+	usb_record_slot = calloc(1, usb_record_header.slot_size);
+	if ( ! usb_record_slot ) {
+		pthread_mutex_unlock(&usb_record_lock);
+		ALLOC_ERROR_RETURN();
+	}
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( fd < 0 || pwrite(fd, &usb_record_header, sizeof(usb_record_header), 0) != sizeof(usb_record_header) ) {
+		ERROR_INFO("Cannot create USB record file %s", file);
+		if ( fd >= 0 )
+			close(fd);
+		free(usb_record_slot);
+		usb_record_slot = NULL;
+		pthread_mutex_unlock(&usb_record_lock);
+		return;
+	}
+
+	__atomic_store_n(&usb_record_fd, fd, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&usb_record_lock);
+
+}
+
+void usb_record(struct usb_device_info * dev, int type, int ep, int requesttype, int request, int value, int index, const char * bytes, int size, int ret, int timeout, uint64_t start) {
+
+	struct usbsniff_trace_record * record;
+	uint32_t captured = 0;
+	int fd;
+
+	fd = __atomic_load_n(&usb_record_fd, __ATOMIC_ACQUIRE);
+	if ( fd < 0 )
+		return;
+
+	/* Read data are valid only after transfer */
+	if ( ep & 0x80 ) {
+		if ( ret > 0 )
+			captured = ret;
+	} else if ( size > 0 ) {
+		captured = size;
+	}
+
+	pthread_mutex_lock(&usb_record_lock);
+
+	if ( captured > usb_record_header.payload_size )
+		captured = usb_record_header.payload_size;
+
+	record = (struct usbsniff_trace_record *)usb_record_slot;
+	memset(usb_record_slot, 0, usb_record_header.slot_size);
+
+	record->seq = usb_record_header.next_seq + 1;
+	record->start = start * 1000;
+	record->end = usb_replay_now();
+	record->type = type;
+	record->ep = ep;
+	record->requesttype = requesttype;
+	record->request = request;
+	record->value = value;
+	record->index = index;
+	record->size = size;
+	record->ret = ret;
+	record->captured = captured;
+	record->timeout = timeout;
+
+	if ( captured )
+		memcpy(record + 1, bytes, captured);
+
+	if ( pwrite(fd, usb_record_slot, usb_record_header.slot_size, usb_record_header.header_size + usb_record_header.next_seq * usb_record_header.slot_size) == (ssize_t)usb_record_header.slot_size ) {
+		usb_record_header.next_seq++;
+		usb_record_header.slot_count = usb_record_header.next_seq;
+		if ( pwrite(fd, &usb_record_header, sizeof(usb_record_header), 0) != sizeof(usb_record_header) )
+			ERROR_INFO("Cannot write USB record file");
+	} else {
+		ERROR_INFO("Cannot write USB record file");
+	}
+
+	pthread_mutex_unlock(&usb_record_lock);
+
+	(void)dev;
+
+}
+
+/* Replay */
+
+struct usb_replay_phase {
+	enum usb_flash_protocol protocol;
+	int request;
+	unsigned long int transfers;
+	uint64_t recorded;
+	uint64_t replayed;
+};
+
+struct usb_replay {
+	const struct usbsniff_trace_header * header;
+	size_t size;
+	const struct usbsniff_trace_record ** records;
+	size_t count;
+	size_t pos;	/* next recorded transfer */
+	size_t skipped;
+	size_t different;	/* OUT transfers with data different from recording */
+	enum device device;
+	double speed;
+	uint64_t busy;	/* time when all replayed transfers are finished */
+	uint64_t available;	/* time when device connects again */
+	int reconnect;	/* device was closed after last transfer */
+	uint64_t start;
+	uint64_t last_done;
+	uint64_t recorded_start;
+	uint64_t last_recorded;
+	struct rusage usage;
+	int truncated;
+	struct usb_replay_phase phases[USB_REPLAY_PHASES];
+	int phase_count;
+};
+
+static pthread_mutex_t usb_replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static int usb_replay_initialized;
+static struct usb_replay usb_replay;
+
+static void usb_replay_report(void);
+
+static int usb_replay_compare(const void * a, const void * b) {
+
+	const struct usbsniff_trace_record * ra = *(const struct usbsniff_trace_record * const *)a;
+	const struct usbsniff_trace_record * rb = *(const struct usbsniff_trace_record * const *)b;
+
+	if ( ra->seq < rb->seq )
+		return -1;
+	else if ( ra->seq > rb->seq )
+		return 1;
+	else
+		return 0;
+
+}
+
+static int usb_replay_load(const char * file) {
+
+	const struct usbsniff_trace_header * header;
+	const struct usbsniff_trace_record * record;
+	struct stat st;
+	void * map;
+	size_t i;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if ( fd < 0 || fstat(fd, &st) != 0 ) {
+		ERROR_INFO("Cannot open USB replay file %s", file);
+		if ( fd >= 0 )
+			close(fd);
+		return -1;
+	}
+
+	if ( (size_t)st.st_size < sizeof(*header) ) {
+		close(fd);
+		ERROR("USB replay file %s is too small", file);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		ERROR_INFO("Cannot map USB replay file %s", file);
+		return -1;
+	}
+
+	header = map;
+
+	if ( memcmp(header->magic, USBSNIFF_TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != USBSNIFF_TRACE_VERSION || header->byte_order != USBSNIFF_TRACE_BYTE_ORDER
+		|| header->slot_size < sizeof(*record) + header->payload_size || header->header_size + (uint64_t)header->slot_count * header->slot_size > (uint64_t)st.st_size ) {
+		munmap(map, st.st_size);
+		ERROR("Unsupported USB replay file %s", file);
+		return -1;
+	}
+
+	usb_replay.records = calloc(header->slot_count + 1, sizeof(*usb_replay.records));
+	if ( ! usb_replay.records ) {
+		munmap(map, st.st_size);
+		ALLOC_ERROR_RETURN(-1);
+	}
+
+	for ( i = 0; i < header->slot_count; ++i ) {
+		record = (const struct usbsniff_trace_record *)((const char *)header + header->header_size + i * header->slot_size);
+		if ( record->seq && record->captured <= header->payload_size )
+			usb_replay.records[usb_replay.count++] = record;
+	}
+
+	qsort(usb_replay.records, usb_replay.count, sizeof(*usb_replay.records), usb_replay_compare);
+
+	if ( usb_replay.count > 0 && usb_replay.records[0]->seq != 1 )
+		WARNING("Trace ring in %s was overwritten, replay starts in the middle of session", file);
+
+	usb_replay.header = header;
+	usb_replay.size = st.st_size;
+	return 0;
+
+}
+
+static void usb_replay_init(void) {
+
+	const char * env;
+	const char * ptr;
+	char * file;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	if ( usb_replay_initialized ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return;
+	}
+
+	usb_replay_initialized = 1;
+	usb_replay.device = DEVICE_RX_51;
+	usb_replay.speed = 1;
+
+	env = getenv("USB_REPLAY");
+	if ( ! env || ! env[0] ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return;
+	}
+
+	file = strdup(env);
+	if ( ! file ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		ALLOC_ERROR_RETURN();
+	}
+
+	/* File name itself can contain colon */
+	ptr = strrchr(env, ':');
+	if ( ptr && ptr[1] ) {
+		enum device device = device_from_string(ptr+1);
+		if ( device != DEVICE_UNKNOWN && device != DEVICE_ANY ) {
+			usb_replay.device = device;
+			file[ptr - env] = 0;
+		}
+	}
+
+	env = getenv("USB_REPLAY_SPEED");
+	if ( env && env[0] ) {
+		usb_replay.speed = atof(env);
+		if ( usb_replay.speed < 0 ) {
+			ERROR("Invalid USB replay speed %s", env);
+			usb_replay.speed = 1;
+		}
+	}
+
+	if ( usb_replay_load(file) == 0 ) {
+		printf("Replaying %lu recorded USB transfers from %s\n", (unsigned long int)usb_replay.count, file);
+		atexit(usb_replay_report);
+	}
+
+	free(file);
+	pthread_mutex_unlock(&usb_replay_lock);
+
+}
+
+int usb_replay_enabled(void) {
+
+	usb_replay_init();
+	return usb_replay.header != NULL;
+
+}
+
+enum device usb_replay_device(void) {
+
+	usb_replay_init();
+	return usb_replay.device;
+
+}
+
+static uint32_t usb_replay_le32(const struct usbsniff_trace_record * record) {
+
+	const uint8_t * data = (const uint8_t *)(record + 1);
+
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+
+}
+
+/* Protocol which recorded transfer belongs to, FLASH_UNKN when it cannot be decided */
+static enum usb_flash_protocol usb_replay_record_protocol(const struct usbsniff_trace_record * record) {
+
+	uint32_t msg;
+
+	if ( record->type == USBSNIFF_TRACE_CONTROL )
+		return FLASH_NOLO;
+
+	if ( record->type != USBSNIFF_TRACE_BULK )
+		return FLASH_UNKN;
+
+	if ( ( record->ep & 0x80 ) && record->ret == 69 )
+		return FLASH_COLD; /* ASIC ID */
+
+	if ( record->captured < 4 )
+		return FLASH_UNKN;
+
+	msg = usb_replay_le32(record);
+
+	if ( msg == MKII_OUT || msg == MKII_IN )
+		return FLASH_MKII;
+
+	if ( ! ( record->ep & 0x80 ) && record->size == 4 && ( msg == OMAP_PERIPHERAL_MSG || msg == OMAP_MEMORY_MSG ) )
+		return FLASH_COLD;
+
+	if ( ! ( record->ep & 0x80 ) && record->size == 16 && ( msg == XLOADER_MSG_TYPE_PING || msg == XLOADER_MSG_TYPE_SEND ) )
+		return FLASH_COLD;
+
+	return FLASH_UNKN;
+
+}
+
+enum usb_flash_protocol usb_replay_protocol(void) {
+
+	enum usb_flash_protocol protocol = FLASH_UNKN;
+	size_t i;
+
+	if ( ! usb_replay_enabled() )
+		return FLASH_UNKN;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	if ( usb_replay_now() >= usb_replay.available ) {
+		for ( i = usb_replay.pos; i < usb_replay.count && protocol == FLASH_UNKN; ++i )
+			protocol = usb_replay_record_protocol(usb_replay.records[i]);
+	}
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	return protocol;
+
+}
+
+static struct usb_replay_phase * usb_replay_phase(struct usb_device_info * dev) {
+
+	struct usb_replay_phase * phase;
+	int i;
+
+	for ( i = 0; i < usb_replay.phase_count; ++i ) {
+		phase = &usb_replay.phases[i];
+		if ( phase->protocol == dev->flash_device->protocol && phase->request == dev->stats_request )
+			return phase;
+	}
+
+	if ( usb_replay.phase_count == USB_REPLAY_PHASES )
+		return NULL;
+
+	phase = &usb_replay.phases[usb_replay.phase_count++];
+	phase->protocol = dev->flash_device->protocol;
+	phase->request = dev->stats_request;
+	return phase;
+
+}
+
+/* Find next recorded transfer matching replayed one, must be called with lock held */
+static const struct usbsniff_trace_record * usb_replay_next(int type, int ep, int request) {
+
+	const struct usbsniff_trace_record * record;
+	size_t skipped = 0;
+	size_t i;
+
+	for ( i = usb_replay.pos; i < usb_replay.count && i < usb_replay.pos + USB_REPLAY_LOOKAHEAD; ++i ) {
+
+		record = usb_replay.records[i];
+
+		/* Synchronous transfers do not have flush */
+		if ( record->type == USBSNIFF_TRACE_FLUSH )
+			continue;
+
+		if ( record->type == type && ( record->ep & 0x8F ) == ( ep & 0x8F ) && ( type != USBSNIFF_TRACE_CONTROL || record->request == request ) ) {
+			usb_replay.skipped += skipped;
+			usb_replay.pos = i + 1;
+			return record;
+		}
+
+		++skipped;
+
+	}
+
+	if ( usb_replay.pos >= usb_replay.count )
+		ERROR("USB replay: End of recorded session");
+	else
+		ERROR("USB replay: Transfer %s ep=%#04x request=%d does not match recorded transfer %llu", type == USBSNIFF_TRACE_CONTROL ? "control" : "bulk", ep, request, (unsigned long long int)usb_replay.records[usb_replay.pos]->seq);
+
+	return NULL;
+
+}
+
+/* Account recorded transfer and return time when it finishes, must be called with lock held */
+static uint64_t usb_replay_time(struct usb_device_info * dev, const struct usbsniff_trace_record * record, int wait) {
+
+	struct usb_replay_phase * phase;
+	uint64_t now = usb_replay_now();
+	uint64_t done;
+
+	/* Session is measured from first transfer */
+	if ( ! usb_replay.start ) {
+		usb_replay.start = usb_replay.last_done = now;
+		usb_replay.recorded_start = usb_replay.last_recorded = record->start;
+		getrusage(RUSAGE_SELF, &usb_replay.usage);
+	}
+
+	/* Time of waiting for reconnected device is not accounted to any request */
+	if ( usb_replay.reconnect ) {
+		usb_replay.last_done = now;
+		usb_replay.last_recorded = record->start;
+		usb_replay.reconnect = 0;
+	}
+
+	if ( usb_replay.busy < now )
+		usb_replay.busy = now;
+
+	if ( usb_replay.speed > 0 )
+		usb_replay.busy += (uint64_t)( ( record->end - record->start ) / usb_replay.speed );
+
+	done = wait ? usb_replay.busy : now;
+
+	phase = usb_replay_phase(dev);
+	if ( phase ) {
+		phase->transfers++;
+		phase->recorded += record->end - usb_replay.last_recorded;
+		phase->replayed += done - usb_replay.last_done;
+	}
+
+	usb_replay.last_recorded = record->end;
+	usb_replay.last_done = done;
+
+	return done;
+
+}
+
+static void usb_replay_sleep(uint64_t until) {
+
+	uint64_t now = usb_replay_now();
+	struct timespec ts;
+
+	if ( until <= now )
+		return;
+
+	ts.tv_sec = ( until - now ) / 1000000000;
+	ts.tv_nsec = ( until - now ) % 1000000000;
+	nanosleep(&ts, NULL);
+
+}
+
+/* Copy recorded data of IN transfer, must be called with lock held */
+static int usb_replay_data(const struct usbsniff_trace_record * record, char * bytes, int size) {
+
+	int ret = record->ret;
+	int captured = record->captured;
+
+	if ( ret <= 0 )
+		return ret;
+
+	if ( ret > size )
+		ret = size;
+
+	if ( captured > ret )
+		captured = ret;
+
+	memcpy(bytes, record + 1, captured);
+
+	if ( captured < ret ) {
+		memset(bytes + captured, 0, ret - captured);
+		if ( ! usb_replay.truncated ) {
+			WARNING("USB replay: Recorded data were truncated, record session with bigger payload size");
+			usb_replay.truncated = 1;
+		}
+	}
+
+	return ret;
+
+}
+
+/* Compare data of OUT transfer with recorded prefix, must be called with lock held */
+static int usb_replay_check_data(const struct usbsniff_trace_record * record, const char * bytes, int size) {
+
+	if ( size != record->size || ( record->captured > 0 && memcmp(bytes, record + 1, record->captured) != 0 ) ) {
+		usb_replay.different++;
+		ERROR("USB replay: Data of transfer does not match recorded transfer %llu", (unsigned long long int)record->seq);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+static int usb_replay_open(struct usb_device_info * dev) {
+
+	if ( ! usb_replay_enabled() )
+		return -1;
+
+	dev->transport_data = NULL;
+	return 0;
+
+}
+
+/* Device reconnects after same time as in recorded session */
+static void usb_replay_close(struct usb_device_info * dev) {
+
+	const struct usbsniff_trace_record * prev;
+	const struct usbsniff_trace_record * next;
+	uint64_t now;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	now = usb_replay_now();
+	if ( usb_replay.busy > now )
+		now = usb_replay.busy;
+
+	usb_replay.available = now;
+	usb_replay.reconnect = 1;
+
+	if ( usb_replay.pos > 0 && usb_replay.pos < usb_replay.count && usb_replay.speed > 0 ) {
+		prev = usb_replay.records[usb_replay.pos - 1];
+		next = usb_replay.records[usb_replay.pos];
+		if ( next->start > prev->end )
+			usb_replay.available += (uint64_t)( ( next->start - prev->end ) / usb_replay.speed );
+	}
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	(void)dev;
+
+}
+
+static int usb_replay_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	const struct usbsniff_trace_record * record;
+	uint64_t done;
+	int ret;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	record = usb_replay_next(USBSNIFF_TRACE_CONTROL, requesttype & 0x80, request);
+	if ( ! record ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return -1;
+	}
+
+	if ( requesttype & 0x80 ) {
+		ret = usb_replay_data(record, bytes, size);
+	} else {
+		if ( usb_replay_check_data(record, bytes, size) != 0 ) {
+			pthread_mutex_unlock(&usb_replay_lock);
+			return -1;
+		}
+		ret = ( record->ret == record->size ) ? size : record->ret;
+	}
+
+	done = usb_replay_time(dev, record, 1);
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	usb_replay_sleep(done);
+
+	(void)value;
+	(void)index;
+	(void)timeout;
+	return ret;
+
+}
+
+static int usb_replay_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	const struct usbsniff_trace_record * record;
+	uint64_t done;
+	int ret;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	record = usb_replay_next(USBSNIFF_TRACE_BULK, ep | 0x80, 0);
+	if ( ! record ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return -1;
+	}
+
+	ret = usb_replay_data(record, bytes, size);
+	done = usb_replay_time(dev, record, 1);
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	usb_replay_sleep(done);
+
+	(void)timeout;
+	return ret;
+
+}
+
+static int usb_replay_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	const struct usbsniff_trace_record * record;
+	uint64_t done;
+	int ret;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	record = usb_replay_next(USBSNIFF_TRACE_BULK, ep & 0x7F, 0);
+	if ( ! record ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return -1;
+	}
+
+	if ( usb_replay_check_data(record, bytes, size) != 0 ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return -1;
+	}
+
+	ret = ( record->ret == record->size ) ? size : record->ret;
+	done = usb_replay_time(dev, record, 1);
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	usb_replay_sleep(done);
+
+	(void)timeout;
+	return ret;
+
+}
+
+/* Submitted transfer keeps replayed bus busy, waiting is done in flush */
+static int usb_replay_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	const struct usbsniff_trace_record * record;
+	int ret;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	record = usb_replay_next(USBSNIFF_TRACE_BULK, ep & 0x7F, 0);
+	if ( ! record ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return -1;
+	}
+
+	if ( usb_replay_check_data(record, bytes, size) != 0 ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return -1;
+	}
+
+	ret = ( record->ret < 0 ) ? record->ret : 0;
+	usb_replay_time(dev, record, 0);
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	(void)timeout;
+	return ret;
+
+}
+
+static int usb_replay_bulk_flush(struct usb_device_info * dev) {
+
+	const struct usbsniff_trace_record * record;
+	uint64_t done;
+	int ret = 0;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	if ( usb_replay.pos < usb_replay.count && usb_replay.records[usb_replay.pos]->type == USBSNIFF_TRACE_FLUSH ) {
+		record = usb_replay.records[usb_replay.pos++];
+		ret = record->ret;
+		done = usb_replay_time(dev, record, 1);
+	} else {
+		done = usb_replay.busy;
+	}
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	usb_replay_sleep(done);
+
+	return ret;
+
+}
+
+int usb_replay_check(void) {
+
+	int ret = 0;
+
+	if ( ! usb_replay_enabled() )
+		return 0;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	if ( usb_replay.skipped ) {
+		ERROR("USB replay: %lu recorded transfers were skipped", (unsigned long int)usb_replay.skipped);
+		ret = -1;
+	}
+
+	if ( usb_replay.different ) {
+		ERROR("USB replay: %lu transfers had different data than recording", (unsigned long int)usb_replay.different);
+		ret = -1;
+	}
+
+	if ( usb_replay.pos < usb_replay.count ) {
+		ERROR("USB replay: %lu recorded transfers were not replayed", (unsigned long int)( usb_replay.count - usb_replay.pos ));
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+	return ret;
+
+}
+
+static double usb_replay_delta(uint64_t replayed, uint64_t recorded) {
+
+	if ( ! recorded )
+		return 0;
+
+	return ( (double)replayed - (double)recorded ) * 100 / recorded;
+
+}
+
+static void usb_replay_report(void) {
+
+	struct usb_replay_phase * phase;
+	struct rusage usage;
+	char request_name[64];
+	uint64_t replayed;
+	uint64_t recorded;
+	int i;
+
+	pthread_mutex_lock(&usb_replay_lock);
+
+	if ( ! usb_replay.start ) {
+		pthread_mutex_unlock(&usb_replay_lock);
+		return;
+	}
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	replayed = usb_replay.last_done - usb_replay.start;
+	recorded = usb_replay.last_recorded - usb_replay.recorded_start;
+
+	flockfile(stderr);
+
+	fprintf(stderr, "\nUSB replay: %lu of %lu recorded transfers replayed, %lu skipped, %lu different, speed %g\n", (unsigned long int)usb_replay.pos, (unsigned long int)usb_replay.count, (unsigned long int)usb_replay.skipped, (unsigned long int)usb_replay.different, usb_replay.speed);
+	fprintf(stderr, "Wall time: %.3f s, recorded %.3f s (%+.1f%%)\n", replayed / 1e9, recorded / 1e9, usb_replay_delta(replayed, recorded));
+	fprintf(stderr, "Host CPU time: user %.3f s, system %.3f s\n",
+		( usage.ru_utime.tv_sec - usb_replay.usage.ru_utime.tv_sec ) + ( usage.ru_utime.tv_usec - usb_replay.usage.ru_utime.tv_usec ) / 1e6,
+		( usage.ru_stime.tv_sec - usb_replay.usage.ru_stime.tv_sec ) + ( usage.ru_stime.tv_usec - usb_replay.usage.ru_stime.tv_usec ) / 1e6);
+
+	fprintf(stderr, "%-14s %-28s %9s %12s %12s %12s %8s\n", "protocol", "request", "transfers", "recorded ms", "replayed ms", "delta ms", "delta");
+
+	for ( i = 0; i < usb_replay.phase_count; ++i ) {
+		phase = &usb_replay.phases[i];
+		usb_stats_request_name(phase->protocol, phase->request, request_name, sizeof(request_name));
+		fprintf(stderr, "%-14s %-28s %9lu %12.3f %12.3f %+12.3f %+7.1f%%\n",
+			usb_flash_protocol_to_string(phase->protocol) ? usb_flash_protocol_to_string(phase->protocol) : "unknown",
+			request_name,
+			phase->transfers,
+			phase->recorded / 1e6,
+			phase->replayed / 1e6,
+			( (double)phase->replayed - (double)phase->recorded ) / 1e6,
+			usb_replay_delta(phase->replayed, phase->recorded));
+	}
+
+	funlockfile(stderr);
+
+	pthread_mutex_unlock(&usb_replay_lock);
+
+}
+
+const struct usb_transport usb_transport_replay = {
+	.name = "replay",
+	.open = usb_replay_open,
+	.close = usb_replay_close,
+	.control_msg = usb_replay_control_msg,
+	.bulk_read = usb_replay_bulk_read,
+	.bulk_write = usb_replay_bulk_write,
+	.async = 1,
+	.bulk_submit = usb_replay_bulk_submit,
+	.bulk_flush = usb_replay_bulk_flush,
+};
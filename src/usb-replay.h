@@ -0,0 +1,65 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef USB_REPLAY_H
+#define USB_REPLAY_H
+
+#include <stdint.h>
+
+#include "device.h"
+#include "usb-device.h"
+
+/*
+  Recording and replaying of USB sessions in libusb-sniff trace format, configured by environment variables:
+  USB_RECORD=file              record all transfers of this process to file
+  USB_RECORD_PAYLOAD=bytes     number of stored data bytes of every transfer (default 4096)
+  USB_REPLAY=file[:device]     replay device side of recorded session instead of real device, device defaults to RX-51
+  USB_REPLAY_SPEED=factor      divide recorded device times by factor, 0 for no delays (default 1)
+
+  Replayed session reports wall time, host CPU time and per request time
+  compared with recording at exit. Data of every OUT transfer (recorded prefix)
+  must match recording, and replay fails when some recorded transfer was skipped
+  or not replayed at all. Target check in src/Makefile records and replays
+  sessions of all emulated modes.
+*/
+
+/* USB bus path of replayed device */
+#define USB_REPLAY_PATH		"replay-0"
+
+/* Start recording when USB_RECORD is set */
+void usb_record_init(void);
+
+/* Store transfer which started at start (usec from usb_stats_start()) when recording is enabled */
+void usb_record(struct usb_device_info * dev, int type, int ep, int requesttype, int request, int value, int index, const char * bytes, int size, int ret, int timeout, uint64_t start);
+
+/* Nonzero when USB_REPLAY is set and trace was loaded */
+int usb_replay_enabled(void);
+
+/* Protocol of device at current position in trace, FLASH_UNKN when device is not connected */
+enum usb_flash_protocol usb_replay_protocol(void);
+
+/* Replayed device */
+enum device usb_replay_device(void);
+
+/* Returns -1 when replayed session did not match recording, 0 otherwise or when replay is not enabled */
+int usb_replay_check(void);
+
+extern const struct usb_transport usb_transport_replay;
+
+#endif
@@ -0,0 +1,327 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "global.h"
+#include "usb-device.h"
+#include "usb-stats.h"
+#include "nolo.h"
+#include "mkii.h"
+#include "cold-flash.h"
+
+#define USB_STATS_REQUESTS	256
+
+/* Latency histogram with 16 linear sub-buckets in every power of two (max 6% error) up to 2^32 usec */
+#define USB_STATS_SUB_BITS	4
+#define USB_STATS_SUB		(1U << USB_STATS_SUB_BITS)
+#define USB_STATS_BUCKETS	(USB_STATS_SUB + (32 - USB_STATS_SUB_BITS) * USB_STATS_SUB)
+
+struct usb_stats_counter {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t shorts;
+	uint64_t retries;
+	uint64_t max;
+	uint32_t histogram[USB_STATS_BUCKETS];
+};
+
+struct usb_stats_entry {
+	struct usb_stats_counter ops[USB_STATS_OP_COUNT];
+};
+
+static const char * usb_stats_ops[] = {
+	[USB_STATS_CONTROL] = "control",
+	[USB_STATS_BULK_READ] = "read",
+	[USB_STATS_BULK_WRITE] = "write",
+	[USB_STATS_BULK_SUBMIT] = "submit",
+	[USB_STATS_BULK_FLUSH] = "flush",
+};
+
+/* Entries are allocated on first transfer, all counters are updated atomically from more threads */
+static struct usb_stats_entry * usb_stats[FLASH_COUNT][USB_STATS_REQUESTS];
+static volatile sig_atomic_t usb_stats_requested;
+static int usb_stats_initialized;
+
+static void usb_stats_signal(int signum) {
+
+	usb_stats_requested = 1;
+	(void)signum;
+
+}
+
+static void usb_stats_exit(void) {
+
+	usb_stats_print();
+
+}
+
+void usb_stats_init(void) {
+
+	if ( usb_stats_initialized )
+		return;
+
+	usb_stats_initialized = 1;
+
+	signal(SIGUSR1, usb_stats_signal);
+
+	if ( verbose || getenv("USB_STATS") )
+		atexit(usb_stats_exit);
+
+}
+
+uint64_t usb_stats_start(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+static struct usb_stats_entry * usb_stats_entry(struct usb_device_info * dev) {
+
+	struct usb_stats_entry ** slot;
+	struct usb_stats_entry * entry;
+	struct usb_stats_entry * expected = NULL;
+
+	slot = &usb_stats[dev->flash_device->protocol][(unsigned int)dev->stats_request % USB_STATS_REQUESTS];
+
+	entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if ( entry )
+		return entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if ( ! entry )
+		return NULL;
+
+	if ( ! __atomic_compare_exchange_n(slot, &expected, entry, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+		free(entry);
+		entry = expected;
+	}
+
+	return entry;
+
+}
+
+static unsigned int usb_stats_bucket(uint64_t value) {
+
+	unsigned int exp;
+
+	if ( value < USB_STATS_SUB )
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+	if ( exp >= 32 )
+		return USB_STATS_BUCKETS - 1;
+
+	return USB_STATS_SUB + ( exp - USB_STATS_SUB_BITS ) * USB_STATS_SUB + ( ( value >> ( exp - USB_STATS_SUB_BITS ) ) - USB_STATS_SUB );
+
+}
+
+/* Lowest value which falls into bucket */
+static uint64_t usb_stats_bucket_value(unsigned int bucket) {
+
+	unsigned int exp;
+
+	if ( bucket < USB_STATS_SUB )
+		return bucket;
+
+	exp = ( bucket - USB_STATS_SUB ) / USB_STATS_SUB + USB_STATS_SUB_BITS;
+
+	return (uint64_t)( USB_STATS_SUB + ( bucket - USB_STATS_SUB ) % USB_STATS_SUB ) << ( exp - USB_STATS_SUB_BITS );
+
+}
+
+void usb_stats_record(struct usb_device_info * dev, enum usb_stats_op op, int size, int ret, uint64_t start) {
+
+	struct usb_stats_entry * entry;
+	struct usb_stats_counter * counter;
+	uint64_t latency;
+	uint64_t max;
+
+	latency = usb_stats_start() - start;
+
+	entry = usb_stats_entry(dev);
+	if ( entry ) {
+
+		counter = &entry->ops[op];
+
+		__atomic_fetch_add(&counter->calls, 1, __ATOMIC_RELAXED);
+
+		if ( ret < 0 )
+			__atomic_fetch_add(&counter->errors, 1, __ATOMIC_RELAXED);
+		else if ( op == USB_STATS_BULK_SUBMIT )
+			__atomic_fetch_add(&counter->bytes, size, __ATOMIC_RELAXED);
+		else if ( op != USB_STATS_BULK_FLUSH ) {
+			__atomic_fetch_add(&counter->bytes, ret, __ATOMIC_RELAXED);
+			if ( ret < size )
+				__atomic_fetch_add(&counter->shorts, 1, __ATOMIC_RELAXED);
+		}
+
+		__atomic_fetch_add(&counter->histogram[usb_stats_bucket(latency)], 1, __ATOMIC_RELAXED);
+
+		max = __atomic_load_n(&counter->max, __ATOMIC_RELAXED);
+		while ( latency > max && ! __atomic_compare_exchange_n(&counter->max, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+			;
+
+	}
+
+	if ( usb_stats_requested )
+		usb_stats_poll();
+
+}
+
+void usb_stats_retry(struct usb_device_info * dev, enum usb_stats_op op) {
+
+	struct usb_stats_entry * entry = usb_stats_entry(dev);
+
+	if ( entry )
+		__atomic_fetch_add(&entry->ops[op].retries, 1, __ATOMIC_RELAXED);
+
+}
+
+void usb_stats_poll(void) {
+
+	if ( usb_stats_requested && __sync_bool_compare_and_swap(&usb_stats_requested, 1, 0) )
+		usb_stats_print();
+
+}
+
+void usb_stats_request_name(enum usb_flash_protocol protocol, unsigned int request, char * buf, size_t size) {
+
+	const char * name = NULL;
+
+	if ( protocol == FLASH_NOLO )
+		name = nolo_request_to_string(request);
+	else if ( protocol == FLASH_MKII )
+		name = mkii_message_to_string(request);
+	else if ( protocol == FLASH_COLD )
+		name = cold_flash_phase_to_string(request);
+
+	if ( name )
+		snprintf(buf, size, "%s (%u)", name, request);
+	else
+		snprintf(buf, size, "%u", request);
+
+}
+
+/* Highest value of bucket which contains given fraction of all values */
+static uint64_t usb_stats_percentile(const uint32_t * histogram, uint64_t calls, uint64_t max, unsigned int permille) {
+
+	uint64_t count = 0;
+	uint64_t need;
+	uint64_t value = max;
+	unsigned int i;
+
+	need = ( calls * permille + 999 ) / 1000;
+
+	for ( i = 0; i < USB_STATS_BUCKETS - 1; ++i ) {
+		count += histogram[i];
+		if ( count >= need ) {
+			value = usb_stats_bucket_value(i + 1) - 1;
+			break;
+		}
+	}
+
+	return ( value < max ) ? value : max;
+
+}
+
+void usb_stats_print(void) {
+
+	static uint32_t histogram[USB_STATS_BUCKETS];
+	struct usb_stats_entry * entry;
+	struct usb_stats_counter * counter;
+	const char * protocol_name;
+	char request_name[64];
+	uint64_t calls;
+	uint64_t max;
+	unsigned int protocol;
+	unsigned int request;
+	unsigned int op;
+	unsigned int i;
+	int header = 0;
+
+	flockfile(stderr);
+
+	for ( protocol = 0; protocol < FLASH_COUNT; ++protocol ) {
+
+		protocol_name = usb_flash_protocol_to_string(protocol);
+
+		for ( request = 0; request < USB_STATS_REQUESTS; ++request ) {
+
+			entry = __atomic_load_n(&usb_stats[protocol][request], __ATOMIC_ACQUIRE);
+			if ( ! entry )
+				continue;
+
+			usb_stats_request_name(protocol, request, request_name, sizeof(request_name));
+
+			for ( op = 0; op < USB_STATS_OP_COUNT; ++op ) {
+
+				counter = &entry->ops[op];
+
+				calls = __atomic_load_n(&counter->calls, __ATOMIC_RELAXED);
+				if ( ! calls )
+					continue;
+
+				/* Transfers can be running, so work with snapshot of histogram */
+				calls = 0;
+				for ( i = 0; i < USB_STATS_BUCKETS; ++i ) {
+					histogram[i] = __atomic_load_n(&counter->histogram[i], __ATOMIC_RELAXED);
+					calls += histogram[i];
+				}
+
+				max = __atomic_load_n(&counter->max, __ATOMIC_RELAXED);
+
+				if ( ! header ) {
+					fprintf(stderr, "\nUSB transfer statistics (latency in usec):\n");
+					fprintf(stderr, "%-14s %-28s %-8s %8s %12s %6s %6s %7s %8s %8s %8s %8s\n", "protocol", "request", "transfer", "calls", "bytes", "errors", "short", "retries", "p50", "p90", "p99", "max");
+					header = 1;
+				}
+
+				fprintf(stderr, "%-14s %-28s %-8s %8llu %12llu %6llu %6llu %7llu %8llu %8llu %8llu %8llu\n",
+					protocol_name ? protocol_name : "unknown",
+					request_name,
+					usb_stats_ops[op],
+					(unsigned long long int)calls,
+					(unsigned long long int)__atomic_load_n(&counter->bytes, __ATOMIC_RELAXED),
+					(unsigned long long int)__atomic_load_n(&counter->errors, __ATOMIC_RELAXED),
+					(unsigned long long int)__atomic_load_n(&counter->shorts, __ATOMIC_RELAXED),
+					(unsigned long long int)__atomic_load_n(&counter->retries, __ATOMIC_RELAXED),
+					(unsigned long long int)usb_stats_percentile(histogram, calls, max, 500),
+					(unsigned long long int)usb_stats_percentile(histogram, calls, max, 900),
+					(unsigned long long int)usb_stats_percentile(histogram, calls, max, 990),
+					(unsigned long long int)max);
+
+			}
+
+		}
+
+	}
+
+	funlockfile(stderr);
+
+}
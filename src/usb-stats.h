@@ -0,0 +1,64 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef USB_STATS_H
+#define USB_STATS_H
+
+#include <stdint.h>
+
+#include "usb-device.h"
+
+/*
+  Counters and latency histograms of all USB transfers, always collected.
+  Transfers are grouped by protocol and by request: NOLO control request,
+  Mk II message type or Cold Flash phase (dev->stats_request).
+
+  Statistics are printed to stderr on SIGUSR1 and at exit when verbose
+  mode is enabled or USB_STATS environment variable is set.
+*/
+
+enum usb_stats_op {
+	USB_STATS_CONTROL = 0,
+	USB_STATS_BULK_READ,
+	USB_STATS_BULK_WRITE,
+	USB_STATS_BULK_SUBMIT,
+	USB_STATS_BULK_FLUSH,
+	USB_STATS_OP_COUNT,
+};
+
+void usb_stats_init(void);
+
+/* Timestamp for usb_stats_record() */
+uint64_t usb_stats_start(void);
+
+/* Account transfer which started at start, size is requested and ret is returned size */
+void usb_stats_record(struct usb_device_info * dev, enum usb_stats_op op, int size, int ret, uint64_t start);
+
+/* Account transfer which protocol repeats */
+void usb_stats_retry(struct usb_device_info * dev, enum usb_stats_op op);
+
+/* Print statistics now if they were requested by SIGUSR1 */
+void usb_stats_poll(void);
+
+void usb_stats_print(void);
+
+/* Human readable name of protocol request used for grouping */
+void usb_stats_request_name(enum usb_flash_protocol protocol, unsigned int request, char * buf, size_t size);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "usb-usbfs.h"
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <linux/usbdevice_fs.h>
+
+#include "global.h"
+#include "usb-device.h"
+
+/* Character device major number of usbfs device nodes */
+#define USBFS_MAJOR		189
+
+/* Maximal number of queued URBs */
+#define USBFS_MAX_URBS		32
+
+/* Header of transfer buffer, usbfs mmap buffer can be used with offset */
+#define USBFS_BUFFER_HEADER	64
+
+struct usbfs_urb {
+	struct usbdevfs_urb * urb;
+	int timeout;
+	int used;
+};
+
+struct usbfs {
+	int fd;
+	int mmap;	/* kernel supports mmap of transfer buffers */
+	int pending;
+	int error;
+	struct usbfs_urb urbs[USBFS_MAX_URBS];
+};
+
+struct usbfs_buffer {
+	size_t size;
+	int mmap;
+};
+
+static int usbfs_open(struct usb_device_info * dev) {
+
+	struct usbfs * data;
+	struct stat st;
+	uint32_t caps = 0;
+	int fd;
+	int i;
+
+	/* libusb 0.1 on Linux stores usbfs file descriptor at start of usb_dev_handle */
+	fd = *((int *)dev->udev);
+
+	/* Check that handle is really from libusb 0.1 and not from some wrapper */
+	if ( fstat(fd, &st) != 0 || ! S_ISCHR(st.st_mode) || major(st.st_rdev) != USBFS_MAJOR )
+		return -1;
+
+	data = calloc(1, sizeof(*data));
+	if ( ! data )
+		ALLOC_ERROR_RETURN(-1);
+
+	data->fd = fd;
+
+	for ( i = 0; i < USBFS_MAX_URBS; ++i ) {
+		data->urbs[i].urb = calloc(1, sizeof(struct usbdevfs_urb));
+		if ( ! data->urbs[i].urb ) {
+			while ( i-- > 0 )
+				free(data->urbs[i].urb);
+			free(data);
+			ALLOC_ERROR_RETURN(-1);
+		}
+	}
+
+	if ( ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps) == 0 && ( caps & USBDEVFS_CAP_MMAP ) )
+		data->mmap = 1;
+
+	dev->transport_data = data;
+	return 0;
+
+}
+
+/* Wait for one URB and process its result, timeout in ms, -1 on timeout or error */
+static int usbfs_reap(struct usbfs * data, int timeout) {
+
+	struct usbdevfs_urb * urb;
+	struct usbfs_urb * entry;
+	struct pollfd pfd;
+	int ret;
+
+	while ( 1 ) {
+
+		urb = NULL;
+		ret = ioctl(data->fd, USBDEVFS_REAPURBNDELAY, &urb);
+		if ( ret == 0 )
+			break;
+
+		if ( errno != EAGAIN )
+			return -1;
+
+		/* usbfs signals completed URB by POLLOUT */
+		pfd.fd = data->fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, timeout);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return -1;
+
+	}
+
+	entry = urb->usercontext;
+	if ( urb->status != 0 || urb->actual_length != urb->buffer_length )
+		data->error = 1;
+
+	entry->used = 0;
+	data->pending--;
+	return 0;
+
+}
+
+/* Cancel all queued URBs, e.g. after timeout */
+static void usbfs_discard(struct usbfs * data) {
+
+	struct usbdevfs_urb * urb;
+	int i;
+
+	for ( i = 0; i < USBFS_MAX_URBS; ++i )
+		if ( data->urbs[i].used )
+			ioctl(data->fd, USBDEVFS_DISCARDURB, data->urbs[i].urb);
+
+	while ( data->pending > 0 ) {
+		urb = NULL;
+		if ( ioctl(data->fd, USBDEVFS_REAPURB, &urb) != 0 )
+			break;
+		((struct usbfs_urb *)urb->usercontext)->used = 0;
+		data->pending--;
+	}
+
+	data->error = 1;
+
+}
+
+static int usbfs_flush(struct usb_device_info * dev) {
+
+	struct usbfs * data = dev->transport_data;
+	int timeout;
+	int ret;
+	int i;
+
+	while ( data->pending > 0 ) {
+
+		timeout = 0;
+		for ( i = 0; i < USBFS_MAX_URBS; ++i )
+			if ( data->urbs[i].used && data->urbs[i].timeout > timeout )
+				timeout = data->urbs[i].timeout;
+
+		if ( usbfs_reap(data, timeout) != 0 ) {
+			usbfs_discard(data);
+			break;
+		}
+
+	}
+
+	ret = data->error ? -1 : 0;
+	data->error = 0;
+	return ret;
+
+}
+
+static void usbfs_close(struct usb_device_info * dev) {
+
+	struct usbfs * data = dev->transport_data;
+	int i;
+
+	if ( ! data )
+		return;
+
+	usbfs_flush(dev);
+
+	for ( i = 0; i < USBFS_MAX_URBS; ++i )
+		free(data->urbs[i].urb);
+
+	free(data);
+	dev->transport_data = NULL;
+
+}
+
+static int usbfs_control_msg(struct usb_device_info * dev, int requesttype, int request, int value, int index, char * bytes, int size, int timeout) {
+
+	struct usbfs * data = dev->transport_data;
+	struct usbdevfs_ctrltransfer ctrl;
+	int ret;
+
+	ctrl.bRequestType = requesttype;
+	ctrl.bRequest = request;
+	ctrl.wValue = value;
+	ctrl.wIndex = index;
+	ctrl.wLength = size;
+	ctrl.timeout = timeout;
+	ctrl.data = bytes;
+
+	ret = ioctl(data->fd, USBDEVFS_CONTROL, &ctrl);
+	if ( ret < 0 )
+		return -1;
+
+	return ret;
+
+}
+
+static int usbfs_bulk_submit(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	struct usbfs * data = dev->transport_data;
+	struct usbfs_urb * entry = NULL;
+	int i;
+
+	/* All URBs are queued, wait for first finished */
+	if ( data->pending >= USBFS_MAX_URBS ) {
+		if ( usbfs_reap(data, timeout) != 0 ) {
+			usbfs_discard(data);
+			return -1;
+		}
+	}
+
+	for ( i = 0; i < USBFS_MAX_URBS; ++i ) {
+		if ( ! data->urbs[i].used ) {
+			entry = &data->urbs[i];
+			break;
+		}
+	}
+
+	if ( ! entry )
+		return -1;
+
+	memset(entry->urb, 0, sizeof(*entry->urb));
+	entry->urb->type = USBDEVFS_URB_TYPE_BULK;
+	entry->urb->endpoint = ep;
+	entry->urb->buffer = (void *)bytes;
+	entry->urb->buffer_length = size;
+	entry->urb->usercontext = entry;
+	entry->timeout = timeout;
+
+	if ( ioctl(data->fd, USBDEVFS_SUBMITURB, entry->urb) != 0 )
+		return -1;
+
+	entry->used = 1;
+	data->pending++;
+	return 0;
+
+}
+
+static int usbfs_bulk_read(struct usb_device_info * dev, int ep, char * bytes, int size, int timeout) {
+
+	struct usbfs * data = dev->transport_data;
+	struct usbdevfs_bulktransfer bulk;
+	int ret;
+
+	bulk.ep = ep;
+	bulk.len = size;
+	bulk.timeout = timeout;
+	bulk.data = bytes;
+
+	ret = ioctl(data->fd, USBDEVFS_BULK, &bulk);
+	if ( ret < 0 )
+		return -1;
+
+	return ret;
+
+}
+
+/* Synchronous write is queued as URB too, so there is no usbfs limit for size of one bulk transfer */
+static int usbfs_bulk_write(struct usb_device_info * dev, int ep, const char * bytes, int size, int timeout) {
+
+	if ( usbfs_flush(dev) != 0 )
+		return -1;
+
+	if ( usbfs_bulk_submit(dev, ep, bytes, size, timeout) != 0 )
+		return -1;
+
+	if ( usbfs_flush(dev) != 0 )
+		return -1;
+
+	return size;
+
+}
+
+/* Buffers mmaped from usbfs are used by kernel directly without copying */
+static void * usbfs_buffer_alloc(struct usb_device_info * dev, size_t size) {
+
+	struct usbfs * data = dev->transport_data;
+	struct usbfs_buffer * buffer = MAP_FAILED;
+
+	if ( data->mmap )
+		buffer = mmap(NULL, size + USBFS_BUFFER_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED, data->fd, 0);
+
+	if ( buffer != MAP_FAILED ) {
+		buffer->mmap = 1;
+	} else {
+		buffer = malloc(size + USBFS_BUFFER_HEADER);
+		if ( ! buffer )
+			return NULL;
+		buffer->mmap = 0;
+	}
+
+	buffer->size = size + USBFS_BUFFER_HEADER;
+	return (char *)buffer + USBFS_BUFFER_HEADER;
+
+}
+
+static void usbfs_buffer_free(struct usb_device_info * dev, void * ptr) {
+
+	struct usbfs_buffer * buffer;
+
+	(void)dev;
+
+	if ( ! ptr )
+		return;
+
+	buffer = (struct usbfs_buffer *)((char *)ptr - USBFS_BUFFER_HEADER);
+
+	if ( buffer->mmap )
+		munmap(buffer, buffer->size);
+	else
+		free(buffer);
+
+}
+
+const struct usb_transport usb_transport_usbfs = {
+	.name = "usbfs",
+	.open = usbfs_open,
+	.close = usbfs_close,
+	.control_msg = usbfs_control_msg,
+	.bulk_read = usbfs_bulk_read,
+	.bulk_write = usbfs_bulk_write,
+	.async = 1,
+	.bulk_submit = usbfs_bulk_submit,
+	.bulk_flush = usbfs_flush,
+	.buffer_alloc = usbfs_buffer_alloc,
+	.buffer_free = usbfs_buffer_free,
+};
+
+#endif
@@ -0,0 +1,535 @@
+/*
+    usbsniff-decode.c - Decoder for binary traces of libusb-sniff
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* usage: usbsniff-decode [-x] [-p file.pcapng] trace */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libusb-sniff.h"
+
+/* NOLO control requests, see nolo.c */
+static const char * nolo_requests[] = {
+	[1] = "status",
+	[3] = "get_nolo_version",
+	[4] = "identify",
+	[5] = "error_log",
+	[16] = "set",
+	[17] = "get",
+	[18] = "string",
+	[19] = "set_string",
+	[20] = "get_string",
+	[66] = "send_image",
+	[67] = "set_sw_release",
+	[80] = "flash_image",
+	[82] = "send_flash_finish",
+	[84] = "send_flash_image",
+	[130] = "boot",
+	[131] = "reboot",
+};
+
+/* Mk II message types, see mkii.c */
+static const char * mkii_messages[] = {
+	[0x00] = "ping",
+	[0x01] = "get",
+	[0x02] = "tell",
+	[0x03] = "image start",
+	[0x04] = "image header",
+	[0x05] = "image transport",
+	[0x06] = "image status",
+	[0x08] = "image data",
+	[0x0B] = "image buffer",
+	[0x0C] = "reboot",
+};
+
+#define MKII_OUT	0x8810001B
+#define MKII_IN		0x8800101B
+#define MKII_RESPONCE	0x20
+
+/* OMAP boot ROM and X-Loader messages, see cold-flash.c */
+static const struct {
+	uint32_t msg;
+	const char * name;
+} omap_messages[] = {
+	{ 0xF0030002, "OMAP peripheral boot" },
+	{ 0xF0030006, "OMAP void boot" },
+	{ 0xF0030106, "OMAP XIP boot" },
+	{ 0xF0030206, "OMAP NAND boot" },
+	{ 0xF0030306, "OMAP OneNAND boot" },
+	{ 0xF0030406, "OMAP DOC boot" },
+	{ 0xF0030506, "OMAP MMC2 boot" },
+	{ 0xF0030606, "OMAP MMC1 boot" },
+	{ 0xF0030706, "OMAP XIP wait boot" },
+	{ 0xF0031006, "OMAP UART boot" },
+	{ 0xF0031106, "OMAP HS USB boot" },
+	{ 0xFFFFFFFF, "OMAP next boot" },
+	{ 0x00000000, "OMAP memory boot" },
+};
+
+#define XLOADER_MSG_TYPE_PING	0x6301326E
+#define XLOADER_MSG_TYPE_SEND	0x6302326E
+
+/* pcapng with LINKTYPE_USB_LINUX_MMAPPED, same as usbmon captures */
+#define PCAPNG_LINKTYPE_USB_LINUX_MMAPPED	220
+
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	int8_t flag_setup;
+	int8_t flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+static int hexdump;
+
+static const char * table_lookup(const char ** table, size_t count, unsigned int index) {
+
+	if ( index >= count )
+		return NULL;
+
+	return table[index];
+
+}
+
+static uint32_t get_le32(const uint8_t * buf) {
+
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+
+}
+
+static void print_string(const uint8_t * buf, size_t size) {
+
+	size_t i;
+
+	putchar('"');
+	for ( i = 0; i < size; ++i ) {
+		if ( buf[i] >= 32 && buf[i] <= 126 && buf[i] != '"' )
+			putchar(buf[i]);
+		else if ( buf[i] == 0 )
+			printf("\\0");
+		else
+			printf("\\x%02x", buf[i]);
+	}
+	putchar('"');
+
+}
+
+static void print_hexdump(const uint8_t * buf, size_t size) {
+
+	size_t i;
+
+	for ( i = 0; i < size; ++i ) {
+		if ( i % 16 == 0 )
+			printf("%s    %04X:", i ? "\n" : "", (unsigned int)i);
+		printf(" %02X", buf[i]);
+	}
+
+	if ( size )
+		printf("\n");
+
+}
+
+static void decode_nolo(const struct usbsniff_trace_record * record, const uint8_t * data) {
+
+	const char * name = table_lookup(nolo_requests, sizeof(nolo_requests)/sizeof(nolo_requests[0]), record->request);
+
+	if ( name )
+		printf("NOLO %s", name);
+	else
+		printf("NOLO request %d", record->request);
+
+	printf(" value=%#x index=%#x", record->value, record->index);
+
+	if ( record->captured && ( record->request == 18 || record->request == 19 || record->request == 20 ) ) {
+		printf(" ");
+		print_string(data, record->captured);
+	}
+
+}
+
+static int decode_mkii(const struct usbsniff_trace_record * record, const uint8_t * data) {
+
+	uint32_t header;
+	uint8_t type;
+	const char * name;
+
+	if ( record->captured < 10 )
+		return 0;
+
+	header = get_le32(data);
+	if ( header != MKII_OUT && header != MKII_IN )
+		return 0;
+
+	type = data[9];
+	name = table_lookup(mkii_messages, sizeof(mkii_messages)/sizeof(mkii_messages[0]), type & ~MKII_RESPONCE);
+
+	if ( name )
+		printf("Mk II %s", name);
+	else
+		printf("Mk II message %#x", type & ~MKII_RESPONCE);
+
+	printf("%s #%d size=%d", ( type & MKII_RESPONCE ) ? " response" : "", data[8], (data[4] << 8) | data[5]);
+
+	if ( record->captured > 10 ) {
+		printf(" ");
+		print_string(data + 10, record->captured - 10);
+	}
+
+	return 1;
+
+}
+
+static int decode_cold_flash(const struct usbsniff_trace_record * record, const uint8_t * data) {
+
+	uint32_t msg;
+	size_t i;
+
+	if ( record->ep & 0x80 ) {
+		if ( record->ret == 69 ) {
+			printf("ASIC ID");
+			return 1;
+		}
+		return 0;
+	}
+
+	if ( record->size == 4 && record->captured == 4 ) {
+		msg = get_le32(data);
+		for ( i = 0; i < sizeof(omap_messages)/sizeof(omap_messages[0]); ++i ) {
+			if ( omap_messages[i].msg == msg ) {
+				printf("%s message", omap_messages[i].name);
+				return 1;
+			}
+		}
+		printf("Image size %u", msg);
+		return 1;
+	}
+
+	if ( record->size == 16 && record->captured == 16 ) {
+		msg = get_le32(data);
+		if ( msg == XLOADER_MSG_TYPE_PING ) {
+			printf("X-Loader ping message");
+			return 1;
+		} else if ( msg == XLOADER_MSG_TYPE_SEND ) {
+			printf("X-Loader send message size=%u crc=%#08x", get_le32(data + 4), get_le32(data + 8));
+			return 1;
+		}
+	}
+
+	return 0;
+
+}
+
+static void decode_record(const struct usbsniff_trace_record * record, uint64_t first) {
+
+	const uint8_t * data = (const uint8_t *)(record + 1);
+	int in;
+
+	if ( record->type == USBSNIFF_TRACE_FLUSH ) {
+		printf("%12.6f %9.3fms flush   ret=%d\n", (double)( record->start - first ) / 1e9, (double)( record->end - record->start ) / 1e6, record->ret);
+		return;
+	}
+
+	in = ( record->ep & 0x80 ) != 0;
+
+	printf("%12.6f %9.3fms %-7s %s ep=0x%02x size=%-7d ret=%-7d ",
+		(double)( record->start - first ) / 1e9,
+		(double)( record->end - record->start ) / 1e6,
+		record->type == USBSNIFF_TRACE_CONTROL ? "control" : "bulk",
+		in ? "in " : "out",
+		record->ep,
+		record->size,
+		record->ret);
+
+	if ( record->type == USBSNIFF_TRACE_CONTROL )
+		decode_nolo(record, data);
+	else if ( ! decode_mkii(record, data) && ! decode_cold_flash(record, data) )
+		printf("data");
+
+	printf("\n");
+
+	if ( hexdump )
+		print_hexdump(data, record->captured);
+
+}
+
+static int write_block(FILE * file, uint32_t type, const void * body, uint32_t body_size, const void * data, uint32_t data_size) {
+
+	static const uint8_t padding[4];
+	uint32_t pad = ( 4 - data_size % 4 ) % 4;
+	uint32_t size = 12 + body_size + data_size + pad;
+
+	if ( fwrite(&type, 4, 1, file) != 1 || fwrite(&size, 4, 1, file) != 1 )
+		return -1;
+
+	if ( body_size && fwrite(body, body_size, 1, file) != 1 )
+		return -1;
+
+	if ( data_size && fwrite(data, data_size, 1, file) != 1 )
+		return -1;
+
+	if ( pad && fwrite(padding, pad, 1, file) != 1 )
+		return -1;
+
+	if ( fwrite(&size, 4, 1, file) != 1 )
+		return -1;
+
+	return 0;
+
+}
+
+static int pcapng_header(FILE * file) {
+
+	struct {
+		uint32_t byte_order;
+		uint16_t major;
+		uint16_t minor;
+		int64_t section_length;
+	} shb = { 0x1A2B3C4D, 1, 0, -1 };
+
+	struct {
+		uint16_t linktype;
+		uint16_t reserved;
+		uint32_t snaplen;
+	} idb = { PCAPNG_LINKTYPE_USB_LINUX_MMAPPED, 0, 0 };
+
+	if ( write_block(file, 0x0A0D0D0A, &shb, sizeof(shb), NULL, 0) != 0 )
+		return -1;
+
+	return write_block(file, 0x00000001, &idb, sizeof(idb), NULL, 0);
+
+}
+
+/* Every transfer is written as usbmon submit and complete event */
+static int pcapng_packet(FILE * file, const struct usbsniff_trace_header * header, const struct usbsniff_trace_record * record, int complete) {
+
+	struct usbmon_packet packet;
+	uint8_t buf[sizeof(packet) + USBSNIFF_TRACE_PAYLOAD_MAX];
+	uint64_t time;
+	uint32_t data_size = 0;
+	int in = ( record->ep & 0x80 ) != 0;
+
+	struct {
+		uint32_t interface;
+		uint32_t time_high;
+		uint32_t time_low;
+		uint32_t captured;
+		uint32_t length;
+	} epb;
+
+	time = ( complete ? record->end : record->start ) + header->realtime_offset;
+
+	memset(&packet, 0, sizeof(packet));
+	packet.id = record->seq;
+	packet.type = complete ? 'C' : 'S';
+	packet.xfer_type = record->type;
+	packet.epnum = record->ep;
+	packet.devnum = 1;
+	packet.busnum = 1;
+	packet.flag_setup = '-';
+	packet.flag_data = complete ? '>' : '<';
+	packet.ts_sec = time / 1000000000;
+	packet.ts_usec = ( time % 1000000000 ) / 1000;
+
+	if ( record->type == USBSNIFF_TRACE_CONTROL && ! complete ) {
+		packet.flag_setup = 0;
+		packet.setup[0] = record->requesttype;
+		packet.setup[1] = record->request;
+		packet.setup[2] = record->value & 0xFF;
+		packet.setup[3] = record->value >> 8;
+		packet.setup[4] = record->index & 0xFF;
+		packet.setup[5] = record->index >> 8;
+		packet.setup[6] = record->size & 0xFF;
+		packet.setup[7] = ( record->size >> 8 ) & 0xFF;
+	}
+
+	if ( complete ) {
+		packet.status = ( record->ret < 0 ) ? record->ret : 0;
+		packet.length = ( record->ret < 0 ) ? 0 : record->ret;
+		if ( in )
+			data_size = record->captured;
+	} else {
+		packet.status = -115; /* -EINPROGRESS */
+		packet.length = record->size;
+		if ( ! in )
+			data_size = record->captured;
+	}
+
+	if ( data_size )
+		packet.flag_data = 0;
+
+	packet.len_cap = data_size;
+
+	memcpy(buf, &packet, sizeof(packet));
+	memcpy(buf + sizeof(packet), record + 1, data_size);
+
+	epb.interface = 0;
+	epb.time_high = ( time / 1000 ) >> 32;
+	epb.time_low = ( time / 1000 ) & 0xFFFFFFFF;
+	epb.captured = sizeof(packet) + data_size;
+	epb.length = sizeof(packet);
+	if ( in == complete )
+		epb.length += packet.length;
+
+	return write_block(file, 0x00000006, &epb, sizeof(epb), buf, sizeof(packet) + data_size);
+
+}
+
+static int compare_records(const void * a, const void * b) {
+
+	const struct usbsniff_trace_record * ra = *(const struct usbsniff_trace_record * const *)a;
+	const struct usbsniff_trace_record * rb = *(const struct usbsniff_trace_record * const *)b;
+
+	if ( ra->seq < rb->seq )
+		return -1;
+	else if ( ra->seq > rb->seq )
+		return 1;
+	else
+		return 0;
+
+}
+
+int main(int argc, char **argv) {
+
+	const struct usbsniff_trace_header * header;
+	const struct usbsniff_trace_record ** records;
+	const struct usbsniff_trace_record * record;
+	const char * pcapng = NULL;
+	FILE * file = NULL;
+	struct stat st;
+	void * map;
+	size_t count = 0;
+	size_t i;
+	int ret = 1;
+	int fd;
+	int c;
+
+	while ( ( c = getopt(argc, argv, "xp:") ) != -1 ) {
+		switch ( c ) {
+			case 'x':
+				hexdump = 1;
+				break;
+			case 'p':
+				pcapng = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-x] [-p file.pcapng] trace\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if ( optind + 1 != argc ) {
+		fprintf(stderr, "Usage: %s [-x] [-p file.pcapng] trace\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if ( fd < 0 || fstat(fd, &st) != 0 ) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if ( (size_t)st.st_size < sizeof(*header) ) {
+		fprintf(stderr, "%s: Trace file is too small\n", argv[optind]);
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	header = map;
+
+	if ( memcmp(header->magic, USBSNIFF_TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != USBSNIFF_TRACE_VERSION || header->byte_order != USBSNIFF_TRACE_BYTE_ORDER ) {
+		fprintf(stderr, "%s: Unsupported trace file\n", argv[optind]);
+		goto clean;
+	}
+
+	if ( header->slot_size < sizeof(*record) + header->payload_size || header->payload_size > USBSNIFF_TRACE_PAYLOAD_MAX || header->header_size + (uint64_t)header->slot_count * header->slot_size > (uint64_t)st.st_size ) {
+		fprintf(stderr, "%s: Corrupted trace file\n", argv[optind]);
+		goto clean;
+	}
+
+	records = calloc(header->slot_count, sizeof(*records));
+	if ( ! records ) {
+		perror("calloc");
+		goto clean;
+	}
+
+	for ( i = 0; i < header->slot_count; ++i ) {
+		record = (const struct usbsniff_trace_record *)((const char *)header + header->header_size + i * header->slot_size);
+		if ( record->seq && record->captured <= header->payload_size )
+			records[count++] = record;
+	}
+
+	qsort(records, count, sizeof(*records), compare_records);
+
+	printf("Trace of process %u: %llu transfers, %llu in ring\n", header->pid, (unsigned long long int)header->next_seq, (unsigned long long int)count);
+
+	if ( pcapng ) {
+		file = fopen(pcapng, "wb");
+		if ( ! file || pcapng_header(file) != 0 ) {
+			perror(pcapng);
+			goto clean_records;
+		}
+	}
+
+	for ( i = 0; i < count; ++i ) {
+		decode_record(records[i], records[0]->start);
+		if ( file && records[i]->type != USBSNIFF_TRACE_FLUSH && ( pcapng_packet(file, header, records[i], 0) != 0 || pcapng_packet(file, header, records[i], 1) != 0 ) ) {
+			perror(pcapng);
+			goto clean_records;
+		}
+	}
+
+	ret = 0;
+
+clean_records:
+	if ( file && fclose(file) != 0 ) {
+		perror(pcapng);
+		ret = 1;
+	}
+	free(records);
+clean:
+	munmap(map, st.st_size);
+	return ret;
+
+}
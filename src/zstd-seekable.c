@@ -0,0 +1,616 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <zstd.h>
+
+#include "global.h"
+#include "zstd-seekable.h"
+
+#define ZSTD_SEEKABLE_MAGIC	0x8F92EAB1
+#define ZSTD_SEEKABLE_SKIPPABLE	0x184D2A5E	/* magic of skippable frame with seek table */
+#define ZSTD_SEEKABLE_FOOTER	9	/* number of frames, descriptor and magic */
+#define ZSTD_SEEKABLE_CHECKSUM	0x80	/* descriptor flag, entries contain checksum */
+#define ZSTD_SEEKABLE_RESERVED	0x7C
+
+#define ZSTD_SEEKABLE_LEVEL	3
+#define ZSTD_SEEKABLE_THREADS	8
+
+enum zstd_seekable_state {
+	ZSTD_SEEKABLE_FREE,
+	ZSTD_SEEKABLE_READY,	/* filled by producer */
+	ZSTD_SEEKABLE_BUSY,	/* compressed by worker */
+	ZSTD_SEEKABLE_DONE,	/* waiting for writing */
+};
+
+struct zstd_seekable_slot {
+	enum zstd_seekable_state state;
+	char * in;
+	size_t in_size;
+	char * out;
+	size_t out_size;
+};
+
+/* Frame with sequence number seq is in slot seq % count */
+struct zstd_seekable_writer {
+	int fd;
+	size_t frame_size;
+	size_t bound;
+	int threads;
+	pthread_t workers[ZSTD_SEEKABLE_THREADS];
+	pthread_t thread;	/* writes compressed frames in order */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct zstd_seekable_slot * slots;
+	int count;
+	uint64_t next_fill;
+	uint64_t next_compress;
+	uint64_t next_write;
+	uint32_t * table;	/* compressed and decompressed size of every written frame */
+	uint32_t frames;
+	uint32_t table_alloc;
+	uint64_t compressed;
+	int stop;
+	int error;	/* errno of first failure */
+};
+
+struct zstd_seekable_reader {
+	int fd;
+	uint32_t frames;
+	uint64_t * offsets;	/* offset of every frame in file and end of last frame */
+	uint64_t * positions;	/* offset of every frame in decompressed data and size of data */
+	ZSTD_DCtx * dctx;
+	char * in;
+	char * out;
+	uint32_t cached;	/* frame decompressed in out, frames for none */
+};
+
+static void zstd_seekable_put32(unsigned char * buf, uint32_t value) {
+
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+
+}
+
+static uint32_t zstd_seekable_get32(const unsigned char * buf) {
+
+	return buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+
+}
+
+static int zstd_seekable_write(int fd, const void * buf, size_t size) {
+
+	ssize_t ret;
+
+	while ( size > 0 ) {
+		ret = write(fd, buf, size);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			if ( ret == 0 )
+				errno = ENOSPC;
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		size -= ret;
+	}
+
+	return 0;
+
+}
+
+static int zstd_seekable_pread(int fd, void * buf, size_t size, uint64_t offset) {
+
+	ssize_t ret;
+
+	while ( size > 0 ) {
+		ret = pread(fd, buf, size, offset);
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 ) {
+			if ( ret == 0 )
+				errno = EIO;
+			return -1;
+		}
+		buf = (char *)buf + ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+
+}
+
+static void * zstd_seekable_worker(void * arg) {
+
+	struct zstd_seekable_writer * writer = arg;
+	struct zstd_seekable_slot * slot;
+	ZSTD_CCtx * cctx;
+	size_t ret = 0;
+
+	cctx = ZSTD_createCCtx();
+	if ( cctx ) {
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_SEEKABLE_LEVEL);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	}
+
+	pthread_mutex_lock(&writer->lock);
+
+	while ( 1 ) {
+
+		while ( writer->next_compress == writer->next_fill && ! writer->stop )
+			pthread_cond_wait(&writer->cond, &writer->lock);
+
+		if ( writer->next_compress == writer->next_fill )
+			break;
+
+		slot = &writer->slots[writer->next_compress++ % writer->count];
+		slot->state = ZSTD_SEEKABLE_BUSY;
+
+		pthread_mutex_unlock(&writer->lock);
+
+		if ( cctx )
+			ret = ZSTD_compress2(cctx, slot->out, writer->bound, slot->in, slot->in_size);
+
+		pthread_mutex_lock(&writer->lock);
+
+		if ( ! cctx || ZSTD_isError(ret) ) {
+			if ( ! writer->error )
+				writer->error = cctx ? EIO : ENOMEM;
+			slot->out_size = 0;
+		} else {
+			slot->out_size = ret;
+		}
+
+		slot->state = ZSTD_SEEKABLE_DONE;
+		pthread_cond_broadcast(&writer->cond);
+
+	}
+
+	pthread_mutex_unlock(&writer->lock);
+
+	ZSTD_freeCCtx(cctx);
+	return NULL;
+
+}
+
+static void * zstd_seekable_thread(void * arg) {
+
+	struct zstd_seekable_writer * writer = arg;
+	struct zstd_seekable_slot * slot;
+	uint32_t * table;
+	int error;
+
+	pthread_mutex_lock(&writer->lock);
+
+	while ( 1 ) {
+
+		slot = &writer->slots[writer->next_write % writer->count];
+
+		while ( ( writer->next_write == writer->next_fill && ! writer->stop ) || ( writer->next_write != writer->next_fill && slot->state != ZSTD_SEEKABLE_DONE ) )
+			pthread_cond_wait(&writer->cond, &writer->lock);
+
+		if ( writer->next_write == writer->next_fill )
+			break;
+
+		/* After failure remaining frames are only released */
+		error = writer->error;
+
+		pthread_mutex_unlock(&writer->lock);
+
+		if ( ! error && zstd_seekable_write(writer->fd, slot->out, slot->out_size) != 0 )
+			error = errno;
+
+		pthread_mutex_lock(&writer->lock);
+
+		if ( ! error && writer->frames == writer->table_alloc ) {
+			table = realloc(writer->table, ( writer->table_alloc ? writer->table_alloc * 2 : 64 ) * 2 * sizeof(uint32_t));
+			if ( table ) {
+				writer->table = table;
+				writer->table_alloc = writer->table_alloc ? writer->table_alloc * 2 : 64;
+			} else {
+				error = ENOMEM;
+			}
+		}
+
+		if ( error && ! writer->error )
+			writer->error = error;
+
+		if ( ! writer->error ) {
+			writer->table[writer->frames * 2] = slot->out_size;
+			writer->table[writer->frames * 2 + 1] = slot->in_size;
+			writer->frames++;
+			writer->compressed += slot->out_size;
+		}
+
+		slot->state = ZSTD_SEEKABLE_FREE;
+		writer->next_write++;
+		pthread_cond_broadcast(&writer->cond);
+
+	}
+
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+
+}
+
+static void zstd_seekable_writer_free(struct zstd_seekable_writer * writer) {
+
+	int i;
+
+	for ( i = 0; i < writer->count; ++i ) {
+		free(writer->slots[i].in);
+		free(writer->slots[i].out);
+	}
+
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->cond);
+	free(writer->slots);
+	free(writer->table);
+	free(writer);
+
+}
+
+/* Stop and join threads, returns errno of first failure */
+static int zstd_seekable_writer_stop(struct zstd_seekable_writer * writer, int workers, int thread) {
+
+	int i;
+
+	pthread_mutex_lock(&writer->lock);
+	writer->stop = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+
+	for ( i = 0; i < workers; ++i )
+		pthread_join(writer->workers[i], NULL);
+
+	if ( thread )
+		pthread_join(writer->thread, NULL);
+
+	return writer->error;
+
+}
+
+struct zstd_seekable_writer * zstd_seekable_writer_start(int fd, size_t frame_size) {
+
+	struct zstd_seekable_writer * writer;
+	long cpus;
+	int i;
+
+	writer = calloc(1, sizeof(*writer));
+	if ( ! writer )
+		ALLOC_ERROR_RETURN(NULL);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( cpus < 1 )
+		cpus = 1;
+	if ( cpus > ZSTD_SEEKABLE_THREADS )
+		cpus = ZSTD_SEEKABLE_THREADS;
+
+	writer->fd = fd;
+	writer->frame_size = frame_size;
+	writer->bound = ZSTD_compressBound(frame_size);
+	writer->threads = cpus;
+	/* Every worker has one frame, one is filled by producer and one is written */
+	writer->count = writer->threads + 2;
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	writer->slots = calloc(writer->count, sizeof(*writer->slots));
+	if ( ! writer->slots ) {
+		zstd_seekable_writer_free(writer);
+		ALLOC_ERROR_RETURN(NULL);
+	}
+
+	for ( i = 0; i < writer->count; ++i ) {
+		writer->slots[i].in = malloc(frame_size);
+		writer->slots[i].out = malloc(writer->bound);
+		if ( ! writer->slots[i].in || ! writer->slots[i].out ) {
+			zstd_seekable_writer_free(writer);
+			ALLOC_ERROR_RETURN(NULL);
+		}
+	}
+
+	if ( pthread_create(&writer->thread, NULL, zstd_seekable_thread, writer) != 0 ) {
+		zstd_seekable_writer_free(writer);
+		ERROR_RETURN("Cannot create writer thread", NULL);
+	}
+
+	for ( i = 0; i < writer->threads; ++i ) {
+		if ( pthread_create(&writer->workers[i], NULL, zstd_seekable_worker, writer) != 0 ) {
+			zstd_seekable_writer_stop(writer, i, 1);
+			zstd_seekable_writer_free(writer);
+			ERROR_RETURN("Cannot create compression thread", NULL);
+		}
+	}
+
+	VERBOSE("Compressing with %d threads\n", writer->threads);
+
+	return writer;
+
+}
+
+char * zstd_seekable_writer_buffer(struct zstd_seekable_writer * writer) {
+
+	struct zstd_seekable_slot * slot;
+
+	pthread_mutex_lock(&writer->lock);
+	slot = &writer->slots[writer->next_fill % writer->count];
+	while ( slot->state != ZSTD_SEEKABLE_FREE )
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	pthread_mutex_unlock(&writer->lock);
+
+	return slot->in;
+
+}
+
+int zstd_seekable_writer_queue(struct zstd_seekable_writer * writer, size_t size) {
+
+	struct zstd_seekable_slot * slot;
+	int ret;
+
+	pthread_mutex_lock(&writer->lock);
+	slot = &writer->slots[writer->next_fill % writer->count];
+	slot->in_size = size;
+	slot->state = ZSTD_SEEKABLE_READY;
+	writer->next_fill++;
+	pthread_cond_broadcast(&writer->cond);
+	ret = writer->error ? -1 : 0;
+	pthread_mutex_unlock(&writer->lock);
+
+	return ret;
+
+}
+
+int zstd_seekable_writer_finish(struct zstd_seekable_writer * writer, uint64_t * compressed) {
+
+	unsigned char * table;
+	size_t size;
+	uint32_t i;
+	int error;
+
+	error = zstd_seekable_writer_stop(writer, writer->threads, 1);
+
+	if ( ! error ) {
+
+		size = 8 + writer->frames * 8 + ZSTD_SEEKABLE_FOOTER;
+		table = malloc(size);
+
+		if ( table ) {
+			zstd_seekable_put32(table, ZSTD_SEEKABLE_SKIPPABLE);
+			zstd_seekable_put32(table + 4, size - 8);
+			for ( i = 0; i < writer->frames; ++i ) {
+				zstd_seekable_put32(table + 8 + i * 8, writer->table[i * 2]);
+				zstd_seekable_put32(table + 8 + i * 8 + 4, writer->table[i * 2 + 1]);
+			}
+			zstd_seekable_put32(table + size - 9, writer->frames);
+			table[size - 5] = 0;
+			zstd_seekable_put32(table + size - 4, ZSTD_SEEKABLE_MAGIC);
+			if ( zstd_seekable_write(writer->fd, table, size) != 0 )
+				error = errno;
+			else
+				writer->compressed += size;
+			free(table);
+		} else {
+			error = ENOMEM;
+		}
+
+	}
+
+	if ( compressed )
+		*compressed = writer->compressed;
+
+	zstd_seekable_writer_free(writer);
+
+	if ( error ) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+
+}
+
+struct zstd_seekable_reader * zstd_seekable_reader_open(int fd) {
+
+	struct zstd_seekable_reader * reader;
+	unsigned char footer[ZSTD_SEEKABLE_FOOTER];
+	unsigned char header[8];
+	unsigned char * entries;
+	struct stat st;
+	uint64_t table_size;
+	uint64_t in_max = 0;
+	uint64_t out_max = 0;
+	uint32_t frames;
+	uint32_t entry;
+	uint32_t i;
+
+	if ( fstat(fd, &st) != 0 || st.st_size < (off_t)(8 + ZSTD_SEEKABLE_FOOTER) )
+		return NULL;
+
+	if ( zstd_seekable_pread(fd, footer, sizeof(footer), st.st_size - sizeof(footer)) != 0 )
+		return NULL;
+
+	if ( zstd_seekable_get32(footer + 5) != ZSTD_SEEKABLE_MAGIC || ( footer[4] & ZSTD_SEEKABLE_RESERVED ) )
+		return NULL;
+
+	frames = zstd_seekable_get32(footer);
+	entry = ( footer[4] & ZSTD_SEEKABLE_CHECKSUM ) ? 12 : 8;
+	table_size = (uint64_t)frames * entry + ZSTD_SEEKABLE_FOOTER;
+
+	if ( table_size + 8 > (uint64_t)st.st_size )
+		return NULL;
+
+	if ( zstd_seekable_pread(fd, header, sizeof(header), st.st_size - table_size - 8) != 0 )
+		return NULL;
+
+	if ( zstd_seekable_get32(header) != ZSTD_SEEKABLE_SKIPPABLE || zstd_seekable_get32(header + 4) != table_size )
+		return NULL;
+
+	reader = calloc(1, sizeof(*reader));
+	entries = malloc(table_size);
+	if ( reader ) {
+		reader->offsets = malloc(( frames + 1 ) * sizeof(uint64_t));
+		reader->positions = malloc(( frames + 1 ) * sizeof(uint64_t));
+	}
+
+	if ( ! reader || ! entries || ! reader->offsets || ! reader->positions ) {
+		ALLOC_ERROR();
+		free(entries);
+		zstd_seekable_reader_close(reader);
+		return NULL;
+	}
+
+	reader->fd = fd;
+	reader->frames = frames;
+	reader->cached = frames;
+
+	if ( zstd_seekable_pread(fd, entries, table_size, st.st_size - table_size) != 0 ) {
+		free(entries);
+		zstd_seekable_reader_close(reader);
+		return NULL;
+	}
+
+	reader->offsets[0] = 0;
+	reader->positions[0] = 0;
+	for ( i = 0; i < frames; ++i ) {
+		reader->offsets[i + 1] = reader->offsets[i] + zstd_seekable_get32(entries + i * entry);
+		reader->positions[i + 1] = reader->positions[i] + zstd_seekable_get32(entries + i * entry + 4);
+		if ( reader->offsets[i + 1] - reader->offsets[i] > in_max )
+			in_max = reader->offsets[i + 1] - reader->offsets[i];
+		if ( reader->positions[i + 1] - reader->positions[i] > out_max )
+			out_max = reader->positions[i + 1] - reader->positions[i];
+	}
+
+	free(entries);
+
+	/* Frames must exactly fill file up to seek table */
+	if ( reader->offsets[frames] != st.st_size - table_size - 8 ) {
+		zstd_seekable_reader_close(reader);
+		return NULL;
+	}
+
+	reader->in = malloc(in_max ? in_max : 1);
+	reader->out = malloc(out_max ? out_max : 1);
+	reader->dctx = ZSTD_createDCtx();
+	if ( ! reader->in || ! reader->out || ! reader->dctx ) {
+		ALLOC_ERROR();
+		zstd_seekable_reader_close(reader);
+		return NULL;
+	}
+
+	return reader;
+
+}
+
+uint64_t zstd_seekable_reader_size(struct zstd_seekable_reader * reader) {
+
+	return reader->positions[reader->frames];
+
+}
+
+/* Last frame which starts at or before offset */
+static uint32_t zstd_seekable_reader_frame(struct zstd_seekable_reader * reader, uint64_t offset) {
+
+	uint32_t low = 0;
+	uint32_t high = reader->frames - 1;
+	uint32_t mid;
+
+	while ( low < high ) {
+		mid = low + ( high - low + 1 ) / 2;
+		if ( reader->positions[mid] <= offset )
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return low;
+
+}
+
+ssize_t zstd_seekable_reader_pread(struct zstd_seekable_reader * reader, void * buf, size_t count, uint64_t offset) {
+
+	size_t done = 0;
+	size_t len;
+	size_t ret;
+	uint64_t size;
+	uint32_t frame;
+
+	while ( count > 0 && offset < zstd_seekable_reader_size(reader) ) {
+
+		frame = zstd_seekable_reader_frame(reader, offset);
+
+		if ( reader->cached != frame ) {
+			reader->cached = reader->frames;
+			size = reader->positions[frame + 1] - reader->positions[frame];
+			if ( zstd_seekable_pread(reader->fd, reader->in, reader->offsets[frame + 1] - reader->offsets[frame], reader->offsets[frame]) != 0 ) {
+				ERROR_INFO("Cannot read compressed frame %u", (unsigned int)frame);
+				return -1;
+			}
+			ret = ZSTD_decompressDCtx(reader->dctx, reader->out, size, reader->in, reader->offsets[frame + 1] - reader->offsets[frame]);
+			if ( ZSTD_isError(ret) || ret != size ) {
+				ERROR("Cannot decompress frame %u: %s", (unsigned int)frame, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "Wrong size");
+				return -1;
+			}
+			reader->cached = frame;
+		}
+
+		len = reader->positions[frame + 1] - offset;
+		if ( len > count )
+			len = count;
+
+		memcpy(buf, reader->out + ( offset - reader->positions[frame] ), len);
+		buf = (char *)buf + len;
+		count -= len;
+		offset += len;
+		done += len;
+
+	}
+
+	return done;
+
+}
+
+void zstd_seekable_reader_close(struct zstd_seekable_reader * reader) {
+
+	if ( ! reader )
+		return;
+
+	ZSTD_freeDCtx(reader->dctx);
+	free(reader->offsets);
+	free(reader->positions);
+	free(reader->in);
+	free(reader->out);
+	free(reader);
+
+}
@@ -0,0 +1,62 @@
+/*
+    0xFFFF - Open Free Fiasco Firmware Flasher
+    Copyright (C) 2012  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSTD_SEEKABLE_H
+#define ZSTD_SEEKABLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Zstandard seekable format: every chunk of data is compressed to independent
+  frame and file ends with skippable frame which contains seek table (compressed
+  and decompressed size of every frame). Files can be decompressed by any zstd
+  tool and read from any offset without decompressing previous data.
+
+  Writer compresses frames by pool of worker threads and separate thread writes
+  them in order, so producer only waits when all buffers are in use.
+*/
+
+struct zstd_seekable_writer;
+struct zstd_seekable_reader;
+
+/* Start writer to fd, every frame contains at most frame_size bytes */
+struct zstd_seekable_writer * zstd_seekable_writer_start(int fd, size_t frame_size);
+
+/* Returns buffer of frame_size bytes for next frame, waits until some buffer is free */
+char * zstd_seekable_writer_buffer(struct zstd_seekable_writer * writer);
+
+/* Queue buffer returned by zstd_seekable_writer_buffer() with size bytes, returns -1 when some previous frame failed */
+int zstd_seekable_writer_queue(struct zstd_seekable_writer * writer, size_t size);
+
+/* Write all queued frames and seek table, free writer, returns -1 on error */
+int zstd_seekable_writer_finish(struct zstd_seekable_writer * writer, uint64_t * compressed);
+
+/* Returns NULL when fd is not in seekable format, fd is not closed by reader */
+struct zstd_seekable_reader * zstd_seekable_reader_open(int fd);
+
+/* Size of decompressed data */
+uint64_t zstd_seekable_reader_size(struct zstd_seekable_reader * reader);
+
+/* Read decompressed data from offset, returns number of read bytes or -1 on error */
+ssize_t zstd_seekable_reader_pread(struct zstd_seekable_reader * reader, void * buf, size_t count, uint64_t offset);
+
+void zstd_seekable_reader_close(struct zstd_seekable_reader * reader);
+
+#endif